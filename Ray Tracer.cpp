@@ -1,50 +1,117 @@
-#include <iostream>
+#include "rtweekend.h"
+
+#include "batch.h"
+#include "benchmark.h"
+#include "cluster_file.h"
+#include "preview_server.h"
+#include "render_task.h"
+#include "renderer.h"
+#include "scene.h"
+#include "watch.h"
+
 #include <fstream>
+#include <iostream>
+#include <string>
 
-int main()
+// Usage:
+//      "Ray Tracer.exe" [scene file] [output file]     renders a scene (default scenes/default.scene to output/imageOut.ppm)
+//      "Ray Tracer.exe" --watch scene [output file]     renders progressively, restarting whenever the scene file is saved
+//      "Ray Tracer.exe" --batch manifest               renders every image listed in a manifest (see batch.h)
+//      "Ray Tracer.exe" --serve [port] [scene file]    serves previews to a viewer on this machine (default port 5432)
+//      "Ray Tracer.exe" --pack scene clusters [size]   writes a scene's spheres to a cluster file, for a geometry statement
+//      "Ray Tracer.exe" --bench                        runs the timing benchmarks instead
+int main(int argc, char* argv[])
 {
-    // Image
-    int image_width = 256;
-    int image_height = 256;
+    if (argc > 1 && std::string(argv[1]) == "--bench")
+    {
+        run_benchmarks(std::cout);
+        return 0;
+    }
 
-    // Render
-    // define an output file
-    std::ofstream imageOut("output/imageOut.ppm");
-    // add header for image file
-    imageOut << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+    if (argc > 2 && std::string(argv[1]) == "--watch")
+    {
+        try
+        {
+            watch_and_render(argv[2], argc > 3 ? argv[3] : "output/imageOut.ppm");
+        }
+        catch (const scene_error& error)
+        {
+            std::cerr << "Couldn't load scene: " << error.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
 
+    if (argc > 2 && std::string(argv[1]) == "--batch")
+    {
+        try
+        {
+            renderer batch_renderer;
+            render_batch(argv[2], batch_renderer);
+        }
+        catch (const scene_error& error)
+        {
+            std::cerr << "Couldn't load batch: " << error.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
 
-    // for loop works across each column (i) in a row (j) at a time
-    // outer loop for rows
-    for (int j = 0; j < image_height; j++)
+    if (argc > 3 && std::string(argv[1]) == "--pack")
     {
-        // outputs number of rows remaining. Refreshed each loop.
-        std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-
-        // inner loop for columns
-        for (int i = 0; i < image_width; i++)
-        {
-            // Column index divided by total image width to get a colour value between 0 and 1.
-            // Image_width must be reduced by one as first (left-most) pixel is index 0
-            // and last (right-most) pixel is index 255
-            // 
-            // Pixels are least red on the left, most red on the right.
-            auto r = double(i) / (image_width - 1);
-            // Pixels are least green at the top, most green at the bottom.
-            auto g = double(j) / (image_height - 1);
-            // Pixels always have zero blue input.
-            auto b = 0.0;
-
-            // Integer value, converting the above 0 to 1 values to 0 to 256.
-            int ir = int(255.999 * r);
-            int ig = int(255.999 * g);
-            int ib = int(255.999 * b);
-
-            // Outputs each pixel's RGB values from 0 to 255 to the file.
-            imageOut << ir << ' ' << ig << ' ' << ib << '\n';
+        try
+        {
+            auto clusters = write_cluster_file(read_text_file(argv[2]), argv[3], argc > 4 ? std::stoul(argv[4]) : 4096);
+            std::clog << "Wrote " << clusters << " clusters to " << argv[3] << '\n';
         }
+        catch (const scene_error& error)
+        {
+            std::cerr << "Couldn't pack scene: " << error.what() << '\n';
+            return 1;
+        }
+        return 0;
     }
 
-    std::clog << "\rDone.               \n";
-}
+    if (argc > 1 && std::string(argv[1]) == "--serve")
+    {
+        try
+        {
+            serve_previews(argc > 2 ? std::stoi(argv[2]) : 5432, argc > 3 ? argv[3] : "");
+        }
+        catch (const scene_error& error)
+        {
+            std::cerr << "Couldn't load scene: " << error.what() << '\n';
+            return 1;
+        }
+        catch (const socket_error& error)
+        {
+            std::cerr << "Couldn't serve previews: " << error.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
 
+    std::string scene_path = argc > 1 ? argv[1] : "scenes/default.scene";
+    std::string output_path = argc > 2 ? argv[2] : "output/imageOut.ppm";
+
+    renderer scene_renderer;
+    try
+    {
+        const auto& loaded = scene_renderer.load_scene_file(scene_path);
+
+        framebuffer image;
+        render_task task(priority_final);
+        scene_renderer.render(loaded, image, true, &task);
+
+        // define an output file
+        std::ofstream imageOut(output_path);
+        image.write_ppm(imageOut);
+    }
+    catch (const scene_error& error)
+    {
+        std::cerr << "Couldn't load scene: " << error.what() << '\n';
+        return 1;
+    }
+
+    std::clog << "\rDone.                 \n";
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#ifndef AABB_H
+#define AABB_H
+
+#include "rtweekend.h"
+
+// SSE2 is always there on x64, and on 32-bit x86 when the compiler is told it can use it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define AABB_USE_SSE2 1
+	#include <emmintrin.h>
+#endif
+
+/// <summary>
+/// Axis-aligned bounding box, stored as its minimum and maximum corners.
+/// The default box is empty (minimum = +infinity, maximum = -infinity), so expanding it
+/// by anything just gives that thing's bounds.
+/// </summary>
+class aabb
+{
+public:
+	point3 minimum;
+	point3 maximum;
+
+	// Default constructor, makes an empty box
+	aabb() : minimum(infinity, infinity, infinity), maximum(-infinity, -infinity, -infinity) {}
+
+	// Treats a and b as opposite corners of the box, in any order
+	aabb(const point3& a, const point3& b)
+		: minimum(std::fmin(a[0], b[0]), std::fmin(a[1], b[1]), std::fmin(a[2], b[2])),
+		  maximum(std::fmax(a[0], b[0]), std::fmax(a[1], b[1]), std::fmax(a[2], b[2]))
+	{
+	}
+
+	// Makes the box surrounding two boxes (their union)
+	aabb(const aabb& a, const aabb& b)
+		: minimum(std::fmin(a.minimum[0], b.minimum[0]), std::fmin(a.minimum[1], b.minimum[1]), std::fmin(a.minimum[2], b.minimum[2])),
+		  maximum(std::fmax(a.maximum[0], b.maximum[0]), std::fmax(a.maximum[1], b.maximum[1]), std::fmax(a.maximum[2], b.maximum[2]))
+	{
+	}
+
+	// Grows the box to contain the point p
+	void expand(const point3& p)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			minimum[axis] = std::fmin(minimum[axis], p[axis]);
+			maximum[axis] = std::fmax(maximum[axis], p[axis]);
+		}
+	}
+
+	// Grows the box to contain the box b
+	void expand(const aabb& b)
+	{
+		*this = aabb(*this, b);
+	}
+
+	bool is_empty() const
+	{
+		return minimum[0] > maximum[0] || minimum[1] > maximum[1] || minimum[2] > maximum[2];
+	}
+
+	vec3 extent() const { return maximum - minimum; }
+	point3 centroid() const { return 0.5 * (minimum + maximum); }
+
+	// Surface area of the box. Used by the BVH builder, as the chance of a random ray
+	// hitting a box is proportional to its surface area.
+	double surface_area() const
+	{
+		if (is_empty())
+			return 0;
+
+		auto d = extent();
+		return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+	}
+
+	// Returns the index of the longest axis of the box (0 = x, 1 = y, 2 = z)
+	int longest_axis() const
+	{
+		auto d = extent();
+		if (d[0] > d[1])
+			return d[0] > d[2] ? 0 : 2;
+		return d[1] > d[2] ? 1 : 2;
+	}
+
+	// Slab test: does the ray pass through the box anywhere between ray_tmin and ray_tmax?
+	//
+	// For each axis, the ray is inside the slab between the two planes for t in [t0, t1].
+	// The ray hits the box if the three ranges (and [ray_tmin, ray_tmax]) all overlap, i.e. if the
+	// latest entry is before the earliest exit. Multiplying by the ray's precomputed 1/direction
+	// rather than dividing, and using min/max instead of comparisons, means there are no branches
+	// for the CPU to mispredict - this is called more than anything else while tracing a BVH.
+	bool hit(const ray& r, double ray_tmin, double ray_tmax) const
+	{
+		const auto& orig = r.origin();
+		const auto& inv_dir = r.inverse_direction();
+
+#if AABB_USE_SSE2
+		// x and y are done together in one register, z in the low half of another
+		__m128d o_xy = _mm_loadu_pd(&orig.e[0]);
+		__m128d o_z = _mm_load_sd(&orig.e[2]);
+		__m128d inv_xy = _mm_loadu_pd(&inv_dir.e[0]);
+		__m128d inv_z = _mm_load_sd(&inv_dir.e[2]);
+
+		__m128d t0_xy = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(&minimum.e[0]), o_xy), inv_xy);
+		__m128d t1_xy = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(&maximum.e[0]), o_xy), inv_xy);
+		__m128d t0_z = _mm_mul_sd(_mm_sub_sd(_mm_load_sd(&minimum.e[2]), o_z), inv_z);
+		__m128d t1_z = _mm_mul_sd(_mm_sub_sd(_mm_load_sd(&maximum.e[2]), o_z), inv_z);
+
+		// a negative direction swaps which plane is entered first
+		__m128d near_xy = _mm_min_pd(t0_xy, t1_xy);
+		__m128d far_xy = _mm_max_pd(t0_xy, t1_xy);
+		__m128d near_z = _mm_min_sd(t0_z, t1_z);
+		__m128d far_z = _mm_max_sd(t0_z, t1_z);
+
+		// Reduce to a single entry and exit distance. The ray's own range goes in last as the second
+		// operand, which is what SSE returns if the other is NaN (0 * infinity for a ray lying in a slab plane).
+		__m128d enter = _mm_max_sd(near_xy, _mm_unpackhi_pd(near_xy, near_xy));
+		enter = _mm_max_sd(near_z, enter);
+		enter = _mm_max_sd(enter, _mm_set_sd(ray_tmin));
+
+		__m128d exit = _mm_min_sd(far_xy, _mm_unpackhi_pd(far_xy, far_xy));
+		exit = _mm_min_sd(far_z, exit);
+		exit = _mm_min_sd(exit, _mm_set_sd(ray_tmax));
+
+		return _mm_comile_sd(enter, exit) != 0;
+#else
+		for (int axis = 0; axis < 3; axis++)
+		{
+			auto t0 = (minimum[axis] - orig[axis]) * inv_dir[axis];
+			auto t1 = (maximum[axis] - orig[axis]) * inv_dir[axis];
+
+			ray_tmin = std::fmax(ray_tmin, std::fmin(t0, t1));
+			ray_tmax = std::fmin(ray_tmax, std::fmax(t0, t1));
+		}
+
+		return ray_tmin <= ray_tmax;
+#endif
+	}
+};
+
+#endif
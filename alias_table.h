@@ -0,0 +1,205 @@
+#pragma once
+
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include "rtweekend.h"
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+/// <summary>
+/// Picks one of n items at random, each with probability proportional to its weight, in constant time
+/// (Walker's alias method, built with Vose's algorithm). The table has one slot per item, each holding the
+/// item's own share of the slot and another item (its alias) that fills the rest. A sample picks a slot
+/// uniformly and then one of its two items, with no searching, so it costs the same for a million lights as
+/// for two. Also gives a second random number back for reuse, so a sample can be jittered within its item.
+///
+/// Large tables can be built on a thread_pool: each worker pairs light items with heavy ones within its own
+/// parts of the table, and the few items left over are paired across parts afterwards (PSA+, Hubschle-Schneider
+/// and Sanders 2019).
+/// </summary>
+class alias_table
+{
+public:
+	alias_table() = default;
+
+	// Weights must not be negative. If they are all zero, every item is equally likely. Built on the calling thread.
+	explicit alias_table(const std::vector<double>& weights) : alias_table(weights, nullptr, 0) {}
+
+	// The same, built on pool's workers at priority if the table is large enough to be worth splitting.
+	// Gives the same table as building it on one thread.
+	alias_table(const std::vector<double>& weights, thread_pool& pool, int priority = 0)
+		: alias_table(weights, &pool, priority)
+	{
+	}
+
+	int size() const { return int(slots.size()); }
+
+	// Sum of the weights
+	double weight_sum() const { return total; }
+
+	// Chance of item i being picked
+	double probability(int i) const { return slots[i].probability; }
+
+	// The chance of each item being picked as the slots actually share them out, which should match probability:
+	// a slot's item gets its threshold of the slot, and its alias the rest
+	std::vector<double> implied_probabilities() const
+	{
+		std::vector<double> implied(slots.size(), 0.0);
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			implied[i] += slots[i].threshold / slots.size();
+			implied[slots[i].alias] += (1 - slots[i].threshold) / slots.size();
+		}
+		return implied;
+	}
+
+	// Picks an item with u in [0, 1). remapped is set to a fresh number in [0, 1) made from what is left of u.
+	int sample(double u, double& remapped) const
+	{
+		double scaled = u * slots.size();
+		int i = std::min(int(scaled), size() - 1);
+		double f = scaled - i;
+
+		const auto& slot = slots[i];
+		if (f < slot.threshold)
+		{
+			remapped = std::fmin(f / slot.threshold, 1 - 1e-12);
+			return i;
+		}
+
+		remapped = std::fmin((f - slot.threshold) / (1 - slot.threshold), 1 - 1e-12);
+		return slot.alias;
+	}
+
+private:
+	/// <summary>
+	/// One slot: the share of it that picks the slot's own item, the item picked otherwise, and the chance
+	/// of the slot's item being picked overall (kept for working out densities).
+	/// </summary>
+	class slot
+	{
+	public:
+		double threshold = 1;
+		double probability = 0;
+		int alias = 0;
+	};
+
+	/// <summary>
+	/// Items not yet given a complete slot: those needing less than one slot, and those needing more.
+	/// </summary>
+	class leftovers
+	{
+	public:
+		std::vector<int> light;
+		std::vector<int> heavy;
+	};
+
+	static constexpr int min_items_per_thread = 1 << 16;
+	static constexpr int max_parts = 64;
+
+	std::vector<slot> slots;
+	double total = 0;
+
+	// pool is null to build on the calling thread
+	alias_table(const std::vector<double>& weights, thread_pool* pool, int priority)
+		: slots(weights.size())
+	{
+		int n = int(weights.size());
+		if (n == 0)
+			return;
+
+		// The sum is added up by part, in a fixed order, so the table doesn't depend on how many threads build it
+		int part_count = std::max(1, std::min(n / min_items_per_thread, max_parts));
+		if (part_count == 1)
+			pool = nullptr;
+		std::vector<double> part_sums(part_count);
+		for_each_part(n, part_count, pool, priority, [&](int part, int begin, int end)
+		{
+			double sum = 0;
+			for (int i = begin; i < end; i++)
+				sum += weights[i];
+			part_sums[part] = sum;
+		});
+
+		total = 0;
+		for (double sum : part_sums)
+			total += sum;
+
+		// Each slot holds 1 on this scale, so an item needing more than 1 is heavy and needs aliasing into others
+		std::vector<double> need(n);
+		std::vector<leftovers> left(part_count);
+		for_each_part(n, part_count, pool, priority, [&](int part, int begin, int end)
+		{
+			auto& parted = left[part];
+			for (int i = begin; i < end; i++)
+			{
+				slots[i].probability = total > 0 ? weights[i] / total : 1.0 / n;
+				need[i] = slots[i].probability * n;
+				(need[i] < 1 ? parted.light : parted.heavy).push_back(i);
+			}
+			pair_items(parted, need);
+		});
+
+		// Whatever couldn't be paired within its part
+		leftovers rest;
+		for (auto& parted : left)
+		{
+			rest.light.insert(rest.light.end(), parted.light.begin(), parted.light.end());
+			rest.heavy.insert(rest.heavy.end(), parted.heavy.begin(), parted.heavy.end());
+		}
+		pair_items(rest, need);
+
+		// Anything still left fills its own slot. In exact arithmetic these would all need exactly 1.
+		for (int i : rest.light)
+			slots[i].threshold = 1, slots[i].alias = i;
+		for (int i : rest.heavy)
+			slots[i].threshold = 1, slots[i].alias = i;
+	}
+
+	// Gives each light item's slot the rest of its space to a heavy item, until one kind runs out.
+	// Whatever remains stays in items, with need updated for the heavy ones.
+	void pair_items(leftovers& items, std::vector<double>& need)
+	{
+		while (!items.light.empty() && !items.heavy.empty())
+		{
+			int light = items.light.back();
+			items.light.pop_back();
+			int heavy = items.heavy.back();
+
+			slots[light].threshold = need[light];
+			slots[light].alias = heavy;
+
+			// The heavy item used up the rest of the light one's slot; if it now needs less than a slot, it's light
+			need[heavy] -= 1 - need[light];
+			if (need[heavy] < 1)
+			{
+				items.heavy.pop_back();
+				items.light.push_back(heavy);
+			}
+		}
+	}
+
+	// Splits [0, n) into part_count ranges and calls job(part, begin, end) for each, on pool's workers if there is one
+	template <typename Job>
+	static void for_each_part(int n, int part_count, thread_pool* pool, int priority, const Job& job)
+	{
+		std::atomic<int> next_part(0);
+		auto run = [&]()
+		{
+			for (int part = next_part++; part < part_count; part = next_part++)
+				job(part, int(size_t(n) * part / part_count), int(size_t(n) * (part + 1) / part_count));
+		};
+
+		if (pool)
+			pool->run([&](int, int) { run(); }, priority);
+		else
+			run();
+	}
+};
+
+#endif
@@ -0,0 +1,140 @@
+#pragma once
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "renderer.h"
+#include "scene.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+/// <summary>
+/// One image to render: which scene, seen through which camera, and where to write it.
+/// </summary>
+class batch_job
+{
+public:
+	const loaded_scene* source = nullptr;
+	camera cam;
+	std::string output_path;
+	int line = 0;			// Where the job is in the manifest, for messages
+};
+
+// Reads a batch manifest, loading every scene it uses through scenes. The format is one statement per line:
+//
+//		scene scenes/default.scene		# the scene for the jobs that follow; resets the camera to the scene's own
+//		image width 64 aspect 1			# camera, image, render, filter and background lines as in a scene file,
+//		camera lookfrom 0 1 3			# changing the camera for the jobs that follow
+//		output thumbs/default_a.ppm		# renders an image with the scene and camera so far
+//		camera lookfrom 3 1 0
+//		output thumbs/default_b.ppm
+//
+// Paths can't contain spaces. Throws scene_error for a manifest that doesn't make sense or a scene that
+// can't be loaded, before anything is rendered.
+inline std::vector<batch_job> parse_manifest(std::string_view text, renderer& scenes)
+{
+	std::vector<batch_job> jobs;
+	const loaded_scene* current = nullptr;
+	camera cam;
+
+	scene_tokenizer tokens(text);
+
+	while (tokens.next_line())
+	{
+		auto keyword = tokens.word();
+
+		if (keyword == "scene")
+		{
+			auto path = std::string(tokens.word());
+			try
+			{
+				current = &scenes.load_scene_file(path);
+			}
+			catch (const scene_error& error)
+			{
+				throw scene_error(tokens.line(), error.what());
+			}
+			cam = current->cam;
+		}
+		else if (keyword == "output")
+		{
+			if (!current)
+				throw scene_error(tokens.line(), "output before any scene");
+
+			batch_job job;
+			job.source = current;
+			job.cam = cam;
+			job.output_path = std::string(tokens.word());
+			job.line = tokens.line();
+			jobs.push_back(job);
+		}
+		else if (!parse_camera_statement(keyword, tokens, cam))
+		{
+			throw scene_error(tokens.line(), "unknown statement '" + std::string(keyword) + "'");
+		}
+
+		if (!tokens.at_line_end())
+			throw scene_error(tokens.line(), "unexpected '" + std::string(tokens.word()) + "' at end of line");
+	}
+
+	return jobs;
+}
+
+// Renders every job in the manifest file with scenes_and_threads, so each scene is loaded once and the same
+// threads render every image. A job whose output can't be written is reported and skipped.
+// Returns the number of images written. Throws scene_error if the manifest or a scene in it can't be loaded.
+inline int render_batch(const std::string& manifest_path, renderer& scenes_and_threads, std::ostream& log = std::clog)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<batch_job> jobs;
+	auto text = read_text_file(manifest_path);
+	try
+	{
+		jobs = parse_manifest(text, scenes_and_threads);
+	}
+	catch (const scene_error& error)
+	{
+		throw scene_error(manifest_path + ", " + error.what());
+	}
+
+	std::unordered_set<const loaded_scene*> sources;
+	framebuffer image;
+	int written = 0;
+
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		const auto& job = jobs[i];
+		sources.insert(job.source);
+
+		std::ofstream out(job.output_path, std::ios::binary);
+		if (!out)
+		{
+			log << "\n" << manifest_path << ", line " << job.line << ": can't write '" << job.output_path << "'\n";
+			continue;
+		}
+
+		// The threads are created by the first job, with its thread settings, and kept for the rest
+		scenes_and_threads.render(*job.source, job.cam, image);
+		image.write_ppm(out);
+		written++;
+
+		log << "\rImages rendered: " << (i + 1) << " of " << jobs.size() << ' ' << std::flush;
+	}
+
+	auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	log << "\nDone: " << written << " images from " << sources.size() << " scenes in " << seconds << " s\n";
+
+	return written;
+}
+
+#endif
@@ -0,0 +1,260 @@
+#pragma once
+
+#ifndef BDPT_H
+#define BDPT_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "hittable.h"
+#include "lights.h"
+#include "material.h"
+
+#include <vector>
+
+// The pieces of bidirectional path tracing (Veach 1997) that don't depend on the camera: the vertices of a
+// path, tracing a path from the camera or from a light, and the weight of each way of joining the two.
+// camera::bidirectional_color puts them together.
+
+/// <summary>
+/// One point on a path traced from the camera or from a light, with what is needed to join it to a point on a
+/// path traced the other way. Densities are per unit area (per unit volume inside a volume), so that the
+/// densities of sampling the same path in different ways can be compared.
+/// </summary>
+class path_vertex
+{
+public:
+	enum class kind { camera, light, surface };
+
+	kind type = kind::surface;
+	point3 p;
+	vec3 normal;				// Surface normal, or zero where there is no surface (the camera, or inside a volume)
+	color beta;					// The path's throughput up to here: what it carries, over the density of sampling it
+	double pdf_fwd = 0;			// Density of the path's own sampling reaching this vertex
+	double pdf_rev = 0;			// Density of a path sampled the other way reaching it
+	bool delta = false;			// Scattered in an exact direction (a mirror or glass), so nothing can be joined to it
+	int light = -1;				// The light in the light_set, for lights and for surfaces that are lights
+
+	ray r_in;					// Surfaces: the ray that arrived here
+	hit_record rec;				// Surfaces: where it hit
+
+	vec3 forward;				// Camera: the direction it looks in
+	double film_area = 0;		// Camera: area of the image on a plane 1 unit in front of the lens
+
+	// |cos| of the angle between unit direction d and the surface, or 1 where there is no surface
+	double cosine(const vec3& d) const
+	{
+		return normal.near_zero() ? 1 : std::fabs(dot(normal, d));
+	}
+
+	// Converts a density per solid angle of the direction from here to next into a density per area at next
+	double to_area(double pdf_dir, const path_vertex& next) const
+	{
+		vec3 d = next.p - p;
+		double distance_squared = d.length_squared();
+		if (distance_squared == 0)
+			return 0;
+
+		return pdf_dir * next.cosine(d / std::sqrt(distance_squared)) / distance_squared;
+	}
+
+	// What this vertex sends on in unit direction d, cosine included: a surface's scattering of the light
+	// arriving along r_in (so nothing for exact-direction surfaces), or a light's emission
+	color f(const vec3& d, const light_set& lights) const
+	{
+		if (type == kind::light)
+		{
+			double cos_theta = dot(normal, d);
+			return cos_theta > 0 ? cos_theta * lights[light].emit : color(0, 0, 0);
+		}
+
+		return rec.mat->scattering(r_in, rec, d);
+	}
+
+	// Density of this vertex, reached from prev, sampling next (a light emitting towards it, the camera
+	// looking at it, or a surface scattering towards it). Assumes that scattering densities are symmetric,
+	// as they are for every material that has one.
+	double pdf(const path_vertex* prev, const path_vertex& next) const
+	{
+		vec3 d = unit_vector(next.p - p);
+
+		double pdf_dir;
+		if (type == kind::camera)
+		{
+			// The image is sampled uniformly, and a point on it at angle theta is 1 / cos(theta) away
+			double cos_theta = dot(d, forward);
+			if (cos_theta <= 0)
+				return 0;
+
+			pdf_dir = 1 / (film_area * cos_theta * cos_theta * cos_theta);
+		}
+		else if (type == kind::light)
+		{
+			pdf_dir = emission_pdf(d);
+		}
+		else
+		{
+			pdf_dir = rec.mat->scattering_pdf(ray(prev->p, p - prev->p), rec, d);
+		}
+
+		return to_area(pdf_dir, next);
+	}
+
+	// Density of next being reached by light leaving this vertex, a point on a light
+	double light_pdf(const path_vertex& next) const
+	{
+		return to_area(emission_pdf(unit_vector(next.p - p)), next);
+	}
+
+	// Density of a light path starting at this vertex, a point on a light
+	double light_origin_pdf(const light_set& lights) const
+	{
+		return lights.probability(light) / lights[light].area();
+	}
+
+private:
+	// Lights emit with a cosine distribution about their normal
+	double emission_pdf(const vec3& d) const
+	{
+		return std::fmax(dot(normal, d), 0.0) / pi;
+	}
+};
+
+/// <summary>
+/// Sets a value for as long as it is in scope, then puts the old one back.
+/// </summary>
+template <typename T>
+class scoped_assignment
+{
+public:
+	scoped_assignment() = default;
+	scoped_assignment(const scoped_assignment&) = delete;
+	scoped_assignment& operator=(const scoped_assignment&) = delete;
+
+	~scoped_assignment()
+	{
+		if (target)
+			*target = saved;
+	}
+
+	void assign(T* new_target, T value)
+	{
+		target = new_target;
+		saved = *target;
+		*target = value;
+	}
+
+private:
+	T* target = nullptr;
+	T saved{};
+};
+
+// Extends path by following r, which the path's last vertex sampled with density pdf_dir (per solid angle) and
+// which carries throughput beta, scattering at everything it hits until the path has max_vertices vertices or
+// is absorbed. Returns true if a ray left the scene before then, with that ray in r and its throughput in beta.
+// lights, if given, is used to recognise surfaces that are lights.
+inline bool random_walk(const hittable& world, const light_set* lights, ray& r, color& beta, double pdf_dir,
+						int max_vertices, std::vector<path_vertex>& path)
+{
+	while (int(path.size()) < max_vertices)
+	{
+		hit_record rec;
+		if (!world.hit(r, 0.001, infinity, rec))
+			return true;
+
+		path_vertex vertex;
+		vertex.p = rec.p;
+		vertex.normal = rec.normal;
+		vertex.beta = beta;
+		vertex.r_in = r;
+		vertex.rec = rec;
+		vertex.pdf_fwd = path.back().to_area(pdf_dir, vertex);
+		if (lights && !rec.mat->emitted().near_zero())
+			vertex.light = lights->find(rec);
+		path.push_back(vertex);
+
+		ray scattered;
+		color attenuation;
+		if (!rec.mat->scatter(r, rec, attenuation, scattered))
+			return false;
+
+		// The density of scattering back the way the path came, for weighing against paths sampled the other way
+		auto direction = unit_vector(scattered.direction());
+		pdf_dir = rec.mat->scattering_pdf(r, rec, direction);
+		double pdf_rev = rec.mat->scattering_pdf(r, rec, -unit_vector(r.direction()));
+		if (pdf_dir == 0)
+		{
+			path.back().delta = true;
+			pdf_rev = 0;
+		}
+
+		auto& previous = path[path.size() - 2];
+		previous.pdf_rev = path.back().to_area(pdf_rev, previous);
+
+		beta = beta * attenuation;
+		r = scattered;
+		if (beta.near_zero())
+			return false;
+	}
+
+	return false;
+}
+
+// Weight of the path made by joining the first s vertices of light_path to the first t of camera_path,
+// against every other split into a light part and a camera part that could have made the same path
+// (multiple importance sampling with the power heuristic). sampled stands in for the light vertex when s = 1,
+// or the camera vertex when t = 1: those ends are sampled separately for each join.
+inline double mis_weight(std::vector<path_vertex>& light_path, std::vector<path_vertex>& camera_path,
+						 path_vertex* sampled, int s, int t, const light_set& lights)
+{
+	if (s + t == 2)
+		return 1;
+
+	// The vertices either side of the join: qs ends the light part and pt the camera part
+	path_vertex* qs = s == 0 ? nullptr : s == 1 ? sampled : &light_path[s - 1];
+	path_vertex* pt = t == 1 ? sampled : &camera_path[t - 1];
+	path_vertex* qs_minus = s > 1 ? &light_path[s - 2] : nullptr;
+	path_vertex* pt_minus = t > 1 ? &camera_path[t - 2] : nullptr;
+
+	// The densities of the vertices next to the join sampled the other way, which the paths didn't know
+	scoped_assignment<bool> pt_delta, qs_delta;
+	scoped_assignment<double> pt_rev, pt_minus_rev, qs_rev, qs_minus_rev;
+
+	pt_delta.assign(&pt->delta, false);
+	pt_rev.assign(&pt->pdf_rev, s > 0 ? qs->pdf(qs_minus, *pt) : pt->light_origin_pdf(lights));
+	if (pt_minus)
+		pt_minus_rev.assign(&pt_minus->pdf_rev, s > 0 ? pt->pdf(qs, *pt_minus) : pt->light_pdf(*pt_minus));
+	if (qs)
+	{
+		qs_delta.assign(&qs->delta, false);
+		qs_rev.assign(&qs->pdf_rev, pt->pdf(pt_minus, *qs));
+	}
+	if (qs_minus)
+		qs_minus_rev.assign(&qs_minus->pdf_rev, qs->pdf(pt, *qs_minus));
+
+	// A density of 0 marks an exact-direction scatter, whose density cancels out
+	auto remap0 = [](double pdf) { return pdf != 0 ? pdf : 1; };
+
+	// Each other split's density relative to this one's, moving the join one vertex at a time
+	double sum = 0;
+	double ratio = 1;
+	for (int i = t - 1; i > 0; i--)
+	{
+		ratio *= remap0(camera_path[i].pdf_rev) / remap0(camera_path[i].pdf_fwd);
+		if (!camera_path[i].delta && !camera_path[i - 1].delta)
+			sum += ratio * ratio;
+	}
+
+	ratio = 1;
+	for (int i = s - 1; i >= 0; i--)
+	{
+		const auto& vertex = (s == 1) ? *sampled : light_path[i];
+		ratio *= remap0(vertex.pdf_rev) / remap0(vertex.pdf_fwd);
+		if (!vertex.delta && !(i > 0 && light_path[i - 1].delta))
+			sum += ratio * ratio;
+	}
+
+	return 1 / (1 + sum);
+}
+
+#endif
@@ -0,0 +1,981 @@
+#pragma once
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "rtweekend.h"
+
+#include "alias_table.h"
+#include "bvh.h"
+#include "camera.h"
+#include "color.h"
+#include "compressed_mesh.h"
+#include "curves.h"
+#include "environment.h"
+#include "film.h"
+#include "filter.h"
+#include "hittable_list.h"
+#include "lights.h"
+#include "material.h"
+#include "page_cache.h"
+#include "photon_map.h"
+#include "scene.h"
+#include "sphere.h"
+#include "volume.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs job on thread_count threads at once and returns the wall clock time taken, in milliseconds.
+// job is passed the index of the thread running it.
+inline double time_threads(int thread_count, const std::function<void(int)>& job)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < thread_count; i++)
+		threads.emplace_back(job, i);
+	for (auto& thread : threads)
+		thread.join();
+
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+inline int benchmark_thread_count()
+{
+	int threads = int(std::thread::hardware_concurrency());
+	return threads < 1 ? 1 : threads;
+}
+
+// Renders world with cam in a single pass of samples per pixel on pool. Puts the final colour of every pixel,
+// row by row, in image and returns the time taken in milliseconds. If guide_memory is given it is set to the
+// memory taken by the render's path guide (0 if it wasn't guided).
+inline double render_image(const camera& cam, const hittable& world, int samples, thread_pool& pool,
+						   std::vector<color>& image, std::size_t* guide_memory = nullptr)
+{
+	film result = cam.make_film();
+	auto ms = time_threads(1, [&](int) { cam.render_pass(world, result, pool, samples); });
+
+	image.clear();
+	for (int j = 0; j < result.height(); j++)
+		for (int i = 0; i < result.width(); i++)
+			image.push_back(result.pixel_color(i, j));
+
+	if (guide_memory)
+		*guide_memory = result.guide() ? result.guide()->memory_used() : 0;
+	return ms;
+}
+
+// The root mean square difference between two images of the same size, over all three channels
+inline double rms_error(const std::vector<color>& image, const std::vector<color>& reference)
+{
+	double sum = 0;
+	for (size_t i = 0; i < image.size(); i++)
+		sum += (image[i] - reference[i]).length_squared() / 3;
+	return std::sqrt(sum / std::max<size_t>(image.size(), 1));
+}
+
+// Compares three ways for several threads to splat filtered samples into one framebuffer:
+//	*	per-tile buffers merged into the film when each tile is finished (what the camera does),
+//	*	lock-free atomic adds straight into the film (film::add_splat, used by light tracing),
+//	*	a single buffer behind one mutex, as the baseline.
+// Every method splats the same number of samples, spread over the image the way a tiled render would.
+inline void benchmark_splatting(std::ostream& out)
+{
+	const int image_width = 512;
+	const int image_height = 512;
+	const int tile_size = 16;
+	const int samples_per_pixel = 16;
+	const int tiles_x = image_width / tile_size;
+	const int tile_count = tiles_x * (image_height / tile_size);
+	const int threads = benchmark_thread_count();
+
+	blackman_harris_filter pixel_filter(2.0);
+
+	// Walks the tiles in the same order for every method. splat is called once per sample.
+	auto run = [&](std::atomic<int>& next_tile, const std::function<void(int, int, int)>& start_tile,
+				   const std::function<void(double, double, const color&)>& splat,
+				   const std::function<void()>& end_tile)
+	{
+		for (int t = next_tile++; t < tile_count; t = next_tile++)
+		{
+			int x0 = (t % tiles_x) * tile_size;
+			int y0 = (t / tiles_x) * tile_size;
+			start_tile(t, x0, y0);
+
+			for (int j = y0; j < y0 + tile_size; j++)
+				for (int i = x0; i < x0 + tile_size; i++)
+					for (int s = 0; s < samples_per_pixel; s++)
+						splat(i + random_double(), j + random_double(), color(0.5, 0.5, 0.5));
+
+			end_tile();
+		}
+	};
+
+	out << "Splatting " << image_width << "x" << image_height << " at " << samples_per_pixel
+		<< " spp on " << threads << " threads, " << pixel_filter.radius() << " px filter radius\n";
+
+	// Per-tile buffers
+	{
+		film image(image_width, image_height, pixel_filter);
+		std::atomic<int> next_tile(0);
+
+		auto ms = time_threads(threads, [&](int)
+		{
+			film_tile tile = image.make_tile(0, 0, 0, 0);
+			run(next_tile,
+				[&](int, int x0, int y0) { tile = image.make_tile(x0, y0, x0 + tile_size, y0 + tile_size); },
+				[&](double px, double py, const color& c) { tile.add_sample(px, py, c); },
+				[&]() { image.merge_tile(tile); });
+		});
+		out << "  per-tile buffers: " << ms << " ms\n";
+	}
+
+	// Atomic adds straight into the film
+	{
+		film image(image_width, image_height, pixel_filter);
+		std::atomic<int> next_tile(0);
+
+		auto ms = time_threads(threads, [&](int)
+		{
+			run(next_tile,
+				[](int, int, int) {},
+				[&](double px, double py, const color& c) { image.add_splat(px, py, c); },
+				[]() {});
+		});
+		out << "  atomic adds:      " << ms << " ms\n";
+	}
+
+	// Mutex baseline: one tile covering the whole image, locked for every sample
+	{
+		film image(image_width, image_height, pixel_filter);
+		film_tile whole = image.make_tile(0, 0, image_width, image_height);
+		std::mutex whole_mutex;
+		std::atomic<int> next_tile(0);
+
+		auto ms = time_threads(threads, [&](int)
+		{
+			run(next_tile,
+				[](int, int, int) {},
+				[&](double px, double py, const color& c)
+				{
+					std::lock_guard<std::mutex> lock(whole_mutex);
+					whole.add_sample(px, py, c);
+				},
+				[]() {});
+		});
+		out << "  mutex baseline:   " << ms << " ms\n";
+	}
+}
+
+// Compares closest-hit (hit) and any-hit (occluded) queries for shadow-like rays:
+// rays between two random points inside a cloud of spheres, as a shadow ray from a surface to a light would be.
+inline void benchmark_occlusion(std::ostream& out)
+{
+	const int sphere_count = 20000;
+	const int ray_count = 1000000;
+
+	auto grey = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+	hittable_list spheres;
+	for (int i = 0; i < sphere_count; i++)
+	{
+		auto center = point3(random_double(-50, 50), random_double(-50, 50), random_double(-50, 50));
+		spheres.add(make_shared<sphere>(center, random_double(0.2, 1.0), grey));
+	}
+	bvh world(spheres);
+
+	std::vector<ray> rays;
+	for (int i = 0; i < ray_count; i++)
+	{
+		auto from = point3(random_double(-50, 50), random_double(-50, 50), random_double(-50, 50));
+		auto to = point3(random_double(-50, 50), random_double(-50, 50), random_double(-50, 50));
+		// direction is the full segment, so t runs from 0 at from to 1 at to
+		rays.emplace_back(from, to - from);
+	}
+
+	out << "Shadow rays: " << ray_count << " rays through " << sphere_count << " spheres\n";
+
+	int closest_blocked = 0;
+	auto ms = time_threads(1, [&](int)
+	{
+		hit_record rec;
+		for (const auto& r : rays)
+			closest_blocked += world.hit(r, 0.001, 0.999, rec);
+	});
+	out << "  closest hit: " << ms << " ms (" << closest_blocked << " blocked)\n";
+
+	int any_blocked = 0;
+	ms = time_threads(1, [&](int)
+	{
+		for (const auto& r : rays)
+			any_blocked += world.occluded(r, 0.001, 0.999);
+	});
+	out << "  any hit:     " << ms << " ms (" << any_blocked << " blocked)\n";
+}
+
+// Times parsing a large generated scene file, and building the BVH over it separately
+inline void benchmark_scene_parsing(std::ostream& out)
+{
+	const int sphere_count = 200000;
+
+	std::string text =
+		"camera lookfrom 0 0 0 lookat 0 0 -1 vup 0 1 0 vfov 40\n"
+		"image width 400 aspect 1.7778 samples 16 depth 10\n"
+		"material matte lambertian 0.5 0.5 0.5\n"
+		"material shiny metal 0.8 0.8 0.8 0.1\n";
+	for (int i = 0; i < sphere_count; i++)
+	{
+		text += "sphere " + std::to_string(random_double(-50, 50)) + ' ' + std::to_string(random_double(-50, 50))
+			+ ' ' + std::to_string(random_double(-50, 50)) + " 0.5 " + (i % 2 ? "matte" : "shiny") + '\n';
+	}
+
+	out << "Scene parsing: " << sphere_count << " spheres, " << text.size() / 1024 << " KiB\n";
+
+	scene parsed;
+	auto ms = time_threads(1, [&](int) { parsed = parse_scene(text); });
+	out << "  parse:     " << ms << " ms (" << parsed.objects.objects.size() << " objects)\n";
+
+	ms = time_threads(1, [&](int) { bvh world(parsed.objects); });
+	out << "  bvh build: " << ms << " ms\n";
+
+	// Parsing again through a cache, as --watch does, reuses every object. A glowing sphere kept that way
+	// must still be found as a light when a ray hits it.
+	text += "material lamp light 4 4 4\nsphere 0 0 -100 1 lamp\n";
+	scene_object_cache cache;
+	parse_scene(text, &cache);
+	ms = time_threads(1, [&](int) { parsed = parse_scene(text, &cache); });
+
+	hit_record rec;
+	bool lit = parsed.objects.objects.back()->hit(ray(point3(0, 0, -90), vec3(0, 0, -1)), 0.001, infinity, rec)
+		&& parsed.cam.lights->find(rec) >= 0;
+	out << "  re-parse:  " << ms << " ms (lamp " << (lit ? "still" : "NOT") << " found as a light)\n";
+}
+
+// Measures how much smaller a compressed_mesh is than the plain vertex and index arrays it was made from,
+// and how fast rays hit it given that every cluster a ray reaches is decoded on the way
+inline void benchmark_mesh_compression(std::ostream& out)
+{
+	const int rings = 400;
+	const int segments = 250;
+	const int ray_count = 200000;
+
+	// A bumpy sphere, so the triangles aren't all the same shape
+	triangle_mesh mesh;
+	for (int i = 0; i <= rings; i++)
+	{
+		for (int j = 0; j < segments; j++)
+		{
+			auto theta = pi * i / rings;
+			auto phi = 2 * pi * j / segments;
+			auto radius = 10 + 0.2 * std::sin(7 * theta) * std::sin(5 * phi);
+			mesh.positions.emplace_back(radius * std::sin(theta) * std::cos(phi), radius * std::cos(theta),
+										radius * std::sin(theta) * std::sin(phi));
+		}
+	}
+	for (int i = 0; i < rings; i++)
+	{
+		for (int j = 0; j < segments; j++)
+		{
+			int a = i * segments + j, b = i * segments + (j + 1) % segments;
+			int c = a + segments, d = b + segments;
+			mesh.indices.insert(mesh.indices.end(), { a, b, d, a, d, c });
+		}
+	}
+
+	auto grey = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+	compressed_mesh compressed(mesh, grey);
+
+	auto plain_bytes = mesh.positions.size() * sizeof(point3) + mesh.indices.size() * sizeof(int);
+	out << "Mesh compression: " << mesh.triangle_count() << " triangles\n";
+	out << "  plain:      " << plain_bytes / 1024 << " KiB\n";
+	out << "  compressed: " << compressed.memory_size() / 1024 << " KiB ("
+		<< double(plain_bytes) / compressed.memory_size() << "x smaller)\n";
+
+	std::vector<ray> rays;
+	for (int i = 0; i < ray_count; i++)
+	{
+		auto from = 30 * unit_vector(vec3(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1)));
+		rays.emplace_back(from, point3(random_double(-5, 5), random_double(-5, 5), random_double(-5, 5)) - from);
+	}
+
+	int hits = 0;
+	auto ms = time_threads(1, [&](int)
+	{
+		hit_record rec;
+		for (const auto& r : rays)
+			hits += compressed.hit(r, 0.001, infinity, rec);
+	});
+	out << "  " << ray_count << " rays:  " << ms << " ms (" << hits << " hits)\n";
+}
+
+// Compares a ball of hair as curves with the same hair made of triangles (each strand a flat strip of
+// 8 quads): memory, build time and the time to trace rays into it
+inline void benchmark_hair(std::ostream& out)
+{
+	const int strand_count = 50000;
+	const int strip_quads = 8;
+	const int ray_count = 200000;
+
+	auto strands = grow_hair(point3(0, 0, 0), 1, strand_count, 0.8, 0.01);
+	auto grey = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+	shared_ptr<curve_set> curves;
+	auto curve_ms = time_threads(1, [&](int) { curves = make_shared<curve_set>(strands, grey); });
+
+	triangle_mesh strips;
+	for (const auto& strand : strands)
+	{
+		auto side = unit_vector(cross(strand.control[3] - strand.control[0], vec3(0, 1, 0.1)));
+		int first = int(strips.positions.size());
+		for (int i = 0; i <= strip_quads; i++)
+		{
+			double u = double(i) / strip_quads, s = 1 - u;
+			auto centre = s * s * s * strand.control[0] + 3 * s * s * u * strand.control[1]
+				+ 3 * s * u * u * strand.control[2] + u * u * u * strand.control[3];
+			auto half_width = (strand.width[0] + (strand.width[1] - strand.width[0]) * u) / 2;
+			strips.positions.push_back(centre - half_width * side);
+			strips.positions.push_back(centre + half_width * side);
+		}
+		for (int i = 0; i < strip_quads; i++)
+		{
+			int a = first + 2 * i;
+			strips.indices.insert(strips.indices.end(), { a, a + 1, a + 3, a, a + 3, a + 2 });
+		}
+	}
+
+	// A plain triangle BVH would need its own primitive per triangle; the compressed mesh is the smallest
+	// triangle representation there is here, so the comparison flatters the triangles if anything
+	shared_ptr<compressed_mesh> triangles;
+	auto triangle_ms = time_threads(1, [&](int) { triangles = make_shared<compressed_mesh>(strips, grey); });
+	auto plain_bytes = strips.positions.size() * sizeof(point3) + strips.indices.size() * sizeof(int);
+
+	out << "Hair: " << strand_count << " strands\n";
+	out << "  curves:    " << curves->memory_size() / 1024 << " KiB, built in " << curve_ms << " ms\n";
+	out << "  triangles: " << strips.triangle_count() << ", " << plain_bytes / 1024 << " KiB plain, "
+		<< triangles->memory_size() / 1024 << " KiB compressed, built in " << triangle_ms << " ms\n";
+
+	std::vector<ray> rays;
+	for (int i = 0; i < ray_count; i++)
+	{
+		auto from = 3 * unit_vector(vec3(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1)));
+		rays.emplace_back(from, point3(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1)) - from);
+	}
+
+	for (auto object : { shared_ptr<hittable>(curves), shared_ptr<hittable>(triangles) })
+	{
+		int hits = 0;
+		auto ms = time_threads(1, [&](int)
+		{
+			hit_record rec;
+			for (const auto& r : rays)
+				hits += object->hit(r, 0.001, infinity, rec);
+		});
+		out << "  " << (object == curves ? "curves" : "triangles") << ": " << ray_count << " rays in " << ms
+			<< " ms (" << hits << " hits)\n";
+	}
+}
+
+// Measures a cloud's sparse voxel grid against storing it densely, and the time to track rays through it
+inline void benchmark_volume(std::ostream& out)
+{
+	const int resolution = 192;
+	const int ray_count = 100000;
+
+	shared_ptr<voxel_grid> grid;
+	auto build_ms = time_threads(1, [&](int) { grid = make_cloud(point3(0, 0, 0), 1, resolution); });
+	heterogeneous_medium cloud(grid, 20, color(0.9, 0.9, 0.9));
+
+	out << "Volume: " << resolution << "^3 voxel cloud, built in " << build_ms << " ms\n";
+	out << "  dense:  " << grid->dense_memory_size() / 1024 << " KiB\n";
+	out << "  sparse: " << grid->memory_size() / 1024 << " KiB (" << grid->occupied_bricks() << " occupied bricks)\n";
+
+	std::vector<ray> rays;
+	for (int i = 0; i < ray_count; i++)
+	{
+		auto from = 3 * unit_vector(vec3(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1)));
+		rays.emplace_back(from, point3(random_double(-0.5, 0.5), random_double(-0.5, 0.5), random_double(-0.5, 0.5)) - from);
+	}
+
+	int collisions = 0;
+	auto ms = time_threads(1, [&](int)
+	{
+		hit_record rec;
+		for (const auto& r : rays)
+			collisions += cloud.hit(r, 0.001, infinity, rec);
+	});
+	out << "  delta tracking: " << ray_count << " rays in " << ms << " ms (" << collisions << " collisions)\n";
+
+	double total = 0;
+	ms = time_threads(1, [&](int)
+	{
+		for (const auto& r : rays)
+			total += cloud.transmittance(r, 0.001, infinity);
+	});
+	out << "  ratio tracking: " << ray_count << " rays in " << ms << " ms (mean transmittance " << total / ray_count << ")\n";
+}
+
+// Renders a matte sphere on the ground under a sky with a small, very bright sun, with and without shadow rays
+// aimed at the environment map. Reports each render's time and its RMS error against a long render.
+inline void benchmark_environment(std::ostream& out)
+{
+	const int map_width = 256;
+	const int map_height = 128;
+
+	// Blue sky over a grey ground, and a sun 2 pixels (about 1.4 degrees) across, high to one side
+	std::vector<color> pixels;
+	for (int j = 0; j < map_height; j++)
+		for (int i = 0; i < map_width; i++)
+			pixels.push_back(j < map_height / 2 ? color(0.4, 0.6, 1.0) : color(0.2, 0.2, 0.2));
+	for (int j = 40; j < 42; j++)
+		for (int i = 150; i < 152; i++)
+			pixels[size_t(j) * map_width + i] = color(4000, 3600, 3200);
+
+	hittable_list objects;
+	objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+	objects.add(make_shared<sphere>(point3(0, 0.5, 0), 0.5, make_shared<lambertian>(color(0.7, 0.3, 0.2))));
+	bvh world(objects);
+
+	camera cam;
+	cam.image_width = 160;
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.max_depth = 8;
+	cam.vfov = 40;
+	cam.lookfrom = point3(0, 1, 3);
+	cam.lookat = point3(0, 0.4, 0);
+	cam.environment = make_shared<environment_map>(map_width, map_height, std::move(pixels));
+	cam.initialize();
+
+	thread_pool pool;
+	std::vector<color> reference, image;
+	render_image(cam, world, 1024, pool, reference);
+
+	out << "Environment map sampling: " << map_width << "x" << map_height << " sky with a small sun\n";
+	for (int samples : { 16, 64, 256 })
+	{
+		cam.sample_environment = true;
+		auto ms = render_image(cam, world, samples, pool, image);
+		out << "  sampled, " << samples << " spp: " << ms << " ms, RMS error " << rms_error(image, reference) << '\n';
+		cam.sample_environment = false;
+		ms = render_image(cam, world, samples, pool, image);
+		out << "  uniform, " << samples << " spp: " << ms << " ms, RMS error " << rms_error(image, reference) << '\n';
+	}
+}
+
+// Builds an alias table over a few million skewed weights on one thread and on a thread pool, checking that
+// both share out the weights exactly, then compares drawing samples from it with a binary search of the same
+// weights' running totals
+inline void benchmark_alias_table(std::ostream& out)
+{
+	const int item_count = 1 << 22;
+	const int sample_count = 10000000;
+
+	// Mostly dim with a few very bright items, like the triangles of a scene with a handful of lamps
+	std::vector<double> weights(item_count);
+	for (auto& weight : weights)
+		weight = random_double() < 0.001 ? random_double(100, 1000) : random_double();
+
+	out << "Alias table: " << item_count << " items\n";
+
+	// However many threads build it, the slots should share out exactly the weights' probabilities
+	auto check = [&](const alias_table& table)
+	{
+		auto implied = table.implied_probabilities();
+		double sum = 0, worst = 0;
+		for (int i = 0; i < item_count; i++)
+		{
+			sum += table.probability(i);
+			worst = std::fmax(worst, std::fabs(implied[i] - weights[i] / table.weight_sum()));
+		}
+		out << " (probabilities add up to " << sum << ", slots differ from them by at most " << worst << ")\n";
+	};
+
+	alias_table table;
+	auto ms = time_threads(1, [&](int) { table = alias_table(weights); });
+	out << "  build, 1 thread:   " << ms << " ms";
+	check(table);
+
+	thread_pool pool;
+	ms = time_threads(1, [&](int) { table = alias_table(weights, pool); });
+	out << "  build, pool of " << pool.size() << ": " << ms << " ms";
+	check(table);
+
+	std::vector<double> cdf(item_count);
+	double sum = 0;
+	for (int i = 0; i < item_count; i++)
+		cdf[i] = (sum += weights[i]);
+
+	std::vector<double> us(sample_count);
+	for (auto& u : us)
+		u = random_double();
+
+	long long checksum = 0;
+	ms = time_threads(1, [&](int)
+	{
+		double remapped;
+		for (double u : us)
+			checksum += table.sample(u, remapped);
+	});
+	out << "  alias sampling:    " << sample_count << " samples in " << ms << " ms\n";
+
+	ms = time_threads(1, [&](int)
+	{
+		for (double u : us)
+			checksum += std::upper_bound(cdf.begin(), cdf.end(), u * sum) - cdf.begin();
+	});
+	out << "  binary search:     " << sample_count << " samples in " << ms << " ms (checksum " << checksum % 1000 << ")\n";
+}
+
+// A closed room lit only by a lamp inside an open-topped shade, so all its light bounces off the ceiling first.
+// Sets up cam to look into it at a small image, and returns the room.
+inline shared_ptr<bvh> make_lamp_room(camera& cam)
+{
+	triangle_mesh room;
+	auto add_box = [&](point3 low, point3 high, bool open_top)
+	{
+		int first = int(room.positions.size());
+		for (int k = 0; k < 8; k++)
+			room.positions.emplace_back(k & 1 ? high.x() : low.x(), k & 2 ? high.y() : low.y(), k & 4 ? high.z() : low.z());
+
+		// Corners of each face, as offsets into the eight above
+		const int faces[6][4] = { { 0, 1, 5, 4 }, { 2, 6, 7, 3 }, { 0, 4, 6, 2 }, { 1, 3, 7, 5 }, { 0, 2, 3, 1 }, { 4, 5, 7, 6 } };
+		for (int f = 0; f < 6; f++)
+		{
+			if (open_top && f == 1)
+				continue;
+			for (int corner : { 0, 1, 2, 0, 2, 3 })
+				room.indices.push_back(first + faces[f][corner]);
+		}
+	};
+	add_box(point3(-2, 0, -4), point3(2, 3, 1), false);
+	add_box(point3(-0.4, 2.2, -2.4), point3(0.4, 2.85, -1.6), true);
+
+	auto wall = make_shared<lambertian>(color(0.75, 0.75, 0.7));
+	auto lamp = make_shared<diffuse_light>(color(80, 72, 60));
+	hittable_list objects;
+	objects.add(make_shared<compressed_mesh>(room, wall));
+	objects.add(make_shared<sphere>(point3(0, 2.5, -2), 0.15, lamp));
+	objects.add(make_shared<sphere>(point3(-0.9, 0.45, -2.8), 0.45, make_shared<lambertian>(color(0.7, 0.3, 0.25))));
+
+	cam.image_width = 64;
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.max_depth = 8;
+	cam.vfov = 70;
+	cam.lookfrom = point3(0, 1.4, 0.8);
+	cam.lookat = point3(0, 1.2, -4);
+	cam.sky_background = false;
+	cam.lights = make_shared<light_set>();
+	cam.lights->add(point3(0, 2.5, -2), 0.15, lamp.get());
+	cam.lights->build();
+	cam.initialize();
+
+	return make_shared<bvh>(objects);
+}
+
+// A long path traced render of the lamp room (see make_lamp_room), made the first time it is asked for and
+// kept for every benchmark that compares against it. It is the average of two independent halves, and noise is
+// set to the RMS error it still has, which is half their RMS difference; errors below that can't be told apart.
+inline const std::vector<color>& lamp_room_reference(thread_pool& pool, double& noise)
+{
+	static std::vector<color> reference;
+	static double reference_noise = 0;
+	if (reference.empty())
+	{
+		camera cam;
+		auto room = make_lamp_room(cam);
+		std::vector<color> first, second;
+		render_image(cam, *room, 4096, pool, first);
+		render_image(cam, *room, 4096, pool, second);
+
+		reference_noise = rms_error(first, second) / 2;
+		for (size_t i = 0; i < first.size(); i++)
+			reference.push_back((first[i] + second[i]) / 2);
+	}
+
+	noise = reference_noise;
+	return reference;
+}
+
+// Renders the lamp room (see make_lamp_room) by path tracing and by bidirectional path tracing. Reports each
+// render's time and its RMS error against a long path traced render (see lamp_room_reference).
+inline void benchmark_bidirectional(std::ostream& out)
+{
+	camera cam;
+	auto room = make_lamp_room(cam);
+	const auto& world = *room;
+
+	thread_pool pool;
+	double noise;
+	const auto& reference = lamp_room_reference(pool, noise);
+	std::vector<color> image;
+
+	out << "Bidirectional path tracing: room lit through the top of a lamp shade (reference noise " << noise << ")\n";
+	cam.bidirectional = false;
+	for (int samples : { 16, 64, 256 })
+	{
+		auto ms = render_image(cam, world, samples, pool, image);
+		out << "  path traced,   " << samples << " spp: " << ms << " ms, RMS error " << rms_error(image, reference) << '\n';
+	}
+	cam.bidirectional = true;
+	for (int samples : { 4, 16, 64 })
+	{
+		auto ms = render_image(cam, world, samples, pool, image);
+		out << "  bidirectional, " << samples << " spp: " << ms << " ms, RMS error " << rms_error(image, reference) << '\n';
+	}
+}
+
+// A glass ball on a matte floor, focusing the light of a small lamp above it into a caustic. Sets up cam to
+// look at it at a small image, with the lamp as its lights, and returns the scene.
+inline shared_ptr<bvh> make_glass_ball(camera& cam)
+{
+	auto lamp = make_shared<diffuse_light>(color(40, 36, 30));
+	hittable_list objects;
+	objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(color(0.7, 0.7, 0.7))));
+	objects.add(make_shared<sphere>(point3(0, 0.5, 0), 0.5, make_shared<dielectric>(1.5)));
+	objects.add(make_shared<sphere>(point3(0.8, 2.5, -0.5), 0.15, lamp));
+
+	cam.image_width = 64;
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.max_depth = 8;
+	cam.vfov = 40;
+	cam.lookfrom = point3(0, 1.5, 2.5);
+	cam.lookat = point3(0, 0.2, 0);
+	cam.sky_background = false;
+	cam.background = color(0.2, 0.2, 0.2);
+	cam.lights = make_shared<light_set>();
+	cam.lights->add(point3(0.8, 2.5, -0.5), 0.15, lamp.get());
+	cam.lights->build();
+	cam.initialize();
+
+	return make_shared<bvh>(objects);
+}
+
+// Times tracing caustic photons and building their kd-tree on one thread and on every thread, then renders the
+// caustic a glass ball focuses from a small lamp (see make_glass_ball) by path tracing and with the photon map.
+// Reports each render's time and its RMS error against a long path traced render.
+inline void benchmark_caustics(std::ostream& out)
+{
+	const int photon_count = 1000000;
+
+	camera cam;
+	auto ball = make_glass_ball(cam);
+	const auto& world = *ball;
+	const auto& lights = *cam.lights;
+	cam.caustic_radius = 0.05;
+
+	out << "Caustic photon map: " << photon_count << " photons through a glass ball\n";
+
+	photon_map caustics;
+	thread_pool single(1);
+	auto ms = time_threads(1, [&](int) { caustics = trace_caustic_photons(world, lights, photon_count, 8, single); });
+	out << "  trace and build, 1 thread:  " << ms << " ms, " << caustics.size() << " photons stored\n";
+
+	thread_pool pool;
+	ms = time_threads(1, [&](int) { caustics = trace_caustic_photons(world, lights, photon_count, 8, pool); });
+	out << "  trace and build, " << pool.size() << " threads: " << ms << " ms\n";
+
+	// The kd-tree's nearest photons against checking every photon, at points scattered about the caustic
+	const int query_count = 1000;
+	std::vector<point3> queries;
+	for (int i = 0; i < query_count && !caustics.empty(); i++)
+	{
+		auto near = caustics[int(random_double() * caustics.size())].p();
+		queries.push_back(near + cam.caustic_radius * vec3(random_double(-1, 1), 0, random_double(-1, 1)));
+	}
+
+	std::vector<std::vector<int>> found(queries.size());
+	auto tree_ms = time_threads(1, [&](int)
+	{
+		for (size_t q = 0; q < queries.size(); q++)
+			caustics.nearest(queries[q], cam.caustic_neighbours, cam.caustic_radius, found[q]);
+	});
+
+	int matching = 0;
+	auto brute_ms = time_threads(1, [&](int)
+	{
+		std::vector<std::pair<double, int>> all;
+		for (size_t q = 0; q < queries.size(); q++)
+		{
+			all.clear();
+			for (int i = 0; i < caustics.size(); i++)
+			{
+				double distance_squared = (caustics[i].p() - queries[q]).length_squared();
+				if (distance_squared < cam.caustic_radius * cam.caustic_radius)
+					all.emplace_back(distance_squared, i);
+			}
+			std::sort(all.begin(), all.end());
+			all.resize(std::min<size_t>(all.size(), cam.caustic_neighbours));
+
+			// Compared by distance, as photons the same distance away may come in either order
+			bool same = all.size() == found[q].size();
+			for (size_t k = 0; same && k < all.size(); k++)
+				same = all[k].first == (caustics[found[q][k]].p() - queries[q]).length_squared();
+			matching += same;
+		}
+	});
+	out << "  nearest " << cam.caustic_neighbours << " photons: kd-tree " << tree_ms << " ms, every photon " << brute_ms
+		<< " ms for " << queries.size() << " points; " << matching << " of them agree\n";
+
+	std::vector<color> reference, image;
+	cam.caustic_photons = 0;
+	render_image(cam, world, 4096, pool, reference);
+
+	// Errors over the whole image, and over the caustic alone (the pixels much brighter than the lit floor)
+	auto caustic_error = [&]()
+	{
+		std::vector<color> caustic, caustic_reference;
+		for (size_t i = 0; i < image.size(); i++)
+		{
+			if (reference[i].y() >= 1)
+			{
+				caustic.push_back(image[i]);
+				caustic_reference.push_back(reference[i]);
+			}
+		}
+		return rms_error(caustic, caustic_reference);
+	};
+
+	for (int samples : { 16, 64, 256 })
+	{
+		cam.caustic_photons = 0;
+		ms = render_image(cam, world, samples, pool, image);
+		out << "  path traced, " << samples << " spp: " << ms << " ms, RMS error " << rms_error(image, reference)
+			<< ", in the caustic " << caustic_error() << '\n';
+		cam.caustic_photons = 100000;
+		ms = render_image(cam, world, samples, pool, image);
+		out << "  photons,     " << samples << " spp: " << ms << " ms, RMS error " << rms_error(image, reference)
+			<< ", in the caustic " << caustic_error() << '\n';
+	}
+}
+
+// Renders a room open along one side to the sky, where nearly all the light has bounced off a wall, by path
+// tracing and with the irradiance cache. Reports each render's time and its RMS error against a long path
+// traced render.
+inline void benchmark_irradiance_cache(std::ostream& out)
+{
+	// Floor, ceiling and three walls of a 4 x 3 x 5 room, the wall at x = -2 left out
+	triangle_mesh room;
+	for (int k = 0; k < 8; k++)
+		room.positions.emplace_back(k & 1 ? 2 : -2, k & 2 ? 3 : 0, k & 4 ? 1 : -4);
+	for (int face : { 0, 2, 3, 4, 5 })
+	{
+		const int faces[6][4] = { { 0, 1, 5, 4 }, { 0, 4, 6, 2 }, { 2, 6, 7, 3 }, { 1, 3, 7, 5 }, { 0, 2, 3, 1 }, { 4, 5, 7, 6 } };
+		for (int corner : { 0, 1, 2, 0, 2, 3 })
+			room.indices.push_back(faces[face][corner]);
+	}
+
+	hittable_list objects;
+	objects.add(make_shared<compressed_mesh>(room, make_shared<lambertian>(color(0.75, 0.75, 0.7))));
+	objects.add(make_shared<sphere>(point3(0.4, 0.45, -2.6), 0.45, make_shared<lambertian>(color(0.7, 0.3, 0.25))));
+	bvh world(objects);
+
+	camera cam;
+	cam.image_width = 160;
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.max_depth = 8;
+	cam.vfov = 75;
+	cam.lookfrom = point3(1.2, 1.5, 0.6);
+	cam.lookat = point3(0.4, 1.1, -3);
+	cam.irradiance_rays = 512;
+	cam.initialize();
+
+	thread_pool pool;
+	std::vector<color> reference, image;
+	cam.irradiance_accuracy = 0;
+	render_image(cam, world, 1024, pool, reference);
+
+	out << "Irradiance cache: room open to the sky along one side\n";
+	for (int samples : { 16, 64, 256 })
+	{
+		auto ms = render_image(cam, world, samples, pool, image);
+		out << "  path traced,    " << samples << " spp: " << ms << " ms, RMS error " << rms_error(image, reference) << '\n';
+	}
+	for (double accuracy : { 0.5, 0.3 })
+	{
+		cam.irradiance_accuracy = accuracy;
+		auto ms = render_image(cam, world, 4, pool, image);
+		out << "  cached (" << accuracy << "), 4 spp: " << ms << " ms, RMS error " << rms_error(image, reference) << '\n';
+	}
+
+	// Progressively, the passes after the first reuse the records it made
+	film progressive = cam.make_film();
+	out << "  cached (" << cam.irradiance_accuracy << "), passes of 4 spp:";
+	for (int pass = 0; pass < 4; pass++)
+		out << ' ' << time_threads(1, [&](int) { cam.render_pass(world, progressive, pool, 4); }) << " ms";
+	out << ", " << progressive.irradiance()->size() << " records\n";
+}
+
+// Renders the lamp room (see make_lamp_room) by path tracing with and without path guiding, reporting each
+// render's time and its RMS error against a long path traced render (see lamp_room_reference), and the memory
+// the guide used.
+inline void benchmark_guiding(std::ostream& out)
+{
+	camera cam;
+	auto room = make_lamp_room(cam);
+	const auto& world = *room;
+
+	thread_pool pool;
+	double noise;
+	const auto& reference = lamp_room_reference(pool, noise);
+	std::vector<color> image;
+
+	auto mean = [](const std::vector<color>& pixels)
+	{
+		double sum = 0;
+		for (const auto& c : pixels)
+			sum += (c.x() + c.y() + c.z()) / 3;
+		return sum / pixels.size();
+	};
+
+	out << "Path guiding: room lit through the top of a lamp shade\n";
+	for (int samples : { 64, 256, 1024 })
+	{
+		// The guide plans its learning iterations around the samples the whole render will take
+		cam.samples_per_pixel = samples;
+		cam.guided = false;
+		auto ms = render_image(cam, world, samples, pool, image);
+		out << "  path traced, " << samples << " spp: " << ms << " ms, RMS error " << rms_error(image, reference)
+			<< ", mean " << mean(image) << '\n';
+		cam.guided = true;
+		std::size_t guide_memory = 0;
+		ms = render_image(cam, world, samples, pool, image, &guide_memory);
+		out << "  guided,      " << samples << " spp: " << ms << " ms, RMS error " << rms_error(image, reference)
+			<< ", mean " << mean(image) << ", guide " << guide_memory / 1024 << " KB\n";
+	}
+	out << "  reference mean " << mean(reference) << ", noise " << noise << '\n';
+}
+
+// Renders the lamp room (see make_lamp_room) and the glass ball's caustic (see make_glass_ball) by path tracing
+// and by Metropolis light transport with the same number of paths. Reports each render's time and its RMS
+// error against a long path traced render.
+inline void benchmark_metropolis(std::ostream& out)
+{
+	thread_pool pool;
+	auto compare = [&](camera& cam, const hittable& world, const std::vector<color>& reference)
+	{
+		std::vector<color> image;
+		for (int samples : { 16, 64, 256 })
+		{
+			cam.metropolis = false;
+			auto ms = render_image(cam, world, samples, pool, image);
+			out << "  path traced, " << samples << " spp: " << ms << " ms, RMS error " << rms_error(image, reference) << '\n';
+			cam.metropolis = true;
+			ms = render_image(cam, world, samples, pool, image);
+			out << "  metropolis,  " << samples << " spp: " << ms << " ms, RMS error " << rms_error(image, reference) << '\n';
+		}
+	};
+
+	out << "Metropolis light transport: room lit through the top of a lamp shade\n";
+	{
+		camera cam;
+		auto room = make_lamp_room(cam);
+		double noise;
+		compare(cam, *room, lamp_room_reference(pool, noise));
+	}
+
+	out << "Metropolis light transport: caustic under a glass ball\n";
+	{
+		camera cam;
+		auto ball = make_glass_ball(cam);
+		std::vector<color> reference;
+		render_image(cam, *ball, 4096, pool, reference);
+		compare(cam, *ball, reference);
+	}
+}
+
+// Renders a scene kept in a page_cache twice: first with nothing in memory, so tiles that reach a missing page
+// are put aside and rendered again once it has loaded, then again with every page resident. Each page takes
+// a few milliseconds to load, standing in for a disk read. The difference is what starting tiles again costs.
+inline void benchmark_paging(std::ostream& out)
+{
+	const int grid = 8;
+	const int spheres_per_page = 400;
+	const auto load_time = std::chrono::milliseconds(3);
+
+	auto grey = make_shared<lambertian>(color(0.6, 0.6, 0.6));
+	page_cache cache;
+	hittable_list pages;
+	std::vector<page_cache::loader> loaders;
+	for (int i = 0; i < grid; i++)
+	{
+		for (int k = 0; k < grid; k++)
+		{
+			auto low = point3(i - grid / 2.0, 0, -k - 2.0);
+			auto high = low + vec3(1, 1, 1);
+			loaders.push_back([=]()
+			{
+				std::this_thread::sleep_for(load_time);
+
+				hittable_list spheres;
+				for (int s = 0; s < spheres_per_page; s++)
+				{
+					auto center = point3(random_double(low.x() + 0.05, high.x() - 0.05), random_double(low.y() + 0.05, high.y() - 0.05),
+										 random_double(low.z() + 0.05, high.z() - 0.05));
+					spheres.add(make_shared<sphere>(center, 0.05, grey));
+				}
+				auto loaded = make_shared<paged_hittable::contents>();
+				loaded->objects = make_shared<bvh>(spheres);
+				loaded->memory_size = spheres_per_page * sizeof(sphere);
+				return shared_ptr<const pageable>(loaded);
+			});
+			int page = cache.add_page(loaders.back());
+			pages.add(make_shared<paged_hittable>(cache, page, aabb(low, high)));
+		}
+	}
+	bvh world(pages);
+
+	camera cam;
+	cam.image_width = 160;
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.max_depth = 4;
+	cam.vfov = 60;
+	cam.lookfrom = point3(0, 4, 2);
+	cam.lookat = point3(0, 0, -5);
+	cam.initialize();
+
+	thread_pool pool;
+	std::vector<color> image;
+	auto render = [&]() { return render_image(cam, world, 16, pool, image); };
+
+	out << "Paging: " << grid * grid << " pages of " << spheres_per_page << " spheres, each taking "
+		<< load_time.count() << " ms to load\n";
+	auto ms = render();
+	out << "  nothing resident: " << ms << " ms (" << cache.loads() << " loads)\n";
+	ms = render();
+	out << "  all resident:     " << ms << " ms\n";
+
+	// Every page loaded again, one after another, as a render that waited for each page would
+	ms = time_threads(1, [&](int)
+	{
+		for (const auto& load : loaders)
+			load();
+	});
+	out << "  loading alone:    " << ms << " ms\n";
+}
+
+// Runs every benchmark, printing the results to the out stream
+inline void run_benchmarks(std::ostream& out)
+{
+	benchmark_splatting(out);
+	benchmark_occlusion(out);
+	benchmark_scene_parsing(out);
+	benchmark_mesh_compression(out);
+	benchmark_paging(out);
+	benchmark_hair(out);
+	benchmark_volume(out);
+	benchmark_environment(out);
+	benchmark_alias_table(out);
+	benchmark_bidirectional(out);
+	benchmark_caustics(out);
+	benchmark_irradiance_cache(out);
+	benchmark_guiding(out);
+	benchmark_metropolis(out);
+}
+
+#endif
@@ -0,0 +1,390 @@
+#pragma once
+
+#ifndef BVH_H
+#define BVH_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// <summary>
+/// One node of the BVH. Nodes are stored in a flat array rather than as separate objects,
+/// so traversal walks through contiguous memory instead of chasing pointers.
+/// </summary>
+class bvh_node
+{
+public:
+	aabb box;
+	int left_first = 0;		// Leaf: index of the first primitive. Interior: index of the left child (right is left + 1)
+	int count = 0;			// Number of primitives in a leaf, 0 for an interior node
+	int axis = 0;			// Axis an interior node was split along, used to visit the nearer child first
+
+	bool is_leaf() const { return count > 0; }
+};
+
+/// <summary>
+/// Bounding volume hierarchy: a tree of boxes, each containing the boxes (or objects) below it.
+/// A ray that misses a box can skip everything inside it, so a hit costs O(log n) box tests rather than n object tests.
+/// </summary>
+class bvh : public hittable
+{
+public:
+	// Builds the tree over the objects in list. The list itself is not changed.
+	bvh(const hittable_list& list) : primitives(list.objects)
+	{
+		if (primitives.empty())
+			return;
+
+		nodes.reserve(2 * primitives.size());
+		nodes.emplace_back();
+		build(0, 0, int(primitives.size()));
+	}
+
+	// Recreates a saved tree: saved_primitives in the order primitive_order() gave them, and the nodes from
+	// tree_nodes(). Nothing is checked or built, so this is only as slow as the copy.
+	bvh(std::vector<shared_ptr<hittable>> saved_primitives, std::vector<bvh_node> saved_nodes)
+		: primitives(std::move(saved_primitives)), nodes(std::move(saved_nodes)) {}
+
+	// The objects in the order the leaves refer to them, and the nodes, for saving the tree
+	const std::vector<shared_ptr<hittable>>& primitive_order() const { return primitives; }
+	const std::vector<bvh_node>& tree_nodes() const { return nodes; }
+
+	bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override
+	{
+		if (nodes.empty())
+			return false;
+
+		hit_record temp_rec;
+		bool hit_anything = false;
+		auto closest_so_far = ray_tmax;
+
+		// Nodes still to visit. The tree is built with at most max_depth levels, so this can't overflow.
+		int stack[max_depth + 1];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size > 0)
+		{
+			const auto& node = nodes[stack[--stack_size]];
+
+			// closest_so_far shrinks with every hit, so boxes behind a hit are skipped too
+			if (!node.box.hit(r, ray_tmin, closest_so_far))
+				continue;
+
+			if (node.is_leaf())
+			{
+				for (int i = node.left_first; i < node.left_first + node.count; i++)
+				{
+					if (primitives[i]->hit(r, ray_tmin, closest_so_far, temp_rec))
+					{
+						hit_anything = true;
+						closest_so_far = temp_rec.t;
+						rec = temp_rec;
+					}
+				}
+			}
+			else
+			{
+				// Push the far child first so the near child is popped (and tested) first.
+				// A hit in the near child then lets the far child be rejected by its box.
+				bool dir_negative = r.direction()[node.axis] < 0;
+				stack[stack_size++] = node.left_first + (dir_negative ? 0 : 1);
+				stack[stack_size++] = node.left_first + (dir_negative ? 1 : 0);
+			}
+		}
+
+		return hit_anything;
+	}
+
+	// Any-hit traversal. Returns as soon as any object is found, so there is no need to keep
+	// shrinking the range or to visit the nearer child first.
+	bool occluded(const ray& r, double ray_tmin, double ray_tmax) const override
+	{
+		if (nodes.empty())
+			return false;
+
+		int stack[max_depth + 1];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size > 0)
+		{
+			const auto& node = nodes[stack[--stack_size]];
+
+			if (!node.box.hit(r, ray_tmin, ray_tmax))
+				continue;
+
+			if (node.is_leaf())
+			{
+				for (int i = node.left_first; i < node.left_first + node.count; i++)
+					if (primitives[i]->occluded(r, ray_tmin, ray_tmax))
+						return true;
+			}
+			else
+			{
+				stack[stack_size++] = node.left_first + 1;
+				stack[stack_size++] = node.left_first;
+			}
+		}
+
+		return false;
+	}
+
+	aabb bounding_box() const override
+	{
+		return nodes.empty() ? aabb() : nodes[0].box;
+	}
+
+	// Recomputes every node's box from the current bounds of its objects, keeping the tree shape.
+	// Much cheaper than a rebuild, and correct after objects move, but the tree gets less efficient
+	// the further things move from where they were when it was built.
+	void refit()
+	{
+		// Children are always stored after their parent, so walking backwards finishes
+		// both children before their parent is reached.
+		for (int i = int(nodes.size()) - 1; i >= 0; i--)
+		{
+			auto& node = nodes[i];
+			if (node.is_leaf())
+			{
+				aabb box;
+				for (int p = node.left_first; p < node.left_first + node.count; p++)
+					box.expand(primitives[p]->bounding_box());
+				node.box = box;
+			}
+			else
+			{
+				node.box = aabb(nodes[node.left_first].box, nodes[node.left_first + 1].box);
+			}
+		}
+	}
+
+	// Swaps objects for new versions of themselves (e.g. after one was edited in the scene file) and updates the
+	// tree to match. The tree is refitted, then any subtree holding a changed object whose box has grown to more
+	// than twice its old surface area is rebuilt, as refitting alone would leave it slow to traverse.
+	// Returns the number of objects replaced. Objects not in the tree are ignored.
+	int update(const std::unordered_map<const hittable*, shared_ptr<hittable>>& replacements)
+	{
+		if (nodes.empty() || replacements.empty())
+			return 0;
+
+		std::vector<char> changed(primitives.size(), 0);
+		int replaced = 0;
+		for (size_t i = 0; i < primitives.size(); i++)
+		{
+			auto found = replacements.find(primitives[i].get());
+			if (found != replacements.end())
+			{
+				primitives[i] = found->second;
+				changed[i] = 1;
+				replaced++;
+			}
+		}
+
+		if (replaced == 0)
+			return 0;
+
+		std::vector<double> old_areas(nodes.size());
+		for (size_t i = 0; i < nodes.size(); i++)
+			old_areas[i] = nodes[i].box.surface_area();
+
+		refit();
+		repair(0, 0, changed, old_areas);
+
+		// Rebuilt subtrees leave their old nodes unused at the front of the array.
+		// Once that is most of it, start over to get the memory (and cache locality) back.
+		if (unused_nodes > int(nodes.size()) / 2)
+			rebuild();
+
+		return replaced;
+	}
+
+	// Builds the whole tree again from scratch
+	void rebuild()
+	{
+		nodes.clear();
+		unused_nodes = 0;
+		if (primitives.empty())
+			return;
+
+		nodes.emplace_back();
+		build(0, 0, int(primitives.size()));
+	}
+
+private:
+	static const int max_depth = 64;		// Deepest the tree is allowed to go
+	static const int bin_count = 12;		// Number of candidate split positions tried per axis
+	static const int max_leaf_size = 4;		// Nodes with more objects than this are always split
+	static const int min_leaf_size = 1;		// Nodes with this many objects or fewer are never split
+
+	std::vector<shared_ptr<hittable>> primitives;
+	std::vector<bvh_node> nodes;
+	int unused_nodes = 0;					// Nodes orphaned by rebuilding subtrees
+
+	// Fills in node (covering primitives [first, first + count)) and, unless it becomes a leaf, its children
+	void build(int node_index, int first, int count, int depth = 0)
+	{
+		aabb bounds;
+		aabb centroid_bounds;
+		for (int i = first; i < first + count; i++)
+		{
+			auto box = primitives[i]->bounding_box();
+			bounds.expand(box);
+			centroid_bounds.expand(box.centroid());
+		}
+		nodes[node_index].box = bounds;
+
+		int axis = centroid_bounds.longest_axis();
+		double axis_min = centroid_bounds.minimum[axis];
+		double axis_extent = centroid_bounds.maximum[axis] - axis_min;
+
+		// All centroids at one point (or too deep): nothing sensible to split
+		if (count <= min_leaf_size || axis_extent <= 0 || depth >= max_depth)
+		{
+			make_leaf(node_index, first, count);
+			return;
+		}
+
+		// Binned surface area heuristic (SAH). Drop every object into one of bin_count buckets by centroid,
+		// then for each boundary between buckets estimate the cost of splitting there as
+		//		area(left) * count(left) + area(right) * count(right)
+		// i.e. how many objects a random ray would need to test. Far cheaper than sorting, and nearly as good.
+		aabb bin_bounds[bin_count];
+		int bin_counts[bin_count] = {};
+		auto bin_of = [&](const shared_ptr<hittable>& object)
+		{
+			int bin = int(bin_count * (object->bounding_box().centroid()[axis] - axis_min) / axis_extent);
+			return std::min(bin, bin_count - 1);
+		};
+
+		for (int i = first; i < first + count; i++)
+		{
+			int bin = bin_of(primitives[i]);
+			bin_counts[bin]++;
+			bin_bounds[bin].expand(primitives[i]->bounding_box());
+		}
+
+		// Sweep from the right to get the area and count of everything right of each boundary
+		double right_area[bin_count];
+		int right_count[bin_count];
+		aabb sweep;
+		int sweep_count = 0;
+		for (int b = bin_count - 1; b > 0; b--)
+		{
+			sweep.expand(bin_bounds[b]);
+			sweep_count += bin_counts[b];
+			right_area[b] = sweep.surface_area();
+			right_count[b] = sweep_count;
+		}
+
+		// Then sweep from the left, finishing each boundary's cost
+		int best_split = -1;
+		double best_cost = infinity;
+		sweep = aabb();
+		sweep_count = 0;
+		for (int b = 1; b < bin_count; b++)
+		{
+			sweep.expand(bin_bounds[b - 1]);
+			sweep_count += bin_counts[b - 1];
+			if (sweep_count == 0 || right_count[b] == 0)
+				continue;
+
+			double cost = sweep.surface_area() * sweep_count + right_area[b] * right_count[b];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_split = b;
+			}
+		}
+
+		// Compare against testing every object in this node (costs are relative to this node's area)
+		double leaf_cost = bounds.surface_area() * count;
+		if (best_split < 0 || (count <= max_leaf_size && best_cost >= leaf_cost))
+		{
+			make_leaf(node_index, first, count);
+			return;
+		}
+
+		auto middle = std::partition(primitives.begin() + first, primitives.begin() + first + count,
+			[&](const shared_ptr<hittable>& object) { return bin_of(object) < best_split; });
+		int left_count = int(middle - (primitives.begin() + first));
+
+		int left_index = int(nodes.size());
+		nodes.emplace_back();
+		nodes.emplace_back();
+		nodes[node_index].left_first = left_index;
+		nodes[node_index].count = 0;
+		nodes[node_index].axis = axis;
+
+		build(left_index, first, left_count, depth + 1);
+		build(left_index + 1, first + left_count, count - left_count, depth + 1);
+	}
+
+	void make_leaf(int node_index, int first, int count)
+	{
+		nodes[node_index].left_first = first;
+		nodes[node_index].count = count;
+	}
+
+	// The objects under a node are always one contiguous run of primitives: from the first object
+	// of its leftmost leaf to the last object of its rightmost leaf
+	void primitive_range(int node_index, int& first, int& count) const
+	{
+		int left = node_index;
+		while (!nodes[left].is_leaf())
+			left = nodes[left].left_first;
+
+		int right = node_index;
+		while (!nodes[right].is_leaf())
+			right = nodes[right].left_first + 1;
+
+		first = nodes[left].left_first;
+		count = nodes[right].left_first + nodes[right].count - first;
+	}
+
+	// Number of nodes below node_index
+	int descendant_count(int node_index) const
+	{
+		const auto& node = nodes[node_index];
+		if (node.is_leaf())
+			return 0;
+
+		return 2 + descendant_count(node.left_first) + descendant_count(node.left_first + 1);
+	}
+
+	// Walks down from node_index (after a refit) looking for subtrees that hold changed objects
+	// and have grown too much, and rebuilds them. Untouched subtrees are skipped entirely.
+	void repair(int node_index, int depth, const std::vector<char>& changed, const std::vector<double>& old_areas)
+	{
+		int first, count;
+		primitive_range(node_index, first, count);
+
+		bool has_changed = false;
+		for (int i = first; i < first + count && !has_changed; i++)
+			has_changed = changed[i] != 0;
+
+		if (!has_changed || nodes[node_index].is_leaf())
+			return;
+
+		if (nodes[node_index].box.surface_area() > 2 * old_areas[node_index])
+		{
+			// The new subtree's nodes are appended to the array, so the old ones are left unused
+			unused_nodes += descendant_count(node_index);
+			build(node_index, first, count, depth);
+			return;
+		}
+
+		int left = nodes[node_index].left_first;
+		repair(left, depth + 1, changed, old_areas);
+		repair(left + 1, depth + 1, changed, old_areas);
+	}
+};
+
+#endif
@@ -0,0 +1,998 @@
+#pragma once
+
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include "rtweekend.h"
+
+#include "alias_table.h"
+#include "bdpt.h"
+#include "color.h"
+#include "environment.h"
+#include "film.h"
+#include "filter.h"
+#include "guiding.h"
+#include "hittable.h"
+#include "irradiance_cache.h"
+#include "lights.h"
+#include "material.h"
+#include "metropolis.h"
+#include "page_cache.h"
+#include "photon_map.h"
+#include "render_task.h"
+#include "sampler.h"
+#include "spectrum.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/// <summary>
+/// Thin lens camera. Builds rays for each pixel sample and renders the world into a film.
+/// Rays start from a random point on a lens disk and pass through the matching point on the focus plane,
+/// so anything on the focus plane is sharp and everything else is blurred (depth of field).
+/// </summary>
+class camera
+{
+public:
+	double aspect_ratio = 1.0;			// Ratio of image width over height
+	int image_width = 100;				// Rendered image width in pixel count
+	int samples_per_pixel = 16;			// Count of random samples for each pixel (rounded down to a square)
+	int max_depth = 10;					// Maximum number of ray bounces into scene
+	int tile_size = 16;					// Width and height of each block of pixels rendered together
+	int thread_count = 0;				// Number of render threads (0 = one per hardware thread)
+	bool pin_threads = true;			// Lock each render thread to its own CPU on multi-socket machines (keeps its memory local)
+	bool spectral = false;				// Trace four wavelengths per path instead of RGB (shows dispersion; slower)
+	bool bidirectional = false;			// Join paths from the camera to paths from the lights (see bdpt.h); not spectral
+	int caustic_photons = 0;			// Photons traced from the lights to render caustics (0 = none; see photon_map.h)
+	int caustic_neighbours = 50;		// Nearest photons averaged for each caustic estimate...
+	double caustic_radius = 0.25;		// ...from no further away than this
+	double irradiance_accuracy = 0;		// Error allowed reusing light between matte surfaces (0 = no irradiance cache)
+	int irradiance_rays = 256;			// Rays traced for each irradiance cache record (see irradiance_cache.h)
+	bool guided = false;				// Learn where light comes from and aim paths there (see guiding.h); not spectral
+	int guide_memory = 64;				// Most memory the learned directions may use, in MB
+	bool metropolis = false;			// Metropolis light transport: mutate paths that found light (see metropolis.h); not spectral
+	int metropolis_chains = 16;			// Markov chains per render thread that a Metropolis pass shares its mutations among
+
+	double vfov = 90;					// Vertical view angle (field of view)
+	point3 lookfrom = point3(0, 0, 0);	// Point camera is looking from
+	point3 lookat = point3(0, 0, -1);	// Point camera is looking at
+	vec3 vup = vec3(0, 1, 0);			// Camera-relative "up" direction
+
+	double defocus_angle = 0;			// Variation angle of rays through each pixel (0 = pinhole, no blur)
+	double focus_dist = 10;				// Distance from camera lookfrom point to plane of perfect focus
+
+	bool sky_background = true;			// Use the white to blue sky gradient for rays that miss everything...
+	color background = color(0, 0, 0);	// ...or else this flat colour
+	shared_ptr<environment_map> environment;	// ...unless there is an environment map, which takes precedence
+	bool sample_environment = true;		// Aim a shadow ray at the environment map's bright parts at each bounce
+	shared_ptr<light_set> lights;		// Lights that bidirectional paths start from (the scene's glowing spheres)
+
+	// Reconstruction filter used to splat samples into the film
+	shared_ptr<filter> pixel_filter = make_shared<box_filter>();
+
+	// Works out the image height and the ray geometry from the settings above.
+	// Call after changing any of them, before make_film or render_pass.
+	void initialize()
+	{
+		image_height = int(image_width / aspect_ratio);
+		image_height = (image_height < 1) ? 1 : image_height;
+
+		center = lookfrom;
+
+		// Determine viewport dimensions. The viewport sits on the focus plane.
+		auto theta = degrees_to_radians(vfov);
+		auto h = std::tan(theta / 2);
+		auto viewport_height = 2 * h * focus_dist;
+		auto viewport_width = viewport_height * (double(image_width) / image_height);
+
+		// Calculate the u,v,w unit basis vectors for the camera coordinate frame.
+		w = unit_vector(lookfrom - lookat);
+		u = unit_vector(cross(vup, w));
+		v = cross(w, u);
+
+		// Calculate the vectors across the horizontal and down the vertical viewport edges.
+		vec3 viewport_u = viewport_width * u;
+		vec3 viewport_v = viewport_height * -v;
+
+		// Calculate the horizontal and vertical delta vectors from pixel to pixel.
+		pixel_delta_u = viewport_u / image_width;
+		pixel_delta_v = viewport_v / image_height;
+
+		// Pixel (i, j) covers [i, i+1) x [j, j+1) in film coordinates, so this is the corner, not the centre.
+		pixel00_loc = center - (focus_dist * w) - viewport_u / 2 - viewport_v / 2;
+
+		// Calculate the camera defocus disk basis vectors.
+		auto defocus_radius = focus_dist * std::tan(degrees_to_radians(defocus_angle / 2));
+		defocus_disk_u = u * defocus_radius;
+		defocus_disk_v = v * defocus_radius;
+
+		film_area = (viewport_width / focus_dist) * (viewport_height / focus_dist);
+	}
+
+	// Returns an empty film the size of the image, using this camera's filter
+	film make_film() const
+	{
+		return film(image_width, image_height, *pixel_filter);
+	}
+
+	// Adds pass_samples more samples to every pixel of image.
+	// Calling this repeatedly on the same film renders progressively: the image gets less noisy with every pass.
+	// If given, tile_done is called (on the worker thread) with each tile once it has been merged into image.
+	// If task is given, the pass runs at its priority and stops early if it is cancelled. Returns false if it was.
+	bool render_pass(const hittable& world, film& image, thread_pool& pool, int pass_samples, bool show_progress = false,
+					 const std::function<void(const film_tile&)>& tile_done = nullptr, const render_task* task = nullptr) const
+	{
+		if (metropolis && !bidirectional && !spectral)
+			return render_metropolis(world, image, pool, pass_samples, show_progress, tile_done, task);
+
+		int tiles_x = (image_width + tile_size - 1) / tile_size;
+		int tiles_y = (image_height + tile_size - 1) / tile_size;
+		int tile_count = tiles_x * tiles_y;
+
+		// Every camera sample of a bidirectional render also traces one light path
+		if (bidirectional && !spectral)
+			image.add_light_paths(sampler(pass_samples).samples_per_pixel());
+
+		// Caustics found by path tracing are replaced by ones estimated from photons. They are traced for the first
+		// pass and kept with the film, like the path guide, so later passes don't trace them again.
+		int priority = task ? task->priority : priority_background;
+		const photon_map* caustics = nullptr;
+		if (caustic_photons > 0 && !bidirectional && !spectral && lights)
+		{
+			if (!image.caustics())
+				image.set_caustics(std::make_shared<photon_map>(trace_caustic_photons(world, *lights, caustic_photons, max_depth, pool, priority)));
+			caustics = image.caustics();
+		}
+
+		// The irradiance cache fills in as the tiles need it, and is kept with the film too, so later passes
+		// mostly reuse records rather than gathering new ones
+		irradiance_cache* irradiance = nullptr;
+		if (irradiance_accuracy > 0 && !bidirectional && !spectral)
+		{
+			if (!image.irradiance())
+				image.set_irradiance(std::make_shared<irradiance_cache>(world.bounding_box(), irradiance_accuracy));
+			irradiance = image.irradiance();
+		}
+
+		// The path guide lives with the film, so a progressive render keeps learning from pass to pass
+		path_guide* guide = nullptr;
+		if (guided && !bidirectional && !spectral)
+		{
+			if (!image.guide())
+				image.set_guide(std::make_shared<path_guide>(world.bounding_box(), std::size_t(guide_memory) << 20, samples_per_pixel));
+			guide = image.guide();
+		}
+
+		pass_caches caches;
+		caches.caustics = caustics && !caustics->empty() ? caustics : nullptr;
+		caches.irradiance = irradiance;
+		caches.guide = guide;
+
+		// Adds samples more samples to every pixel. Returns false if cancelling stopped it before every tile was merged.
+		auto render_samples = [&](int samples)
+		{
+			// Each thread takes the next unrendered tile until none are left, so fast and slow tiles balance out
+			std::atomic<int> next_tile(0);
+			std::atomic<int> tiles_done(0);
+			std::mutex log_mutex;
+
+			// Tiles that needed pages that weren't in memory yet (see page_faults), with the pages they were missing.
+			// They are taken again once there are no new tiles left, by which time the pages have usually arrived.
+			std::vector<deferred_tile> deferred_tiles;
+			std::mutex deferred_mutex;
+
+			auto worker = [&](int worker_index, int)
+			{
+				// One sampler per thread, as it holds per-pixel state.
+				// It and every tile are created here on the worker, so their memory is on the worker's NUMA node.
+				sampler pixel_sampler(samples);
+				auto& faults = page_faults::current();
+				std::vector<light_splat> splats;
+
+				while (true)
+				{
+					// Between tiles: give way to anything more urgent, then stop if this render is no longer wanted
+					pool.run_waiting(worker_index);
+					if (task && task->is_cancelled())
+						return;
+
+					int t = next_tile++;
+					bool retry = false;
+					if (t >= tile_count)
+					{
+						std::lock_guard<std::mutex> lock(deferred_mutex);
+						if (deferred_tiles.empty())
+							return;
+
+						t = take_deferred_tile(deferred_tiles);
+						retry = true;
+					}
+					int x0 = (t % tiles_x) * tile_size;
+					int y0 = (t / tiles_x) * tile_size;
+					film_tile tile = image.make_tile(x0, y0, x0 + tile_size, y0 + tile_size);
+
+					// A tile taken again waits for any pages it's missing, so that it is sure to finish this time
+					faults.clear();
+					faults.blocking = retry;
+					splats.clear();
+					bool rendered = render_tile(world, pixel_sampler, tile, splats, caches);
+					faults.blocking = false;
+
+					if (!rendered)
+					{
+						std::lock_guard<std::mutex> lock(deferred_mutex);
+						deferred_tiles.push_back(deferred_tile{ t, faults.pages });
+						continue;
+					}
+
+					image.merge_tile(tile);
+					for (const auto& splat : splats)
+						image.add_splat(splat.x, splat.y, splat.contribution);
+
+					if (tile_done)
+						tile_done(tile);
+
+					int done = ++tiles_done;
+					if (!show_progress)
+						continue;
+
+					// outputs number of tiles remaining. Refreshed each tile.
+					std::lock_guard<std::mutex> lock(log_mutex);
+					std::clog << "\rTiles remaining: " << (tile_count - done) << ' ' << std::flush;
+				}
+			};
+
+			pool.run(worker, priority);
+
+			// A cancel that arrives after the last tile was merged doesn't undo the pass
+			return tiles_done == tile_count;
+		};
+
+		if (!guide)
+			return render_samples(pass_samples);
+
+		// The pass is split where a learning iteration ends, so the samples after it are aimed with what it
+		// learned. Each part is kept to a square number of samples, as the sampler stratifies those.
+		int remaining = sampler(pass_samples).samples_per_pixel();
+		while (remaining > 0)
+		{
+			int samples = guide->samples_to_learn() > 0 ? std::min(remaining, guide->samples_to_learn()) : remaining;
+			int side = int(std::sqrt(double(samples)));
+			samples = side * side;
+
+			if (!render_samples(samples))
+				return false;
+			remaining -= samples;
+			guide->add_samples(samples);
+		}
+
+		return true;
+	}
+
+private:
+	/// <summary>
+	/// A tile put aside because it needed pages that weren't in memory, and which pages those were.
+	/// </summary>
+	class deferred_tile
+	{
+	public:
+		int index;
+		std::vector<std::pair<page_cache*, int>> missing;
+	};
+
+	/// <summary>
+	/// Light that a bidirectional path sends to a point of the film outside the pixel being rendered. Held
+	/// back until the tile is finished, so a tile that has to be taken again doesn't add its light twice.
+	/// </summary>
+	class light_splat
+	{
+	public:
+		double x, y;
+		color contribution;
+	};
+
+	/// <summary>
+	/// What every sample of a pass shares besides the scene: the caustic photon map, the irradiance cache and
+	/// the path guide, any of which may be missing.
+	/// </summary>
+	class pass_caches
+	{
+	public:
+		const photon_map* caustics = nullptr;
+		irradiance_cache* irradiance = nullptr;
+		path_guide* guide = nullptr;
+	};
+
+	int image_height = 0;		// Rendered image height
+	point3 center;				// Camera centre
+	point3 pixel00_loc;			// Location of the top-left corner of pixel 0, 0
+	vec3 pixel_delta_u;			// Offset to pixel to the right
+	vec3 pixel_delta_v;			// Offset to pixel below
+	vec3 u, v, w;				// Camera frame basis vectors
+	vec3 defocus_disk_u;		// Defocus disk horizontal radius
+	vec3 defocus_disk_v;		// Defocus disk vertical radius
+	double film_area = 0;		// Area of the image on a plane 1 unit in front of the lens
+
+	static constexpr double guide_fraction = 0.3;	// Share of guided bounces aimed by the guide rather than the surface
+
+	// Takes every sample for every pixel in the tile and splats them into it. Light that bidirectional paths
+	// send elsewhere on the film is added to splats.
+	// Gives up and returns false if a pixel needed a page that isn't in memory yet (see page_faults).
+	bool render_tile(const hittable& world, sampler& pixel_sampler, film_tile& tile, std::vector<light_splat>& splats,
+					 const pass_caches& caches) const
+	{
+		int spp = pixel_sampler.samples_per_pixel();
+		const auto& faults = page_faults::current();
+
+		for (int j = tile.y0; j < tile.y1; j++)
+		{
+			for (int i = tile.x0; i < tile.x1; i++)
+			{
+				pixel_sampler.start_pixel();
+
+				for (int s = 0; s < spp; s++)
+				{
+					auto offset = pixel_sampler.pixel_offset(s);
+					auto fx = i + 0.5 + offset.x();
+					auto fy = j + 0.5 + offset.y();
+
+					ray r = get_ray(fx, fy, pixel_sampler.lens_sample(s));
+					if (spectral)
+					{
+						wavelengths lambda(pixel_sampler.wavelength_sample(s));
+						tile.add_sample(fx, fy, lambda.to_rgb(spectral_ray_color(r, max_depth, world, lambda)));
+					}
+					else if (bidirectional)
+					{
+						tile.add_sample(fx, fy, bidirectional_color(r, world, splats));
+					}
+					else
+					{
+						tile.add_sample(fx, fy, ray_color(r, max_depth, world, 0, &caches));
+					}
+				}
+
+				// Checked per pixel rather than per tile, so little work is thrown away
+				if (!faults.empty())
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	// A pass of Metropolis light transport: pass_samples mutations per pixel, shared among metropolis_chains
+	// Markov chains for each of the pool's threads, which take them in turn. Fewer, longer chains explore
+	// better, as each has longer to find its way from where it started. Each chain starts from a path picked in proportion to
+	// its brightness from a first set of independent paths. Every mutation splats both the path proposed and the
+	// current one, weighted by the chance of accepting and of rejecting the proposal (Veach's expected values),
+	// so rejected proposals still count. The chains only find where the light is, not how much there is: that
+	// is the average brightness of the independent paths and of the chains' large steps, which are independent
+	// too, so the pass is splatted into a film of its own and added to image once it is known.
+	bool render_metropolis(const hittable& world, film& image, thread_pool& pool, int pass_samples, bool show_progress,
+						   const std::function<void(const film_tile&)>& tile_done, const render_task* task) const
+	{
+		int priority = task ? task->priority : priority_background;
+		long long mutations = (long long)pass_samples * image_width * image_height;
+		film pass_image = make_film();
+
+		auto brightness = [](const color& c)
+		{
+			double luminance = 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+			return std::isfinite(luminance) && luminance > 0 ? luminance : 0;
+		};
+
+		// Every bootstrap path gets its own seed, so a chain can start from it by tracing it again
+		int bootstrap_count = std::max(1 << 14, image_width * image_height);
+		std::uint64_t base_seed = (std::uint64_t(random_double() * 4294967296.0) << 32) | std::uint64_t(random_double() * 4294967296.0);
+		std::vector<double> weights(bootstrap_count);
+		std::atomic<int> next_batch(0);
+		const int batch_size = 256;
+		pool.run([&](int, int)
+		{
+			// A chain can't put a path aside until its geometry is loaded, so this waits for it
+			auto& faults = page_faults::current();
+			faults.blocking = true;
+			for (int first = next_batch++ * batch_size; first < bootstrap_count; first = next_batch++ * batch_size)
+			{
+				for (int i = first; i < std::min(first + batch_size, bootstrap_count); i++)
+				{
+					pss_sampler chain(base_seed + i);
+					random_source_scope scope(chain);
+					double fx, fy;
+					weights[i] = brightness(metropolis_path(world, fx, fy));
+				}
+			}
+			faults.blocking = false;
+		}, priority);
+
+		double total = 0;
+		for (double weight : weights)
+			total += weight;
+		long long independent_paths = bootstrap_count;
+		bool found_light = total > 0;
+		if (task && task->is_cancelled())
+			return false;
+
+		// Chains stratify their starts over the bootstrap paths' brightness
+		int chain_count = int(std::max(1LL, std::min((long long)metropolis_chains * pool.size(), mutations)));
+		alias_table starts(weights, pool, priority);
+		std::atomic<int> next_chain(0);
+		std::atomic<int> chains_done(0);
+		std::mutex total_mutex;
+		std::mutex log_mutex;
+		pool.run([&](int worker_index, int)
+		{
+			auto& faults = page_faults::current();
+			faults.blocking = true;
+			while (found_light)
+			{
+				pool.run_waiting(worker_index);
+				if (task && task->is_cancelled())
+					break;
+
+				int c = next_chain++;
+				if (c >= chain_count)
+					break;
+
+				// The chain starts by tracing its bootstrap path again, then mutates it with numbers of its own, so
+				// chains that start from the same path still go their separate ways
+				double remapped;
+				pss_sampler chain(base_seed + starts.sample((c + random_double()) / chain_count, remapped));
+				random_source_scope scope(chain);
+				double x, y;
+				color current = metropolis_path(world, x, y);
+				double current_brightness = brightness(current);
+				chain.reseed(base_seed ^ (std::uint64_t(c + 1) * 0xd1b54a32d192ed03));
+
+				long long chain_mutations = mutations * (c + 1) / chain_count - mutations * c / chain_count;
+				double large_step_total = 0;
+				long long large_steps = 0;
+				bool cancelled = false;
+				for (long long m = 0; m < chain_mutations; m++)
+				{
+					if ((m & 4095) == 0 && task && task->is_cancelled())
+					{
+						cancelled = true;
+						break;
+					}
+
+					chain.start_iteration();
+					double proposed_x, proposed_y;
+					color proposed = metropolis_path(world, proposed_x, proposed_y);
+					double proposed_brightness = brightness(proposed);
+					if (chain.is_large_step())
+					{
+						large_step_total += proposed_brightness;
+						large_steps++;
+					}
+
+					double accept = current_brightness > 0 ? std::fmin(1.0, proposed_brightness / current_brightness) : 1;
+					if (proposed_brightness > 0)
+						pass_image.add_splat(proposed_x, proposed_y, (accept / proposed_brightness) * proposed);
+					if (current_brightness > 0)
+						pass_image.add_splat(x, y, ((1 - accept) / current_brightness) * current);
+
+					if (chain.fresh() < accept)
+					{
+						x = proposed_x;
+						y = proposed_y;
+						current = proposed;
+						current_brightness = proposed_brightness;
+						chain.accept();
+					}
+					else
+					{
+						chain.reject();
+					}
+				}
+
+				{
+					std::lock_guard<std::mutex> lock(total_mutex);
+					total += large_step_total;
+					independent_paths += large_steps;
+				}
+				if (cancelled)
+					break;
+
+				int done = ++chains_done;
+				if (!show_progress)
+					continue;
+
+				std::lock_guard<std::mutex> lock(log_mutex);
+				std::clog << "\rChains remaining: " << (chain_count - done) << ' ' << std::flush;
+			}
+			faults.blocking = false;
+		}, priority);
+
+		// A cancel that arrives after the last chain finished doesn't undo the pass
+		if (found_light && chains_done < chain_count)
+			return false;
+
+		image.add_splats(pass_image, total / independent_paths);
+		image.add_light_paths(pass_samples);
+
+		// Light lands anywhere on the film, so every tile is done at once
+		if (tile_done)
+		{
+			for (int y0 = 0; y0 < image_height; y0 += tile_size)
+				for (int x0 = 0; x0 < image_width; x0 += tile_size)
+					tile_done(image.make_tile(x0, y0, x0 + tile_size, y0 + tile_size));
+		}
+
+		return true;
+	}
+
+	// Traces the path that a chain's numbers make, with a random_source_scope for the chain open: the first two
+	// pick the point on the film (set to (fx, fy)), the next two the point on the lens, and ray_color takes the rest
+	color metropolis_path(const hittable& world, double& fx, double& fy) const
+	{
+		fx = random_double() * image_width;
+		fy = random_double() * image_height;
+		double lens_u = random_double();
+		double lens_v = random_double();
+		return ray_color(get_ray(fx, fy, square_to_disk(lens_u, lens_v)), max_depth, world);
+	}
+
+	// Removes and returns a deferred tile, preferring one whose missing pages have all been loaded since
+	static int take_deferred_tile(std::vector<deferred_tile>& deferred_tiles)
+	{
+		size_t chosen = 0;
+		for (size_t i = 0; i < deferred_tiles.size(); i++)
+		{
+			bool ready = true;
+			for (const auto& page : deferred_tiles[i].missing)
+				ready = ready && page.first->is_resident(page.second);
+
+			if (ready)
+			{
+				chosen = i;
+				break;
+			}
+		}
+
+		int t = deferred_tiles[chosen].index;
+		deferred_tiles.erase(deferred_tiles.begin() + chosen);
+		return t;
+	}
+
+	// Constructs a camera ray through film position (fx, fy), starting from the point on the lens
+	// given by lens_point (a point on the unit disk).
+	ray get_ray(double fx, double fy, const vec3& lens_point) const
+	{
+		auto pixel_sample = pixel00_loc + (fx * pixel_delta_u) + (fy * pixel_delta_v);
+
+		auto ray_origin = (defocus_angle <= 0)
+			? center
+			: center + (lens_point.x() * defocus_disk_u) + (lens_point.y() * defocus_disk_v);
+		auto ray_direction = pixel_sample - ray_origin;
+
+		return ray(ray_origin, ray_direction);
+	}
+
+	// scatter_pdf is the density with which the last bounce picked r's direction, or 0 if it was the camera or a
+	// surface like glass: it weighs what r finds in the environment against the shadow rays aimed at it.
+	// With a caustic photon map, the first matte surface the path reaches adds the caustic light the photons
+	// found there, and light reaching that surface through glass or mirrors is left to the photons instead.
+	// Caustics seen in a matte surface further along are path traced, as they are blurred anyway.
+	// With an irradiance cache, the light arriving at that first matte surface comes from the cache.
+	// With a path guide, matte surfaces aim some of their bounces where the guide has learned light comes from.
+	color ray_color(const ray& r, int depth, const hittable& world, double scatter_pdf = 0,
+					const pass_caches* caches = nullptr, int matte_bounces = 0) const
+	{
+		// If we've exceeded the ray bounce limit, no more light is gathered.
+		if (depth <= 0)
+			return color(0, 0, 0);
+
+		hit_record rec;
+
+		// 0.001 rather than 0 ignores hits very close to the surface the ray started on ("shadow acne")
+		if (!world.hit(r, 0.001, infinity, rec))
+			return environment_weight(r, scatter_pdf) * background_color(r);
+
+		ray scattered;
+		color attenuation;
+		color color_from_emission = rec.mat->emitted();
+		if (caches && caches->caustics && matte_bounces == 1 && scatter_pdf == 0 && !color_from_emission.near_zero() && lights->find(rec) >= 0)
+			color_from_emission = color(0, 0, 0);
+
+		// Where the bounce is guided (see guided_scatter), shadow rays are weighed against the guided density too
+		const directional_tree* learned = nullptr;
+		bool cached = caches && caches->irradiance && matte_bounces == 0;
+		if (caches && caches->guide && !cached && matte_bounces < 2 && !rec.normal.near_zero())
+			learned = caches->guide->sampling_tree(rec.p);
+
+		color light_weight, radiance;
+		if (sample_environment_light(r, rec, world, light_weight, radiance, learned))
+			color_from_emission += light_weight * radiance;
+
+		if (!rec.mat->scatter(r, rec, attenuation, scattered))
+			return color_from_emission;
+
+		double pdf = rec.mat->scattering_pdf(r, rec, unit_vector(scattered.direction()));
+		bool first_matte = caches && matte_bounces == 0 && pdf > 0 && !rec.normal.near_zero();
+		if (first_matte && caches->caustics)
+			color_from_emission += caches->caustics->radiance(r, rec, caustic_neighbours, caustic_radius);
+
+		if (first_matte && caches->irradiance)
+			return color_from_emission + attenuation * cached_irradiance(rec, depth, world, *caches);
+
+		if (caches && caches->guide && pdf > 0 && !rec.normal.near_zero())
+			return color_from_emission + guided_scatter(r, rec, scattered, depth, world, *caches, matte_bounces, learned);
+
+		color color_from_scatter = attenuation * ray_color(scattered, depth - 1, world, pdf, caches, matte_bounces + (pdf > 0));
+
+		return color_from_emission + color_from_scatter;
+	}
+
+	// Light that matte surface rec scatters back along r_in. Picks the bounce from the surface (scattered, which
+	// it has already picked) or from learned, the directions the guide learned nearby, and weighs it by the
+	// density of either picking it (see guided_pdf). Records what the bounce found so that later iterations
+	// learn from it.
+	// Only the first two matte bounces are aimed, and only some of the time: where the guide has missed some
+	// light, a bounce the surface picks towards it counts for more than it would unguided, and over a long path
+	// that adds up to bright specks. Later bounces carry too little light to be worth that, but still record.
+	color guided_scatter(const ray& r_in, const hit_record& rec, const ray& scattered, int depth, const hittable& world,
+						 const pass_caches& caches, int matte_bounces, const directional_tree* learned) const
+	{
+		vec3 direction = unit_vector(scattered.direction());
+		if (learned && random_double() < guide_fraction)
+		{
+			double unused;
+			direction = learned->sample(unused);
+			if (dot(direction, rec.normal) < 0)
+				direction = mirror(direction, rec.normal);
+		}
+
+		double pdf = guided_pdf(r_in, rec, direction, learned);
+		color scattering = rec.mat->scattering(r_in, rec, direction);
+		if (pdf <= 0 || scattering.near_zero())
+			return color(0, 0, 0);
+
+		color incoming = ray_color(ray(rec.p, direction), depth - 1, world, pdf, &caches, matte_bounces + 1);
+		double luminance = 0.2126 * incoming.x() + 0.7152 * incoming.y() + 0.0722 * incoming.z();
+		caches.guide->record(rec.p, direction, luminance / pdf);
+
+		return (scattering / pdf) * incoming;
+	}
+
+	// Density with which a bounce from rec along r_in picks direction: the surface's own, or, with learned
+	// directions, the mix of it and the guide's that guided_scatter picks from. The guide knows nothing of the
+	// surface, so a direction it picks below it is mirrored above it, and the guide's density of a direction is
+	// that of picking either it or its mirror image.
+	double guided_pdf(const ray& r_in, const hit_record& rec, const vec3& direction, const directional_tree* learned) const
+	{
+		double surface_pdf = rec.mat->scattering_pdf(r_in, rec, direction);
+		if (!learned)
+			return surface_pdf;
+
+		double guide_pdf = learned->pdf(direction) + learned->pdf(mirror(direction, rec.normal));
+		return (1 - guide_fraction) * surface_pdf + guide_fraction * guide_pdf;
+	}
+
+	// d reflected in the plane with unit normal n
+	static vec3 mirror(const vec3& d, const vec3& n)
+	{
+		return d - 2 * dot(d, n) * n;
+	}
+
+	// Light arriving at matte surface rec from the hemisphere above it, over pi, from caches' irradiance cache.
+	// If no record is close enough, traces irradiance_rays rays from rec to make one. Its radius is the harmonic
+	// mean distance those rays travelled, kept to between a few and a few tens of pixels' width.
+	color cached_irradiance(const hit_record& rec, int depth, const hittable& world, const pass_caches& caches) const
+	{
+		auto& cache = *caches.irradiance;
+		color irradiance;
+		if (cache.lookup(rec.p, rec.normal, irradiance))
+			return irradiance;
+
+		// A frame around the normal, for cosine-distributed directions from stratified points on a disk
+		vec3 normal = rec.normal;
+		vec3 tangent = unit_vector(cross(std::fabs(normal.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0), normal));
+		vec3 bitangent = cross(normal, tangent);
+
+		int strata = std::max(1, int(std::sqrt(double(irradiance_rays))));
+		color sum(0, 0, 0);
+		int used = 0;
+		double inverse_distances = 0;
+		for (int j = 0; j < strata; j++)
+		{
+			for (int i = 0; i < strata; i++)
+			{
+				double radius = std::sqrt((j + random_double()) / strata);
+				double phi = 2 * pi * (i + random_double()) / strata;
+				double cos_theta = std::sqrt(std::fmax(0.0, 1 - radius * radius));
+				vec3 direction = radius * std::cos(phi) * tangent + radius * std::sin(phi) * bitangent + cos_theta * normal;
+
+				// Rays into a wall meeting this surface closer than ray_color looks would pass through it, so at
+				// the edges of rooms they are left out rather than letting in light from outside
+				ray gather(rec.p, direction);
+				hit_record nearest;
+				bool hit = world.hit(gather, 1e-6, infinity, nearest);
+				if (hit)
+					inverse_distances += 1 / std::fmax(nearest.t, 0.001);
+				if (hit && nearest.t < 0.001)
+					continue;
+
+				sum += ray_color(gather, depth - 1, world, cos_theta / pi, &caches, 1);
+				used++;
+			}
+		}
+
+		// The width of a pixel at rec, and the distance the record can reach limited to 2.5 to 25 of those
+		double pixel_width = (rec.p - center).length() * degrees_to_radians(vfov) / image_height;
+		double accuracy = irradiance_accuracy;
+		double radius = inverse_distances > 0 ? strata * strata / inverse_distances : infinity;
+		radius = clamp(radius, 2.5 * pixel_width / accuracy, 25 * pixel_width / accuracy);
+
+		// A gather that needed pages not yet in memory is missing their light, and its tile will be rendered again
+		irradiance = used > 0 ? sum / used : color(0, 0, 0);
+		if (page_faults::current().empty())
+			cache.add(irradiance_record{ rec.p, rec.normal, irradiance, radius });
+		return irradiance;
+	}
+
+	// ray_color for a spectral path: the light arriving at each of lambda's wavelengths
+	spectrum spectral_ray_color(const ray& r, int depth, const hittable& world, wavelengths& lambda,
+								double scatter_pdf = 0) const
+	{
+		if (depth <= 0)
+			return spectrum(0);
+
+		hit_record rec;
+		if (!world.hit(r, 0.001, infinity, rec))
+			return lambda.from_rgb(background_color(r)) * float(environment_weight(r, scatter_pdf));
+
+		ray scattered;
+		spectrum attenuation;
+		spectrum from_emission = lambda.from_rgb(rec.mat->emitted());
+
+		color light_weight, radiance;
+		if (sample_environment_light(r, rec, world, light_weight, radiance))
+			from_emission += lambda.from_rgb(light_weight) * lambda.from_rgb(radiance);
+
+		if (!rec.mat->scatter_spectral(r, rec, lambda, attenuation, scattered) || attenuation.is_black())
+			return from_emission;
+
+		double pdf = rec.mat->scattering_pdf(r, rec, unit_vector(scattered.direction()));
+		return from_emission + attenuation * spectral_ray_color(scattered, depth - 1, world, lambda, pdf);
+	}
+
+	// Aims a shadow ray from rec at a direction picked from the environment map. If it reaches the map, returns
+	// true with the light found (radiance) and what to multiply it by: the surface's scattering over the
+	// direction's density, weighted against the bounce finding the same light (multiple importance sampling).
+	// With learned, the bounce is guided, and picks directions with guided_pdf rather than the surface's density.
+	bool sample_environment_light(const ray& r_in, const hit_record& rec, const hittable& world,
+								  color& weight, color& radiance, const directional_tree* learned = nullptr) const
+	{
+		if (!environment || !sample_environment)
+			return false;
+
+		double light_pdf;
+		vec3 direction = environment->sample(random_double(), random_double(), light_pdf, radiance);
+		if (light_pdf <= 0)
+			return false;
+
+		// Mirrors, glass and the back of a surface scatter nothing towards the light, so no ray is needed
+		color scattering = rec.mat->scattering(r_in, rec, direction);
+		if (scattering.near_zero())
+			return false;
+
+		if (world.occluded(ray(rec.p, direction), 0.001, infinity))
+			return false;
+
+		double scatter_pdf = guided_pdf(r_in, rec, direction, learned);
+		weight = (power_heuristic(light_pdf, scatter_pdf) / light_pdf) * scattering;
+		return true;
+	}
+
+	// How much of the environment a scattered ray finds counts, given the density scatter_pdf with which its
+	// direction was picked: the rest is left to the shadow rays of sample_environment_light
+	double environment_weight(const ray& r, double scatter_pdf) const
+	{
+		if (!environment || !sample_environment || scatter_pdf <= 0)
+			return 1;
+
+		return power_heuristic(scatter_pdf, environment->pdf(r.direction()));
+	}
+
+	// Light arriving along camera ray r, by bidirectional path tracing: traces a path from the camera and one
+	// from a light, and joins every part of one to every part of the other, weighting each join by how well it
+	// samples its paths against the others. Joins straight to the camera land elsewhere on the film, so they
+	// are added to splats instead.
+	color bidirectional_color(const ray& r, const hittable& world, std::vector<light_splat>& splats) const
+	{
+		// Kept between samples so that paths don't allocate
+		thread_local std::vector<path_vertex> camera_path, light_path;
+		camera_path.clear();
+		light_path.clear();
+
+		path_vertex eye;
+		eye.type = path_vertex::kind::camera;
+		eye.p = r.origin();
+		eye.beta = color(1, 1, 1);
+		eye.forward = -w;
+		eye.film_area = film_area;
+		camera_path.push_back(eye);
+
+		color result(0, 0, 0);
+		ray walk = r;
+		color beta(1, 1, 1);
+		double cos_theta = dot(unit_vector(r.direction()), -w);
+		double camera_pdf = 1 / (film_area * cos_theta * cos_theta * cos_theta);
+		if (random_walk(world, lights.get(), walk, beta, camera_pdf, max_depth + 1, camera_path))
+			result += beta * background_color(walk);
+
+		if (lights && !lights->empty())
+			trace_light_path(world, light_path);
+
+		for (int t = 1; t <= int(camera_path.size()); t++)
+		{
+			for (int s = 0; s <= int(light_path.size()); s++)
+			{
+				// A path of s + t vertices has s + t - 1 segments, and max_depth allows as many as ray_color
+				if ((s == 1 && t == 1) || s + t < 2 || s + t - 1 > max_depth)
+					continue;
+
+				if (t == 1)
+				{
+					double fx, fy;
+					auto light = join_to_camera(world, light_path, camera_path, s, fx, fy);
+					if (!light.near_zero())
+						splats.push_back(light_splat{ fx, fy, light });
+				}
+				else
+				{
+					result += join_paths(world, light_path, camera_path, s, t);
+				}
+			}
+		}
+
+		return result;
+	}
+
+	// Fills path with a path traced from a point on a light, picked in proportion to the lights' power
+	void trace_light_path(const hittable& world, std::vector<path_vertex>& path) const
+	{
+		path_vertex start;
+		start.type = path_vertex::kind::light;
+		start.light = lights->pick(random_double());
+		start.p = lights->sample_point(start.light, random_double(), random_double(), start.normal);
+		start.pdf_fwd = start.light_origin_pdf(*lights);
+		start.beta = color(1, 1, 1) / start.pdf_fwd;
+		path.push_back(start);
+
+		// Leaves in a cosine distribution about the normal, so emission's cosine over its density is pi
+		auto direction = start.normal + random_unit_vector();
+		if (direction.near_zero())
+			direction = start.normal;
+		direction = unit_vector(direction);
+
+		ray walk(start.p, direction);
+		color beta = start.beta * pi * (*lights)[start.light].emit;
+		double pdf_dir = dot(start.normal, direction) / pi;
+		random_walk(world, lights.get(), walk, beta, pdf_dir, max_depth, path);
+	}
+
+	// Light along the path made of the first s vertices of light_path and the first t of camera_path (t >= 2),
+	// weighted for multiple importance sampling. When s = 1 a new point is picked on a light instead.
+	color join_paths(const hittable& world, std::vector<path_vertex>& light_path, std::vector<path_vertex>& camera_path,
+					 int s, int t) const
+	{
+		auto& pt = camera_path[t - 1];
+		if (s == 0)
+		{
+			// The camera path found a light by itself. Lights that can't be sampled can't be found any other way.
+			auto emitted = pt.rec.mat->emitted();
+			if (emitted.near_zero())
+				return color(0, 0, 0);
+
+			double weight = pt.light >= 0 ? mis_weight(light_path, camera_path, nullptr, s, t, *lights) : 1;
+			return weight * pt.beta * emitted;
+		}
+
+		if (pt.delta)
+			return color(0, 0, 0);
+
+		path_vertex sampled;
+		const path_vertex* qs = &light_path[s - 1];
+		if (s == 1)
+		{
+			sampled.type = path_vertex::kind::light;
+			sampled.light = lights->pick(random_double());
+			sampled.p = lights->sample_point(sampled.light, random_double(), random_double(), sampled.normal);
+			sampled.pdf_fwd = sampled.light_origin_pdf(*lights);
+			sampled.beta = color(1, 1, 1) / sampled.pdf_fwd;
+			qs = &sampled;
+		}
+		else if (qs->delta)
+		{
+			return color(0, 0, 0);
+		}
+
+		vec3 d = qs->p - pt.p;
+		double distance = d.length();
+		vec3 direction = d / distance;
+
+		auto light = qs->beta * qs->f(-direction, *lights) * pt.f(direction, *lights) * pt.beta / (distance * distance);
+		if (light.near_zero() || world.occluded(ray(pt.p, direction), 0.001, distance - 0.001))
+			return color(0, 0, 0);
+
+		return mis_weight(light_path, camera_path, &sampled, s, t, *lights) * light;
+	}
+
+	// Light from the path made of the first s vertices of light_path (s >= 2) joined to a new point on the lens,
+	// weighted for multiple importance sampling. Sets (fx, fy) to where on the film it lands.
+	color join_to_camera(const hittable& world, std::vector<path_vertex>& light_path, std::vector<path_vertex>& camera_path,
+						 int s, double& fx, double& fy) const
+	{
+		const auto& qs = light_path[s - 1];
+		if (qs.delta)
+			return color(0, 0, 0);
+
+		auto lens_point = square_to_disk(random_double(), random_double());
+		path_vertex eye;
+		eye.type = path_vertex::kind::camera;
+		eye.p = (defocus_angle <= 0) ? center : center + (lens_point.x() * defocus_disk_u) + (lens_point.y() * defocus_disk_v);
+		eye.forward = -w;
+		eye.film_area = film_area;
+
+		if (!film_position(eye.p, qs.p, fx, fy))
+			return color(0, 0, 0);
+
+		vec3 d = eye.p - qs.p;
+		double distance = d.length();
+		vec3 direction = d / distance;
+		double cos_theta = dot(-direction, eye.forward);
+
+		// The camera's response (importance) to light arriving at this angle, over the density of picking the
+		// lens point, and the geometry of the join: every factor of the lens area cancels out
+		auto light = qs.beta * qs.f(direction, *lights) / (film_area * cos_theta * cos_theta * cos_theta * distance * distance);
+		if (light.near_zero() || world.occluded(ray(qs.p, direction), 0.001, distance - 0.001))
+			return color(0, 0, 0);
+
+		return mis_weight(light_path, camera_path, &eye, s, 1, *lights) * light;
+	}
+
+	// Where on the film the line from a point on the lens to p passes (in pixels, like the samples' fx, fy).
+	// Returns false if that is outside the image, or p is behind the camera.
+	bool film_position(const point3& lens, const point3& p, double& fx, double& fy) const
+	{
+		vec3 d = p - lens;
+		double along = dot(d, -w);
+		if (along <= 0)
+			return false;
+
+		// Every lens point is level with the camera centre, so the focus plane is focus_dist in front of it too
+		auto offset = lens + (focus_dist / along) * d - pixel00_loc;
+		fx = dot(offset, pixel_delta_u) / pixel_delta_u.length_squared();
+		fy = dot(offset, pixel_delta_v) / pixel_delta_v.length_squared();
+		return 0 <= fx && fx < image_width && 0 <= fy && fy < image_height;
+	}
+
+	// Light arriving from a ray that hit nothing
+	color background_color(const ray& r) const
+	{
+		if (environment)
+			return environment->lookup(r.direction());
+
+		if (!sky_background)
+			return background;
+
+		// Blend from white at the bottom to blue at the top
+		vec3 unit_direction = unit_vector(r.direction());
+		auto a = 0.5 * (unit_direction.y() + 1.0);
+		return (1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0);
+	}
+};
+
+#endif
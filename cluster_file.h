@@ -0,0 +1,382 @@
+#pragma once
+
+#ifndef CLUSTER_FILE_H
+#define CLUSTER_FILE_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "page_cache.h"
+#include "scene_tokenizer.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Cluster files hold a scene's geometry split into clusters of nearby objects, each of which can be read
+// on its own. Layout (all numbers in the machine's byte order):
+//
+//		"RTCL" u32 version
+//		u32 material count, then for each: u32 length, name bytes
+//		u32 cluster count, then for each: 6 doubles (box min xyz, max xyz), u64 file offset, u32 sphere count,
+//			u32 BVH node count
+//		the clusters, one after another, each being
+//			its spheres: 4 doubles (centre xyz, radius), u32 material index
+//			its BVH's nodes: 6 doubles (box), i32 left_first, i32 count, i32 axis
+//
+// Each cluster's BVH is built when the file is written, so loading a cluster is just reading it.
+// Materials are stored by name and looked up in the scene that uses the file, so they stay in memory
+// (and can be edited) while the geometry is paged.
+
+/// <summary>
+/// One sphere as stored in a cluster file
+/// </summary>
+class packed_sphere
+{
+public:
+	point3 center;
+	double radius = 0;
+	uint32_t material = 0;
+};
+
+/// <summary>
+/// Where a cluster is in its file, and the box around it
+/// </summary>
+class cluster_info
+{
+public:
+	aabb box;
+	uint64_t offset = 0;
+	uint32_t count = 0;
+	uint32_t node_count = 0;
+};
+
+const uint32_t cluster_file_version = 1;
+const size_t packed_sphere_size = 4 * sizeof(double) + sizeof(uint32_t);
+const size_t packed_node_size = 6 * sizeof(double) + 3 * sizeof(int32_t);
+const size_t packed_cluster_info_size = 6 * sizeof(double) + sizeof(uint64_t) + 2 * sizeof(uint32_t);
+
+template <typename T>
+inline void write_value(std::ostream& out, const T& value)
+{
+	out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+inline T read_value(std::istream& in)
+{
+	T value{};
+	in.read(reinterpret_cast<char*>(&value), sizeof(T));
+	return value;
+}
+
+// Sorts spheres[first, first + count) into clusters of at most cluster_size by splitting at the median along
+// the longest axis of their centres, so each cluster is compact and a ray only touches a few of them.
+inline void split_clusters(std::vector<packed_sphere>& spheres, size_t first, size_t count, size_t cluster_size,
+						   std::vector<std::pair<size_t, size_t>>& clusters)
+{
+	if (count <= cluster_size)
+	{
+		clusters.emplace_back(first, count);
+		return;
+	}
+
+	aabb centres;
+	for (size_t i = first; i < first + count; i++)
+		centres.expand(spheres[i].center);
+	int axis = centres.longest_axis();
+
+	auto begin = spheres.begin() + first;
+	auto middle = begin + count / 2;
+	std::nth_element(begin, middle, begin + count, [axis](const packed_sphere& a, const packed_sphere& b)
+	{
+		return a.center[axis] < b.center[axis];
+	});
+
+	split_clusters(spheres, first, count / 2, cluster_size, clusters);
+	split_clusters(spheres, first + count / 2, count - count / 2, cluster_size, clusters);
+}
+
+// Writes the spheres of a scene file's text to a cluster file at path, cluster_size spheres at most per cluster.
+// Everything other than sphere statements is ignored, so the scene itself can go on being used for its
+// materials and camera. Returns the number of clusters written. Throws scene_error if a sphere statement is
+// invalid or the file can't be written.
+inline size_t write_cluster_file(std::string_view scene_text, const std::string& path, size_t cluster_size = 4096)
+{
+	std::vector<packed_sphere> spheres;
+	std::vector<std::string> material_names;
+	std::unordered_map<std::string_view, uint32_t> material_indices;
+
+	scene_tokenizer tokens(scene_text);
+	while (tokens.next_line())
+	{
+		if (tokens.word() != "sphere")
+			continue;
+
+		packed_sphere packed;
+		packed.center = tokens.vector();
+		packed.radius = tokens.number();
+
+		auto name = tokens.word();
+		auto found = material_indices.find(name);
+		if (found == material_indices.end())
+		{
+			found = material_indices.emplace(name, uint32_t(material_names.size())).first;
+			material_names.emplace_back(name);
+		}
+		packed.material = found->second;
+
+		spheres.push_back(packed);
+	}
+
+	std::vector<std::pair<size_t, size_t>> clusters;
+	if (!spheres.empty())
+		split_clusters(spheres, 0, spheres.size(), std::max<size_t>(cluster_size, 1), clusters);
+
+	std::ofstream out(path, std::ios::binary);
+	if (!out)
+		throw scene_error("can't write cluster file '" + path + "'");
+
+	out.write("RTCL", 4);
+	write_value(out, cluster_file_version);
+
+	write_value(out, uint32_t(material_names.size()));
+	for (const auto& name : material_names)
+	{
+		write_value(out, uint32_t(name.size()));
+		out.write(name.data(), std::streamsize(name.size()));
+	}
+
+	// Build each cluster's BVH now, putting its spheres in the order the tree's leaves refer to them
+	std::vector<packed_sphere> ordered;
+	std::vector<std::vector<bvh_node>> cluster_nodes;
+	for (const auto& cluster : clusters)
+	{
+		// Only the boxes matter to the build, so these spheres don't need materials
+		hittable_list objects;
+		std::unordered_map<const hittable*, size_t> source;
+		for (size_t i = cluster.first; i < cluster.first + cluster.second; i++)
+		{
+			auto object = make_shared<sphere>(spheres[i].center, spheres[i].radius, nullptr);
+			source[object.get()] = i;
+			objects.add(object);
+		}
+
+		bvh tree(objects);
+		for (const auto& object : tree.primitive_order())
+			ordered.push_back(spheres[source[object.get()]]);
+		cluster_nodes.push_back(tree.tree_nodes());
+	}
+
+	// The clusters' data starts straight after the index
+	uint64_t offset = uint64_t(out.tellp()) + sizeof(uint32_t) + clusters.size() * packed_cluster_info_size;
+
+	write_value(out, uint32_t(clusters.size()));
+	for (size_t c = 0; c < clusters.size(); c++)
+	{
+		const auto& nodes = cluster_nodes[c];
+		auto box = nodes.empty() ? aabb() : nodes[0].box;
+
+		for (int a = 0; a < 3; a++)
+			write_value(out, box.minimum[a]);
+		for (int a = 0; a < 3; a++)
+			write_value(out, box.maximum[a]);
+		write_value(out, offset);
+		write_value(out, uint32_t(clusters[c].second));
+		write_value(out, uint32_t(nodes.size()));
+
+		offset += clusters[c].second * packed_sphere_size + nodes.size() * packed_node_size;
+	}
+
+	size_t next = 0;
+	for (size_t c = 0; c < clusters.size(); c++)
+	{
+		for (size_t i = 0; i < clusters[c].second; i++, next++)
+		{
+			for (int a = 0; a < 3; a++)
+				write_value(out, ordered[next].center[a]);
+			write_value(out, ordered[next].radius);
+			write_value(out, ordered[next].material);
+		}
+
+		for (const auto& node : cluster_nodes[c])
+		{
+			for (int a = 0; a < 3; a++)
+				write_value(out, node.box.minimum[a]);
+			for (int a = 0; a < 3; a++)
+				write_value(out, node.box.maximum[a]);
+			write_value(out, int32_t(node.left_first));
+			write_value(out, int32_t(node.count));
+			write_value(out, int32_t(node.axis));
+		}
+	}
+
+	if (!out)
+		throw scene_error("couldn't finish writing cluster file '" + path + "'");
+
+	return clusters.size();
+}
+
+/// <summary>
+/// The geometry in a cluster file, read a cluster at a time as rays reach it.
+/// Only the cluster index is read up front: a box per cluster, which a small BVH of paged_hittables is built
+/// over. A cluster is read, and its own BVH built, the first time a ray enters its box, and dropped again when
+/// the clusters in memory take up more than the memory limit.
+/// </summary>
+class paged_geometry : public hittable
+{
+public:
+	// materials maps the names used in the file to the scene's materials. memory_limit is in bytes (0 = no limit).
+	// Throws scene_error if the file can't be read or uses a material that isn't in materials.
+	paged_geometry(const std::string& path, const std::unordered_map<std::string, shared_ptr<material>>& materials,
+				   size_t memory_limit)
+		: cache(make_shared<page_cache>(2, memory_limit))
+	{
+		std::ifstream in(path, std::ios::binary);
+		char magic[4] = {};
+		in.read(magic, 4);
+		if (!in || std::memcmp(magic, "RTCL", 4) != 0 || read_value<uint32_t>(in) != cluster_file_version)
+			throw scene_error("'" + path + "' isn't a cluster file");
+
+		auto material_count = read_value<uint32_t>(in);
+		for (uint32_t m = 0; m < material_count && in; m++)
+		{
+			std::string name(read_value<uint32_t>(in), '\0');
+			in.read(&name[0], std::streamsize(name.size()));
+
+			auto found = materials.find(name);
+			if (found == materials.end())
+				throw scene_error("cluster file '" + path + "' uses unknown material '" + name + "'");
+			cluster_materials.push_back(found->second);
+		}
+
+		hittable_list clusters;
+		auto cluster_count = read_value<uint32_t>(in);
+		for (uint32_t c = 0; c < cluster_count && in; c++)
+		{
+			cluster_info info;
+			for (int a = 0; a < 3; a++)
+				info.box.minimum[a] = read_value<double>(in);
+			for (int a = 0; a < 3; a++)
+				info.box.maximum[a] = read_value<double>(in);
+			info.offset = read_value<uint64_t>(in);
+			info.count = read_value<uint32_t>(in);
+			info.node_count = read_value<uint32_t>(in);
+
+			int page = cache->add_page([this, path, info]() { return load_cluster(path, info); });
+			clusters.add(make_shared<paged_hittable>(*cache, page, info.box));
+		}
+
+		if (!in)
+			throw scene_error("cluster file '" + path + "' is cut short");
+
+		if (!clusters.objects.empty())
+			top = make_shared<bvh>(clusters);
+		bbox = clusters.bounding_box();
+	}
+
+	// The page loaders point back at this object
+	paged_geometry(const paged_geometry&) = delete;
+	paged_geometry& operator=(const paged_geometry&) = delete;
+
+	bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override
+	{
+		return top && top->hit(r, ray_tmin, ray_tmax, rec);
+	}
+
+	bool occluded(const ray& r, double ray_tmin, double ray_tmax) const override
+	{
+		return top && top->occluded(r, ray_tmin, ray_tmax);
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+	const page_cache& pages() const { return *cache; }
+
+private:
+	// Declared first so it is destroyed last: the paged_hittables in top refer to it
+	shared_ptr<page_cache> cache;
+	shared_ptr<bvh> top;
+	aabb bbox;
+	// Kept here rather than in the clusters, as hit records point at them
+	std::vector<shared_ptr<material>> cluster_materials;
+
+	// Reads one cluster and its BVH. Runs on an I/O thread (or a render thread that had to wait).
+	shared_ptr<const pageable> load_cluster(const std::string& path, const cluster_info& info) const
+	{
+		std::vector<char> bytes(info.count * packed_sphere_size + info.node_count * packed_node_size);
+		std::ifstream in(path, std::ios::binary);
+		in.seekg(std::streamoff(info.offset));
+		in.read(bytes.data(), std::streamsize(bytes.size()));
+
+		auto loaded = make_shared<paged_hittable::contents>();
+		auto hole = [&]()
+		{
+			loaded->objects = make_shared<hittable_list>();
+			return loaded;
+		};
+
+		// A file that has changed or gone since it was opened leaves a hole rather than stopping the render,
+		// and so does one naming a material it doesn't have: a sphere is never made without one
+		if (!in)
+			return hole();
+		for (uint32_t i = 0; i < info.count; i++)
+		{
+			uint32_t material_index;
+			std::memcpy(&material_index, bytes.data() + size_t(i) * packed_sphere_size + 4 * sizeof(double), sizeof(material_index));
+			if (material_index >= cluster_materials.size())
+				return hole();
+		}
+
+		// All the spheres go in one block, and the BVH's pointers to them share the block's reference count
+		// (shared_ptr's aliasing constructor), so a cluster is two allocations rather than one per sphere
+		auto block = make_shared<std::vector<sphere>>();
+		block->reserve(info.count);
+		const char* read = bytes.data();
+		for (uint32_t i = 0; i < info.count; i++, read += packed_sphere_size)
+		{
+			double values[4];
+			uint32_t material_index;
+			std::memcpy(values, read, sizeof(values));
+			std::memcpy(&material_index, read + sizeof(values), sizeof(material_index));
+
+			block->emplace_back(point3(values[0], values[1], values[2]), values[3], cluster_materials[material_index]);
+		}
+
+		std::vector<shared_ptr<hittable>> primitives;
+		primitives.reserve(info.count);
+		for (auto& object : *block)
+			primitives.push_back(shared_ptr<hittable>(block, &object));
+
+		std::vector<bvh_node> nodes(info.node_count);
+		for (auto& node : nodes)
+		{
+			double values[6];
+			int32_t fields[3];
+			std::memcpy(values, read, sizeof(values));
+			std::memcpy(fields, read + sizeof(values), sizeof(fields));
+			read += packed_node_size;
+
+			node.box = aabb(point3(values[0], values[1], values[2]), point3(values[3], values[4], values[5]));
+			node.left_first = fields[0];
+			node.count = fields[1];
+			node.axis = fields[2];
+		}
+
+		loaded->objects = make_shared<bvh>(std::move(primitives), std::move(nodes));
+		loaded->memory_size = info.count * (sizeof(sphere) + sizeof(shared_ptr<hittable>)) + info.node_count * sizeof(bvh_node);
+		return loaded;
+	}
+};
+
+#endif
@@ -0,0 +1,40 @@
+#pragma once
+
+#ifndef COLOR_H
+#define COLOR_H
+
+#include "rtweekend.h"
+
+#include <iostream>
+
+// color is just an alias for vec3, but useful for clarity in the code.
+using color = vec3;
+
+// Images are viewed as if they were gamma corrected, so convert from linear space
+// to gamma 2 space (i.e. the inverse of raising to the power of 2 is the square root).
+inline double linear_to_gamma(double linear_component)
+{
+	if (linear_component > 0)
+		return std::sqrt(linear_component);
+
+	return 0;
+}
+
+// Converts one linear colour component to the gamma corrected byte (0 to 255) stored in image files.
+inline unsigned char to_byte(double linear_component)
+{
+	// Translate the [0,1] component value to the byte range [0,255].
+	return (unsigned char)(int(255.999 * clamp(linear_to_gamma(linear_component), 0.0, 0.999)));
+}
+
+// Writes a single pixel's colour to the out stream as three integers from 0 to 255.
+inline void write_color(std::ostream& out, const color& pixel_color)
+{
+	int rbyte = to_byte(pixel_color.x());
+	int gbyte = to_byte(pixel_color.y());
+	int bbyte = to_byte(pixel_color.z());
+
+	out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
+}
+
+#endif
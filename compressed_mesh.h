@@ -0,0 +1,514 @@
+#pragma once
+
+#ifndef COMPRESSED_MESH_H
+#define COMPRESSED_MESH_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "scene_tokenizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// <summary>
+/// A triangle mesh as it is read in: every vertex position, and three indices into them per triangle.
+/// </summary>
+class triangle_mesh
+{
+public:
+	std::vector<point3> positions;
+	std::vector<int> indices;
+
+	int triangle_count() const { return int(indices.size() / 3); }
+};
+
+/// <summary>
+/// A mesh whose faces can have any number of corners, as OBJ files and subdivision surfaces use.
+/// Face f's corners are face_sizes[f] consecutive entries of indices.
+/// </summary>
+class polygon_mesh
+{
+public:
+	std::vector<point3> positions;
+	std::vector<int> face_sizes;
+	std::vector<int> indices;
+};
+
+// Reads the vertices and faces of a Wavefront OBJ file. Texture coordinates, normals and everything else are
+// ignored. Throws scene_error if the file can't be read or has a face that doesn't make sense.
+inline polygon_mesh load_obj_polygons(const std::string& path)
+{
+	auto text = read_text_file(path);
+
+	polygon_mesh mesh;
+	scene_tokenizer tokens(text);
+
+	while (tokens.next_line())
+	{
+		auto keyword = tokens.word();
+
+		if (keyword == "v")
+		{
+			mesh.positions.push_back(tokens.vector());
+		}
+		else if (keyword == "f")
+		{
+			int corners = 0;
+			while (!tokens.at_line_end())
+			{
+				// Only the position index matters: "7", "7/2" and "7/2/5" all mean vertex 7
+				auto corner = tokens.word();
+				auto index = int(tokens.to_number(corner.substr(0, corner.find('/'))));
+
+				// Negative indices count back from the latest vertex
+				index = index < 0 ? int(mesh.positions.size()) + index : index - 1;
+				if (index < 0 || index >= int(mesh.positions.size()))
+					throw scene_error(tokens.line(), "face refers to a vertex that doesn't exist");
+				mesh.indices.push_back(index);
+				corners++;
+			}
+
+			if (corners < 3)
+				throw scene_error(tokens.line(), "face has fewer than three corners");
+			mesh.face_sizes.push_back(corners);
+		}
+
+		// skip the rest of any other statement
+		while (!tokens.at_line_end())
+			tokens.word();
+	}
+
+	return mesh;
+}
+
+// Splits every face of mesh into triangles around its first corner
+inline triangle_mesh triangulate(const polygon_mesh& mesh)
+{
+	triangle_mesh triangles;
+	triangles.positions = mesh.positions;
+
+	size_t first = 0;
+	for (int size : mesh.face_sizes)
+	{
+		for (int i = 2; i < size; i++)
+		{
+			triangles.indices.push_back(mesh.indices[first]);
+			triangles.indices.push_back(mesh.indices[first + i - 1]);
+			triangles.indices.push_back(mesh.indices[first + i]);
+		}
+		first += size;
+	}
+
+	return triangles;
+}
+
+// Reads an OBJ file as triangles (see load_obj_polygons)
+inline triangle_mesh load_obj(const std::string& path)
+{
+	return triangulate(load_obj_polygons(path));
+}
+
+/// <summary>
+/// A triangle mesh stored in about half the memory of a plain one, and intersected directly in that form.
+///
+/// Triangles are grouped into small clusters of neighbours. Each cluster stores its own vertices as 16 bit
+/// offsets from a corner, and its triangles as indices into those: the difference from the previous index,
+/// in as few bytes as it needs (a varint). Vertices are numbered in the order triangles first use them,
+/// so most differences fit in one byte. A ray that reaches a cluster decodes it as it goes.
+///
+/// Each cluster has its own step between quantised positions, a power of two as fine as its size allows, so
+/// one big triangle doesn't coarsen the rest of the mesh. A vertex shared by clusters is rounded on the
+/// coarsest of their grids, which is on all of their grids, so it decodes to exactly the same place in each
+/// and the mesh has no cracks.
+/// </summary>
+class compressed_mesh : public hittable
+{
+public:
+	// Clusters use steps of at least min_step. Meshes that meet along an edge are only sure to round the vertices
+	// there the same way if each cluster on the edge uses the same step: give them all step_for the largest box.
+	compressed_mesh(const triangle_mesh& mesh, shared_ptr<material> mat, double min_step = 0) : mat(mat)
+	{
+		if (mesh.triangle_count() == 0)
+			return;
+
+		std::vector<int> triangles(size_t(mesh.triangle_count()));
+		for (int t = 0; t < mesh.triangle_count(); t++)
+			triangles[t] = t;
+
+		std::vector<std::pair<size_t, size_t>> groups;
+		split(mesh, triangles, 0, triangles.size(), groups);
+
+		// Each cluster gets the finest step that lets it span its box in 65535 steps, allowing one more for its
+		// corner being rounded down onto its grid. Steps are powers of two, so a coarse cluster's grid points
+		// are all on a finer cluster's grid too, and decoding (origin + step * offset) is exact.
+		int min_exponent = std::numeric_limits<int>::min();
+		if (min_step > 0)
+		{
+			min_exponent = std::ilogb(min_step);
+			if (std::ldexp(1.0, min_exponent) < min_step)
+				min_exponent++;
+		}
+
+		std::vector<int> cluster_exponents(groups.size());
+		for (size_t c = 0; c < groups.size(); c++)
+		{
+			aabb box;
+			for (size_t i = groups[c].first; i < groups[c].first + groups[c].second; i++)
+				for (int corner = 0; corner < 3; corner++)
+					box.expand(mesh.positions[mesh.indices[3 * triangles[i] + corner]]);
+			cluster_exponents[c] = std::max(step_exponent(box), min_exponent);
+		}
+
+		// A vertex shared by clusters is rounded on the coarsest of their grids, so each of them decodes it
+		// to exactly the same place and the mesh has no cracks. That can move a vertex of a fine cluster
+		// outside what its step can span, so such clusters are made coarser until everything fits.
+		std::vector<int> vertex_exponents;
+		bool changed = true;
+		while (changed)
+		{
+			vertex_exponents.assign(mesh.positions.size(), std::numeric_limits<int>::min());
+			for (size_t c = 0; c < groups.size(); c++)
+				for (size_t i = groups[c].first; i < groups[c].first + groups[c].second; i++)
+					for (int corner = 0; corner < 3; corner++)
+					{
+						int& exponent = vertex_exponents[mesh.indices[3 * triangles[i] + corner]];
+						exponent = std::max(exponent, cluster_exponents[c]);
+					}
+
+			changed = false;
+			for (size_t c = 0; c < groups.size(); c++)
+			{
+				aabb box;
+				for (size_t i = groups[c].first; i < groups[c].first + groups[c].second; i++)
+					for (int corner = 0; corner < 3; corner++)
+					{
+						int vertex = mesh.indices[3 * triangles[i] + corner];
+						box.expand(rounded(mesh.positions[vertex], vertex_exponents[vertex]));
+					}
+
+				if (step_exponent(box) > cluster_exponents[c])
+				{
+					cluster_exponents[c]++;
+					changed = true;
+				}
+			}
+		}
+
+		clusters.reserve(groups.size());
+		for (size_t c = 0; c < groups.size(); c++)
+			compress(mesh, triangles, groups[c].first, groups[c].second, cluster_exponents[c], vertex_exponents);
+		positions.shrink_to_fit();
+		index_bytes.shrink_to_fit();
+
+		// The clusters are the BVH's primitives. Its pointers to them don't own them (the mesh owns both),
+		// which saves a separate allocation per cluster.
+		hittable_list objects;
+		for (auto& cluster : clusters)
+			objects.add(shared_ptr<hittable>(shared_ptr<hittable>(), &cluster));
+
+		tree = make_shared<bvh>(objects);
+		bbox = objects.bounding_box();
+	}
+
+	// The clusters point back at the mesh
+	compressed_mesh(const compressed_mesh&) = delete;
+	compressed_mesh& operator=(const compressed_mesh&) = delete;
+
+	bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override
+	{
+		return tree && tree->hit(r, ray_tmin, ray_tmax, rec);
+	}
+
+	bool occluded(const ray& r, double ray_tmin, double ray_tmax) const override
+	{
+		return tree && tree->occluded(r, ray_tmin, ray_tmax);
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+	// The step a cluster filling box would use: a power of two, so a finer grid always includes it
+	static double step_for(const aabb& box) { return std::ldexp(1.0, step_exponent(box)); }
+
+	// Memory taken by the compressed vertices and triangles (not counting the BVH over the clusters)
+	size_t memory_size() const
+	{
+		return clusters.capacity() * sizeof(mesh_cluster) + positions.capacity() * sizeof(uint16_t)
+			+ index_bytes.capacity();
+	}
+
+private:
+	static const int cluster_size = 32;			// Most triangles in one cluster
+
+	/// <summary>
+	/// A few neighbouring triangles in compressed form. Its vertices and triangles are ranges of the mesh's
+	/// positions and index_bytes. It is a hittable so that the mesh's BVH can hold it like any other object.
+	/// </summary>
+	class mesh_cluster : public hittable
+	{
+	public:
+		const compressed_mesh* mesh = nullptr;
+		point3 origin;							// Corner the quantised positions are measured from
+		double step = 1;						// Distance between neighbouring quantised positions
+		uint16_t box[6] = {};					// Bounding box, as steps from origin: minimum x, y, z then maximum
+		uint32_t first_position = 0;			// Where the cluster's x, y, z steps from origin start in positions
+		uint32_t first_index_byte = 0;			// Where its vertex indices (delta and varint encoded) start in index_bytes
+		uint32_t triangle_count = 0;
+
+		bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override
+		{
+			bool hit_anything = false;
+			decode([&](const point3& a, const point3& b, const point3& c)
+			{
+				if (intersect(r, a, b, c, ray_tmin, ray_tmax, rec))
+				{
+					ray_tmax = rec.t;
+					hit_anything = true;
+				}
+				return false;
+			});
+
+			if (hit_anything)
+				rec.mat = mesh->mat.get();
+			return hit_anything;
+		}
+
+		bool occluded(const ray& r, double ray_tmin, double ray_tmax) const override
+		{
+			hit_record rec;
+			return decode([&](const point3& a, const point3& b, const point3& c)
+			{
+				// stop decoding at the first triangle in the way
+				return intersect(r, a, b, c, ray_tmin, ray_tmax, rec);
+			});
+		}
+
+		aabb bounding_box() const override
+		{
+			// Padded by a step, so that a flat cluster lying in an axis plane still has some thickness
+			auto pad = vec3(step, step, step);
+			return aabb(origin + step * vec3(box[0], box[1], box[2]) - pad,
+						origin + step * vec3(box[3], box[4], box[5]) + pad);
+		}
+
+		// Calls visit with the corners of each triangle in turn, until it returns true.
+		// Returns whether it did.
+		template <typename visitor>
+		bool decode(const visitor& visit) const
+		{
+			const uint8_t* read = mesh->index_bytes.data() + first_index_byte;
+			const uint16_t* vertices = mesh->positions.data() + first_position;
+			int previous = 0;
+
+			for (uint32_t t = 0; t < triangle_count; t++)
+			{
+				point3 corners[3];
+				for (auto& corner : corners)
+				{
+					// zigzag varint: 7 bits per byte, high bit set on all but the last byte, sign in the lowest bit
+					uint32_t zigzag = 0;
+					for (int shift = 0; ; shift += 7)
+					{
+						uint8_t byte = *read++;
+						zigzag |= uint32_t(byte & 0x7f) << shift;
+						if (!(byte & 0x80))
+							break;
+					}
+					previous += int(zigzag >> 1) ^ -int(zigzag & 1);
+
+					const uint16_t* q = vertices + 3 * previous;
+					corner = origin + step * vec3(q[0], q[1], q[2]);
+				}
+
+				if (visit(corners[0], corners[1], corners[2]))
+					return true;
+			}
+
+			return false;
+		}
+	};
+
+	shared_ptr<material> mat;
+	std::vector<mesh_cluster> clusters;
+	std::vector<uint16_t> positions;			// Every cluster's vertices, one after another
+	std::vector<uint8_t> index_bytes;			// Every cluster's triangles, one after another
+	shared_ptr<bvh> tree;
+	aabb bbox;
+
+	// Möller-Trumbore ray/triangle intersection. Fills in rec (apart from the material) on a hit.
+	static bool intersect(const ray& r, const point3& a, const point3& b, const point3& c,
+						  double ray_tmin, double ray_tmax, hit_record& rec)
+	{
+		vec3 edge1 = b - a;
+		vec3 edge2 = c - a;
+		vec3 p = cross(r.direction(), edge2);
+		double det = dot(edge1, p);
+
+		// Ray parallel to the triangle (or a degenerate triangle)
+		if (std::fabs(det) < 1e-12)
+			return false;
+
+		double inv_det = 1 / det;
+		vec3 s = r.origin() - a;
+		double u = dot(s, p) * inv_det;
+		if (u < 0 || u > 1)
+			return false;
+
+		vec3 q = cross(s, edge1);
+		double v = dot(r.direction(), q) * inv_det;
+		if (v < 0 || u + v > 1)
+			return false;
+
+		double t = dot(edge2, q) * inv_det;
+		if (t <= ray_tmin || t >= ray_tmax)
+			return false;
+
+		rec.t = t;
+		rec.p = r.at(t);
+		rec.set_face_normal(r, unit_vector(cross(edge1, edge2)));
+		return true;
+	}
+
+	// Sorts triangles[first, first + count) into groups of at most cluster_size neighbours by splitting at
+	// the median of their centres along the longest axis
+	void split(const triangle_mesh& mesh, std::vector<int>& triangles, size_t first, size_t count,
+			   std::vector<std::pair<size_t, size_t>>& groups) const
+	{
+		if (count <= size_t(cluster_size))
+		{
+			groups.emplace_back(first, count);
+			return;
+		}
+
+		auto centre = [&](int t)
+		{
+			return (mesh.positions[mesh.indices[3 * t]] + mesh.positions[mesh.indices[3 * t + 1]]
+				+ mesh.positions[mesh.indices[3 * t + 2]]) / 3;
+		};
+
+		aabb centres;
+		for (size_t i = first; i < first + count; i++)
+			centres.expand(centre(triangles[i]));
+		int axis = centres.longest_axis();
+
+		auto begin = triangles.begin() + first;
+		std::nth_element(begin, begin + count / 2, begin + count, [&](int a, int b)
+		{
+			return centre(a)[axis] < centre(b)[axis];
+		});
+
+		split(mesh, triangles, first, count / 2, groups);
+		split(mesh, triangles, first + count / 2, count - count / 2, groups);
+	}
+
+	// The power of two exponent of the finest step that spans box in 65534 steps
+	static int step_exponent(const aabb& box)
+	{
+		double extent = 0;
+		for (int axis = 0; axis < 3; axis++)
+			extent = std::fmax(extent, box.maximum[axis] - box.minimum[axis]);
+
+		// A cluster of triangles all at one point is invisible, so any step will do
+		int exponent;
+		std::frexp(extent > 0 ? extent / 65534.0 : 1.0, &exponent);
+		return exponent;
+	}
+
+	// position rounded onto the grid of step 2^exponent
+	static point3 rounded(const point3& position, int exponent)
+	{
+		point3 result;
+		for (int axis = 0; axis < 3; axis++)
+			result[axis] = std::ldexp(std::round(std::ldexp(position[axis], -exponent)), exponent);
+		return result;
+	}
+
+	// Adds the compressed form of triangles[first, first + count) as a new cluster with step 2^exponent.
+	// vertex_exponents gives the grid each vertex is rounded on (see the constructor).
+	void compress(const triangle_mesh& mesh, const std::vector<int>& triangles, size_t first, size_t count,
+				  int exponent, const std::vector<int>& vertex_exponents)
+	{
+		mesh_cluster cluster;
+		cluster.mesh = this;
+		cluster.step = std::ldexp(1.0, exponent);
+		cluster.first_position = uint32_t(positions.size());
+		cluster.first_index_byte = uint32_t(index_bytes.size());
+		cluster.triangle_count = uint32_t(count);
+
+		// The corner the offsets are measured from is rounded down onto the cluster's grid
+		aabb bounds;
+		for (size_t i = first; i < first + count; i++)
+			for (int corner = 0; corner < 3; corner++)
+			{
+				int vertex = mesh.indices[3 * triangles[i] + corner];
+				bounds.expand(rounded(mesh.positions[vertex], vertex_exponents[vertex]));
+			}
+		double origin_steps[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			origin_steps[axis] = std::floor(std::ldexp(bounds.minimum[axis], -exponent));
+			cluster.origin[axis] = std::ldexp(origin_steps[axis], exponent);
+		}
+
+		uint16_t low[3] = { 65535, 65535, 65535 };
+		uint16_t high[3] = { 0, 0, 0 };
+		std::unordered_map<int, int> local_index;
+		int previous = 0;
+
+		for (size_t i = first; i < first + count; i++)
+		{
+			for (int corner = 0; corner < 3; corner++)
+			{
+				int vertex = mesh.indices[3 * triangles[i] + corner];
+
+				auto found = local_index.find(vertex);
+				if (found == local_index.end())
+				{
+					found = local_index.emplace(vertex, int(local_index.size())).first;
+
+					// The vertex's own grid is this cluster's or coarser, so it lands exactly on a step
+					auto position = rounded(mesh.positions[vertex], vertex_exponents[vertex]);
+					for (int axis = 0; axis < 3; axis++)
+					{
+						double offset = std::ldexp(position[axis], -exponent) - origin_steps[axis];
+						auto value = uint16_t(std::clamp(offset, 0.0, 65535.0));
+						positions.push_back(value);
+						low[axis] = std::min(low[axis], value);
+						high[axis] = std::max(high[axis], value);
+					}
+				}
+
+				int delta = found->second - previous;
+				previous = found->second;
+
+				uint32_t zigzag = (uint32_t(delta) << 1) ^ uint32_t(delta >> 31);
+				while (zigzag >= 0x80)
+				{
+					index_bytes.push_back(uint8_t(zigzag | 0x80));
+					zigzag >>= 7;
+				}
+				index_bytes.push_back(uint8_t(zigzag));
+			}
+		}
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			cluster.box[axis] = low[axis];
+			cluster.box[axis + 3] = high[axis];
+		}
+
+		clusters.push_back(cluster);
+	}
+};
+
+#endif
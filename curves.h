@@ -0,0 +1,489 @@
+#pragma once
+
+#ifndef CURVES_H
+#define CURVES_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <utility>
+#include <vector>
+
+// How a curve looks from the side: a tube, or a flat strip turned to face each ray (cheaper to shade
+// convincingly for very thin hair, since it has no rounded edge to light)
+enum class curve_shape { round, ribbon };
+
+/// <summary>
+/// One cubic Bézier segment of a curve, with its width at each end.
+/// </summary>
+class curve_segment
+{
+public:
+	point3 control[4];
+	double width[2] = { 0, 0 };
+};
+
+/// <summary>
+/// Many curves (hair, fur, grass...), intersected as curves rather than as triangles, which would take
+/// about ten times the memory and build time for a convincing amount of hair.
+///
+/// Hair is long, thin and mostly diagonal, so axis-aligned boxes around it are nearly all empty space.
+/// Each segment therefore also keeps an oriented box lined up with the line between its ends, which a ray is
+/// tested against before the curve itself. Segments are packed into small groups of neighbours, which are
+/// the leaves of a BVH of their own, so the scene's BVH sees one object however many hairs there are.
+///
+/// The intersection follows Nakamaru and Ohno (and pbrt): in a frame where the ray runs along z from the
+/// origin, the curve is split in half until each piece is nearly straight, and the ray hits a piece if it
+/// passes within half the width of it.
+/// </summary>
+class curve_set : public hittable
+{
+public:
+	curve_set(const std::vector<curve_segment>& curves, shared_ptr<material> mat, curve_shape shape = curve_shape::round)
+		: mat(mat), shape(shape)
+	{
+		if (curves.empty())
+			return;
+
+		segments.reserve(curves.size());
+		for (const auto& curve : curves)
+			segments.push_back(make_segment(curve));
+
+		// Group neighbouring segments by splitting at the median of their centres along the longest axis
+		std::vector<std::pair<size_t, size_t>> groups;
+		split(0, segments.size(), groups);
+
+		groups_of_segments.reserve(groups.size());
+		for (const auto& group : groups)
+		{
+			segment_group leaf;
+			leaf.set = this;
+			leaf.first = uint32_t(group.first);
+			leaf.count = uint32_t(group.second);
+			for (size_t i = group.first; i < group.first + group.second; i++)
+			{
+				auto radius = segments[i].max_width() / 2;
+				for (int c = 0; c < 4; c++)
+				{
+					leaf.box.expand(segments[i].control_point(c) - vec3(radius, radius, radius));
+					leaf.box.expand(segments[i].control_point(c) + vec3(radius, radius, radius));
+				}
+			}
+			groups_of_segments.push_back(leaf);
+		}
+
+		// As in compressed_mesh, the BVH's pointers to the groups don't own them
+		hittable_list objects;
+		for (auto& leaf : groups_of_segments)
+			objects.add(shared_ptr<hittable>(shared_ptr<hittable>(), &leaf));
+
+		tree = make_shared<bvh>(objects);
+		bbox = objects.bounding_box();
+	}
+
+	// The groups point back at the set
+	curve_set(const curve_set&) = delete;
+	curve_set& operator=(const curve_set&) = delete;
+
+	bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override
+	{
+		return tree && tree->hit(r, ray_tmin, ray_tmax, rec);
+	}
+
+	bool occluded(const ray& r, double ray_tmin, double ray_tmax) const override
+	{
+		return tree && tree->occluded(r, ray_tmin, ray_tmax);
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+	size_t segment_count() const { return segments.size(); }
+
+	// Memory taken by the segments and their groups (not counting the BVH over the groups)
+	size_t memory_size() const
+	{
+		return segments.capacity() * sizeof(packed_segment) + groups_of_segments.capacity() * sizeof(segment_group);
+	}
+
+private:
+	static const int group_size = 4;		// Most segments in one BVH leaf
+	static const int max_splits = 10;		// Most times a segment is halved while intersecting it
+
+	/// <summary>
+	/// A segment and its boxes, laid out for intersecting.
+	/// </summary>
+	class packed_segment
+	{
+	public:
+		// Stored as floats, which is plenty for hair and halves the memory
+		float control[4][3];
+		float width[2];
+		// Oriented box: its centre, its axes (the first along the line between the ends) and half its size along each
+		float centre[3];
+		float axes[3][3];
+		float half_size[3];
+		int splits;			// Times to halve the curve before each piece is straight enough to test as a line
+
+		point3 control_point(int i) const { return point3(control[i][0], control[i][1], control[i][2]); }
+		vec3 axis(int i) const { return vec3(axes[i][0], axes[i][1], axes[i][2]); }
+		double max_width() const { return std::max(width[0], width[1]); }
+	};
+
+	/// <summary>
+	/// Axes with the ray running along z, worked out once per ray rather than once per segment.
+	/// </summary>
+	class ray_frame
+	{
+	public:
+		ray_frame(const ray& r) : length(r.direction().length())
+		{
+			w = r.direction() / length;
+			perpendicular_axes(w, u, v);
+		}
+
+		vec3 u, v, w;
+		double length;
+	};
+
+	/// <summary>
+	/// A few neighbouring segments: one leaf of the set's BVH.
+	/// </summary>
+	class segment_group : public hittable
+	{
+	public:
+		const curve_set* set = nullptr;
+		uint32_t first = 0;
+		uint32_t count = 0;
+		aabb box;
+
+		bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override
+		{
+			bool hit_anything = false;
+			ray_frame frame(r);
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				if (set->intersect(set->segments[i], r, frame, ray_tmin, ray_tmax, rec))
+				{
+					ray_tmax = rec.t;
+					hit_anything = true;
+				}
+			}
+
+			if (hit_anything)
+				rec.mat = set->mat.get();
+			return hit_anything;
+		}
+
+		bool occluded(const ray& r, double ray_tmin, double ray_tmax) const override
+		{
+			hit_record rec;
+			ray_frame frame(r);
+			for (uint32_t i = first; i < first + count; i++)
+				if (set->intersect(set->segments[i], r, frame, ray_tmin, ray_tmax, rec))
+					return true;
+
+			return false;
+		}
+
+		aabb bounding_box() const override { return box; }
+	};
+
+	shared_ptr<material> mat;
+	curve_shape shape;
+	std::vector<packed_segment> segments;
+	std::vector<segment_group> groups_of_segments;
+	shared_ptr<bvh> tree;
+	aabb bbox;
+
+	// Two unit vectors perpendicular to unit vector w and each other (Duff et al., "Building an Orthonormal Basis, Revisited")
+	static void perpendicular_axes(const vec3& w, vec3& u, vec3& v)
+	{
+		double sign = std::copysign(1.0, w.z());
+		double a = -1 / (sign + w.z());
+		double b = w.x() * w.y() * a;
+		u = vec3(1 + sign * w.x() * w.x() * a, sign * b, -sign * w.x());
+		v = vec3(b, sign + w.y() * w.y() * a, -w.y());
+	}
+
+	static point3 bezier(const point3 control[4], double u)
+	{
+		double s = 1 - u;
+		return s * s * s * control[0] + 3 * s * s * u * control[1] + 3 * s * u * u * control[2] + u * u * u * control[3];
+	}
+
+	static vec3 bezier_tangent(const point3 control[4], double u)
+	{
+		double s = 1 - u;
+		return 3 * s * s * (control[1] - control[0]) + 6 * s * u * (control[2] - control[1])
+			+ 3 * u * u * (control[3] - control[2]);
+	}
+
+	// Splits a Bézier segment in half (de Casteljau), into the 7 control points of the two halves
+	static void split_bezier(const point3 control[4], point3 halves[7])
+	{
+		point3 a = (control[0] + control[1]) / 2, b = (control[1] + control[2]) / 2, c = (control[2] + control[3]) / 2;
+		point3 d = (a + b) / 2, e = (b + c) / 2;
+		halves[0] = control[0];
+		halves[1] = a;
+		halves[2] = d;
+		halves[3] = (d + e) / 2;
+		halves[4] = e;
+		halves[5] = c;
+		halves[6] = control[3];
+	}
+
+	static packed_segment make_segment(const curve_segment& curve)
+	{
+		packed_segment segment;
+		for (int i = 0; i < 4; i++)
+			for (int axis = 0; axis < 3; axis++)
+				segment.control[i][axis] = float(curve.control[i][axis]);
+		segment.width[0] = float(curve.width[0]);
+		segment.width[1] = float(curve.width[1]);
+
+		// The curve lies inside the hull of its control points, so boxing those (grown by half the width) is enough
+		vec3 axes[3];
+		auto chord = curve.control[3] - curve.control[0];
+		axes[0] = chord.length_squared() > 0 ? unit_vector(chord) : vec3(1, 0, 0);
+		perpendicular_axes(axes[0], axes[1], axes[2]);
+
+		double radius = segment.max_width() / 2;
+		point3 middle;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			double lowest = infinity, highest = -infinity;
+			for (int i = 0; i < 4; i++)
+			{
+				lowest = std::fmin(lowest, dot(segment.control_point(i), axes[axis]));
+				highest = std::fmax(highest, dot(segment.control_point(i), axes[axis]));
+			}
+			// A little extra for the rounding to float
+			segment.half_size[axis] = float((highest - lowest) / 2 + radius) * 1.0001f;
+			middle[axis] = (lowest + highest) / 2;
+			for (int i = 0; i < 3; i++)
+				segment.axes[axis][i] = float(axes[axis][i]);
+		}
+		auto centre = middle[0] * axes[0] + middle[1] * axes[1] + middle[2] * axes[2];
+		for (int axis = 0; axis < 3; axis++)
+			segment.centre[axis] = float(centre[axis]);
+
+		// Halve the curve until the pieces are within a twentieth of its width of straight. The bend is measured in 3D,
+		// which is never less than it is in any ray's frame, so this is enough for every ray.
+		double flatness = 0;
+		for (int i = 0; i < 2; i++)
+			flatness = std::fmax(flatness, (curve.control[i] - 2 * curve.control[i + 1] + curve.control[i + 2]).length());
+		double tolerance = segment.max_width() / 20;
+		segment.splits = 0;
+		if (flatness > 0 && tolerance > 0)
+			segment.splits = std::clamp(int(std::log2(1.41421356237 * 6 * flatness / (8 * tolerance)) / 2), 0, int(max_splits));
+
+		return segment;
+	}
+
+	void split(size_t first, size_t count, std::vector<std::pair<size_t, size_t>>& groups)
+	{
+		if (count <= size_t(group_size))
+		{
+			groups.emplace_back(first, count);
+			return;
+		}
+
+		aabb centres;
+		for (size_t i = first; i < first + count; i++)
+			centres.expand(point3(segments[i].centre[0], segments[i].centre[1], segments[i].centre[2]));
+		int axis = centres.longest_axis();
+
+		auto begin = segments.begin() + first;
+		std::nth_element(begin, begin + count / 2, begin + count, [axis](const packed_segment& a, const packed_segment& b)
+		{
+			return a.centre[axis] < b.centre[axis];
+		});
+
+		split(first, count / 2, groups);
+		split(first + count / 2, count - count / 2, groups);
+	}
+
+	// Does the ray pass through the segment's oriented box between ray_tmin and ray_tmax?
+	static bool hit_oriented_box(const packed_segment& segment, const ray& r, double ray_tmin, double ray_tmax)
+	{
+		auto offset = r.origin() - point3(segment.centre[0], segment.centre[1], segment.centre[2]);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			double origin = dot(offset, segment.axis(axis));
+			double direction = dot(r.direction(), segment.axis(axis));
+
+			// Parallel to this pair of planes: either always between them or never. Dividing would give
+			// 0 * infinity = NaN for a ray lying in one of the planes.
+			if (direction == 0)
+			{
+				if (std::fabs(origin) > segment.half_size[axis])
+					return false;
+				continue;
+			}
+
+			double inv_direction = 1 / direction;
+			double t0 = (-segment.half_size[axis] - origin) * inv_direction;
+			double t1 = (segment.half_size[axis] - origin) * inv_direction;
+			if (inv_direction < 0)
+				std::swap(t0, t1);
+
+			ray_tmin = t0 > ray_tmin ? t0 : ray_tmin;
+			ray_tmax = t1 < ray_tmax ? t1 : ray_tmax;
+			if (ray_tmax < ray_tmin)
+				return false;
+		}
+
+		return true;
+	}
+
+	bool intersect(const packed_segment& segment, const ray& r, const ray_frame& frame, double ray_tmin, double ray_tmax,
+				   hit_record& rec) const
+	{
+		if (!hit_oriented_box(segment, r, ray_tmin, ray_tmax))
+			return false;
+
+		// Into the ray's frame: the ray starts at the origin and runs along z, with z measuring distance along it
+		point3 world_control[4], control[4];
+		for (int i = 0; i < 4; i++)
+		{
+			world_control[i] = segment.control_point(i);
+			auto p = world_control[i] - r.origin();
+			control[i] = point3(dot(p, frame.u), dot(p, frame.v), dot(p, frame.w));
+		}
+
+		double length = frame.length;
+		const auto& w = frame.w;
+		double closest = ray_tmax * length;
+		double hit_u = 0;
+		if (!intersect_piece(segment, control, 0, 1, segment.splits, ray_tmin * length, closest, hit_u))
+			return false;
+
+		// Shading: the normal points from the curve's centre line out to the ray, bent towards the ray for round
+		// curves as it would be on a tube. The hit point is put on that side of the centre line, so rays leaving it
+		// don't immediately hit the same curve again.
+		auto tangent = bezier_tangent(world_control, hit_u);
+		tangent = tangent.length_squared() > 0 ? unit_vector(tangent) : segment.axis(0);
+		auto facing = -w - dot(-w, tangent) * tangent;
+		facing = facing.length_squared() > 0 ? unit_vector(facing) : -w;
+
+		double t = closest / length;
+		auto centre = bezier(world_control, hit_u);
+		double radius = (segment.width[0] + (segment.width[1] - segment.width[0]) * hit_u) / 2;
+		vec3 normal = facing;
+
+		if (shape == curve_shape::round)
+		{
+			auto across = r.at(t) - centre;
+			across = across - dot(across, tangent) * tangent - dot(across, facing) * facing;
+			double e = std::fmin(across.length() / radius, 1.0);
+			if (e > 0)
+				normal = unit_vector(unit_vector(across) * e + facing * std::sqrt(1 - e * e));
+		}
+
+		rec.t = t;
+		rec.p = centre + radius * normal;
+		rec.set_face_normal(r, normal);
+		return true;
+	}
+
+	// Tests the piece of the curve from u0 to u1 (with control points in the ray's frame), halving it splits more
+	// times. closest is the nearest hit distance along the ray so far, and shrinks when a nearer hit is found.
+	static bool intersect_piece(const packed_segment& segment, const point3 control[4], double u0, double u1, int splits,
+								double nearest, double& closest, double& hit_u)
+	{
+		// Skip pieces whose box (grown by half the width) doesn't contain the ray
+		double radius = segment.max_width() / 2;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			double low = std::fmin(std::fmin(control[0][axis], control[1][axis]), std::fmin(control[2][axis], control[3][axis]));
+			double high = std::fmax(std::fmax(control[0][axis], control[1][axis]), std::fmax(control[2][axis], control[3][axis]));
+			double from = axis == 2 ? nearest : 0;
+			double to = axis == 2 ? closest : 0;
+			if (low - radius > to || high + radius < from)
+				return false;
+		}
+
+		if (splits > 0)
+		{
+			point3 halves[7];
+			split_bezier(control, halves);
+			double middle = (u0 + u1) / 2;
+
+			bool hit_first = intersect_piece(segment, halves, u0, middle, splits - 1, nearest, closest, hit_u);
+			bool hit_second = intersect_piece(segment, halves + 3, middle, u1, splits - 1, nearest, closest, hit_u);
+			return hit_first || hit_second;
+		}
+
+		// The piece is nearly straight. The ray has to pass between the lines through each end at right angles to it...
+		if ((control[1].y() - control[0].y()) * -control[0].y() + control[0].x() * (control[0].x() - control[1].x()) < 0)
+			return false;
+		if ((control[2].y() - control[3].y()) * -control[3].y() + control[3].x() * (control[3].x() - control[2].x()) < 0)
+			return false;
+
+		// ...and within half the width of the closest point
+		double dx = control[3].x() - control[0].x(), dy = control[3].y() - control[0].y();
+		double length_squared = dx * dx + dy * dy;
+		double along = length_squared > 0 ? std::clamp((-control[0].x() * dx - control[0].y() * dy) / length_squared, 0.0, 1.0) : 0;
+
+		double u = u0 + (u1 - u0) * along;
+		double width = segment.width[0] + (segment.width[1] - segment.width[0]) * u;
+		auto point = bezier(control, along);
+		if (point.x() * point.x() + point.y() * point.y() > width * width / 4)
+			return false;
+		if (point.z() <= nearest || point.z() >= closest)
+			return false;
+
+		closest = point.z();
+		hit_u = u;
+		return true;
+	}
+};
+
+// Makes a ball of hair: count strands growing out of a sphere, each one cubic Bézier segment that droops
+// as it gets longer. Strands are width wide at the root and taper to a fifth of that. The same seed always
+// grows the same hair, so loading a scene twice gives the same image.
+inline std::vector<curve_segment> grow_hair(const point3& centre, double radius, int count, double length, double width,
+											unsigned seed = 1)
+{
+	std::vector<curve_segment> strands;
+	strands.reserve(size_t(count));
+
+	std::mt19937 generator(seed);
+	auto random_double = [&](double min = 0, double max = 1)
+	{
+		return std::uniform_real_distribution<double>(min, max)(generator);
+	};
+
+	for (int i = 0; i < count; i++)
+	{
+		// Uniformly over the sphere
+		double z = random_double(-1, 1);
+		double phi = 2 * pi * random_double();
+		double ring = std::sqrt(1 - z * z);
+		vec3 out(ring * std::cos(phi), z, ring * std::sin(phi));
+
+		double strand_length = length * random_double(0.7, 1.0);
+		auto jitter = vec3(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1)) * (0.15 * strand_length);
+		auto down = vec3(0, -1, 0) * (0.4 * strand_length);
+
+		curve_segment strand;
+		strand.control[0] = centre + radius * out;
+		strand.control[1] = strand.control[0] + out * (strand_length / 3);
+		strand.control[2] = strand.control[0] + out * (2 * strand_length / 3) + down / 3 + jitter / 2;
+		strand.control[3] = strand.control[0] + out * (0.8 * strand_length) + down + jitter;
+		strand.width[0] = width;
+		strand.width[1] = width / 5;
+		strands.push_back(strand);
+	}
+
+	return strands;
+}
+
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+
+#ifndef DISTRIBUTION_H
+#define DISTRIBUTION_H
+
+#include "rtweekend.h"
+
+#include "alias_table.h"
+
+#include <algorithm>
+#include <vector>
+
+/// <summary>
+/// A density over the unit square that is constant over each cell of a width x height grid, proportional
+/// to the cell's weight. Picks a row from the rows' totals (the marginal distribution), then a column from
+/// that row (the conditional distribution), each with an alias table so a sample takes constant time.
+/// </summary>
+class distribution_2d
+{
+public:
+	// weights has one entry per cell, row by row
+	distribution_2d(int width, int height, const std::vector<double>& weights)
+		: width(width), height(height), rows(make_rows(width, height, weights)), marginal(row_sums(rows))
+	{
+	}
+
+	// Returns a point (x, y) in the unit square picked with u1, u2 in [0, 1), and its density.
+	void sample(double u1, double u2, double& x, double& y, double& pdf) const
+	{
+		double v, u;
+		int row = marginal.sample(u2, v);
+		int column = rows[row].sample(u1, u);
+
+		x = (column + u) / width;
+		y = (row + v) / height;
+		pdf = marginal.probability(row) * rows[row].probability(column) * width * height;
+	}
+
+	// Density of sample picking the point (x, y)
+	double pdf(double x, double y) const
+	{
+		int column = std::clamp(int(x * width), 0, width - 1);
+		int row = std::clamp(int(y * height), 0, height - 1);
+		return marginal.probability(row) * rows[row].probability(column) * width * height;
+	}
+
+private:
+	int width;
+	int height;
+	std::vector<alias_table> rows;
+	alias_table marginal;
+
+	static std::vector<alias_table> make_rows(int width, int height, const std::vector<double>& weights)
+	{
+		std::vector<alias_table> result;
+		result.reserve(height);
+		for (int j = 0; j < height; j++)
+			result.emplace_back(std::vector<double>(weights.begin() + size_t(j) * width, weights.begin() + size_t(j + 1) * width));
+		return result;
+	}
+
+	static std::vector<double> row_sums(const std::vector<alias_table>& rows)
+	{
+		std::vector<double> sums;
+		sums.reserve(rows.size());
+		for (const auto& row : rows)
+			sums.push_back(row.weight_sum());
+		return sums;
+	}
+};
+
+#endif
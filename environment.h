@@ -0,0 +1,201 @@
+#pragma once
+
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "distribution.h"
+#include "scene_tokenizer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// <summary>
+/// An HDR image of everything around the scene (a latitude-longitude panorama), lighting whatever rays
+/// escape into it. Its brightest parts - usually the sun - light the scene far more than their size suggests,
+/// so a map this bright everywhere can't be found by rays scattering at random. The map can therefore be
+/// sampled: sample picks directions in proportion to how much light comes from them, using a 2D distribution
+/// over the pixels built once when the map is made.
+/// </summary>
+class environment_map
+{
+public:
+	// pixels holds width x height colours row by row, the top row looking straight up. The middle of the
+	// image is in the -z direction, and rotation (in degrees) turns the map around the y axis.
+	environment_map(int width, int height, std::vector<color> pixels, double intensity = 1, double rotation = 0)
+		: width(width), height(height), pixels(std::move(pixels)), rotation(degrees_to_radians(rotation)),
+		  distribution(width, height, pixel_weights(width, height, this->pixels))
+	{
+		for (auto& pixel : this->pixels)
+			pixel = intensity * pixel;
+	}
+
+	// Light arriving from the given direction (which needn't be of unit length)
+	color lookup(const vec3& direction) const
+	{
+		double x, y;
+		direction_to_image(unit_vector(direction), x, y);
+		return pixel(x, y);
+	}
+
+	// Picks a direction using u1, u2 in [0, 1), and returns it with its density (per solid angle) and the light
+	// arriving from it. The density is 0 for the rare directions that can't be used (straight up or down).
+	vec3 sample(double u1, double u2, double& pdf, color& radiance) const
+	{
+		double x, y, image_pdf;
+		distribution.sample(u1, u2, x, y, image_pdf);
+
+		double theta = y * pi;
+		double sin_theta = std::sin(theta);
+		pdf = sin_theta > 0 ? image_pdf / (2 * pi * pi * sin_theta) : 0;
+		radiance = pixel(x, y);
+
+		double phi = 2 * pi * (x - 0.5) - rotation;
+		return vec3(sin_theta * std::sin(phi), std::cos(theta), -sin_theta * std::cos(phi));
+	}
+
+	// Density of sample picking the given direction
+	double pdf(const vec3& direction) const
+	{
+		auto d = unit_vector(direction);
+		double x, y;
+		direction_to_image(d, x, y);
+
+		double sin_theta = std::sqrt(std::fmax(0.0, 1 - d.y() * d.y()));
+		return sin_theta > 0 ? distribution.pdf(x, y) / (2 * pi * pi * sin_theta) : 0;
+	}
+
+private:
+	int width;
+	int height;
+	std::vector<color> pixels;
+	double rotation;				// In radians
+	distribution_2d distribution;
+
+	color pixel(double x, double y) const
+	{
+		int i = std::clamp(int(x * width), 0, width - 1);
+		int j = std::clamp(int(y * height), 0, height - 1);
+		return pixels[size_t(j) * width + i];
+	}
+
+	// Where unit direction d lands in the image, as (x, y) in the unit square
+	void direction_to_image(const vec3& d, double& x, double& y) const
+	{
+		double phi = std::atan2(d.x(), -d.z()) + rotation;
+		x = phi / (2 * pi) + 0.5;
+		x -= std::floor(x);
+		y = std::acos(clamp(d.y(), -1, 1)) / pi;
+	}
+
+	// How likely each pixel is to be sampled: its brightness, times how much of the sphere it covers (rows
+	// near the poles are squeezed into less solid angle)
+	static std::vector<double> pixel_weights(int width, int height, const std::vector<color>& pixels)
+	{
+		std::vector<double> weights(pixels.size());
+		for (int j = 0; j < height; j++)
+		{
+			double sin_theta = std::sin(pi * (j + 0.5) / height);
+			for (int i = 0; i < width; i++)
+			{
+				const auto& c = pixels[size_t(j) * width + i];
+				weights[size_t(j) * width + i] = (0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z()) * sin_theta;
+			}
+		}
+		return weights;
+	}
+};
+
+// Reads a Radiance HDR (.hdr, RGBE) image, run-length encoded or not. width and height are set to its size.
+// Throws scene_error if the file can't be read.
+inline std::vector<color> load_hdr(const std::string& path, int& width, int& height)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		throw scene_error("can't open image '" + path + "'");
+
+	// A text header ended by a blank line, then the size, e.g. "-Y 512 +X 1024" (rows top to bottom)
+	std::string line;
+	bool is_rgbe = true;
+	while (std::getline(file, line) && !line.empty())
+		if (line.compare(0, 7, "FORMAT=") == 0)
+			is_rgbe = line == "FORMAT=32-bit_rle_rgbe";
+
+	if (!is_rgbe || !std::getline(file, line) || std::sscanf(line.c_str(), "-Y %d +X %d", &height, &width) != 2
+		|| width <= 0 || height <= 0)
+		throw scene_error("'" + path + "' isn't an RGBE image with rows from top to bottom");
+
+	std::vector<color> pixels;
+	pixels.reserve(size_t(width) * height);
+	std::vector<unsigned char> scanline(size_t(width) * 4);
+
+	for (int j = 0; j < height; j++)
+	{
+		unsigned char start[4];
+		if (!file.read(reinterpret_cast<char*>(start), 4))
+			throw scene_error("'" + path + "' ends early");
+
+		bool run_length = width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 && (start[2] & 0x80) == 0;
+		if (!run_length)
+		{
+			// Plain pixels, 4 bytes each
+			std::copy(start, start + 4, scanline.begin());
+			if (!file.read(reinterpret_cast<char*>(scanline.data() + 4), std::streamsize(scanline.size() - 4)))
+				throw scene_error("'" + path + "' ends early");
+		}
+		else
+		{
+			// Each of the four components of the row in turn, as runs of one repeated byte or of literal bytes
+			for (int component = 0; component < 4; component++)
+			{
+				int i = 0;
+				while (i < width)
+				{
+					int count = file.get();
+					if (count == EOF)
+						throw scene_error("'" + path + "' ends early");
+
+					bool repeat = count > 128;
+					if (repeat)
+						count -= 128;
+					if (count == 0 || i + count > width)
+						throw scene_error("'" + path + "' has a bad run length");
+
+					for (int k = 0; k < count; k++)
+					{
+						int value = (repeat && k > 0) ? scanline[size_t(i - 1) * 4 + component] : file.get();
+						if (value == EOF)
+							throw scene_error("'" + path + "' ends early");
+						scanline[size_t(i++) * 4 + component] = (unsigned char)value;
+					}
+				}
+			}
+		}
+
+		// A shared exponent for the three 8-bit mantissas
+		for (int i = 0; i < width; i++)
+		{
+			const unsigned char* rgbe = &scanline[size_t(i) * 4];
+			double scale = rgbe[3] == 0 ? 0 : std::ldexp(1.0, int(rgbe[3]) - (128 + 8));
+			pixels.emplace_back(rgbe[0] * scale, rgbe[1] * scale, rgbe[2] * scale);
+		}
+	}
+
+	return pixels;
+}
+
+// Reads an environment map from a Radiance HDR file (see load_hdr)
+inline shared_ptr<environment_map> load_environment_map(const std::string& path, double intensity = 1, double rotation = 0)
+{
+	int width, height;
+	auto pixels = load_hdr(path, width, height);
+	return make_shared<environment_map>(width, height, std::move(pixels), intensity, rotation);
+}
+
+#endif
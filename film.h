@@ -0,0 +1,337 @@
+#pragma once
+
+#ifndef FILM_H
+#define FILM_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "filter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+class path_guide;
+class irradiance_cache;
+class photon_map;
+
+/// <summary>
+/// Running totals for a single pixel. The final colour is weighted_sum / weight_sum,
+/// so samples can be added in any order and from any number of tiles.
+/// </summary>
+class film_pixel
+{
+public:
+	color weighted_sum;
+	double weight_sum = 0;
+};
+
+/// <summary>
+/// A double that many threads can add to at once without a lock.
+/// std::atomic<double> has no fetch_add before C++20, so this retries a compare-and-swap until
+/// no other thread has changed the value in between. Additions are independent of each other,
+/// so relaxed ordering is enough; all threads are joined before the totals are read.
+/// </summary>
+class atomic_double
+{
+public:
+	atomic_double() : value(0.0) {}
+
+	void add(double v)
+	{
+		auto old = value.load(std::memory_order_relaxed);
+		// on failure, old is updated to the current value, so just try again
+		while (!value.compare_exchange_weak(old, old + v, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	double load() const { return value.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<double> value;
+};
+
+/// <summary>
+/// Unweighted contributions splatted straight into the film from any thread (e.g. by light tracing).
+/// </summary>
+class film_splat
+{
+public:
+	atomic_double r, g, b;
+};
+
+/// <summary>
+/// Precomputed filter weights for one quadrant of the filter (the filters are symmetric).
+/// Looking up a table is much cheaper than calling cos() several times for every pixel a sample touches.
+/// </summary>
+class filter_table
+{
+public:
+	static const int width = 16;
+
+	filter_table(const filter& f) : radius(f.radius()), inv_radius(1.0 / f.radius())
+	{
+		for (int y = 0; y < width; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				// evaluate at the centre of each table cell
+				auto fx = (x + 0.5) * radius / width;
+				auto fy = (y + 0.5) * radius / width;
+				weights[y * width + x] = f.evaluate(fx, fy);
+				integral += weights[y * width + x];
+			}
+		}
+
+		// each cell covers (radius / width)^2 square pixels, and the table is one of four quadrants
+		integral *= 4 * (radius / width) * (radius / width);
+	}
+
+	// Weight for a sample at offset (dx, dy) from a pixel centre
+	double weight(double dx, double dy) const
+	{
+		int ix = std::min(int(std::fabs(dx) * inv_radius * width), width - 1);
+		int iy = std::min(int(std::fabs(dy) * inv_radius * width), width - 1);
+		return weights[iy * width + ix];
+	}
+
+	double radius;
+	double inv_radius;
+	double integral = 0;	// Total volume under the filter, used to normalise splats
+
+private:
+	double weights[width * width];
+};
+
+/// <summary>
+/// A rectangular block of the image that one thread renders into on its own.
+/// A sample near the edge of the tile can reach pixels outside it (by up to the filter radius),
+/// so the tile keeps its own buffer covering that border. Nothing in here is shared, so adding
+/// samples needs no locks or atomics; the tile is merged into the film once it is finished.
+/// </summary>
+class film_tile
+{
+public:
+	// x0, y0 inclusive; x1, y1 exclusive. These are the pixels this tile takes samples for.
+	film_tile(int x0, int y0, int x1, int y1, int image_width, int image_height, const filter_table& table)
+		: x0(x0), y0(y0), x1(x1), y1(y1), table(&table)
+	{
+		// extra pixels either side that samples in this tile can reach
+		int border = int(std::ceil(table.radius - 0.5));
+		bx0 = std::max(x0 - border, 0);
+		by0 = std::max(y0 - border, 0);
+		bx1 = std::min(x1 + border, image_width);
+		by1 = std::min(y1 + border, image_height);
+
+		pixels.resize(size_t(bx1 - bx0) * (by1 - by0));
+	}
+
+	// Splats a sample taken at continuous film position (px, py) onto every pixel within the filter radius.
+	// Pixel (i, j) has its centre at (i + 0.5, j + 0.5).
+	void add_sample(double px, double py, const color& sample)
+	{
+		// range of pixels whose centre is within the radius of the sample
+		int ix0 = std::max(int(std::ceil(px - 0.5 - table->radius)), bx0);
+		int iy0 = std::max(int(std::ceil(py - 0.5 - table->radius)), by0);
+		int ix1 = std::min(int(std::floor(px - 0.5 + table->radius)), bx1 - 1);
+		int iy1 = std::min(int(std::floor(py - 0.5 + table->radius)), by1 - 1);
+
+		for (int j = iy0; j <= iy1; j++)
+		{
+			for (int i = ix0; i <= ix1; i++)
+			{
+				auto w = table->weight(i + 0.5 - px, j + 0.5 - py);
+				if (w == 0)
+					continue;
+
+				auto& pixel = pixels[size_t(j - by0) * (bx1 - bx0) + (i - bx0)];
+				pixel.weighted_sum += w * sample;
+				pixel.weight_sum += w;
+			}
+		}
+	}
+
+	// Pixels this tile is responsible for sampling
+	int x0, y0, x1, y1;
+	// Pixels this tile's buffer covers (the above plus the filter border)
+	int bx0, by0, bx1, by1;
+	std::vector<film_pixel> pixels;
+
+private:
+	// a pointer rather than a reference so tiles can be reassigned
+	const filter_table* table;
+};
+
+/// <summary>
+/// The framebuffer. Holds the filtered sum of every sample and writes the final image.
+/// Camera samples arrive a whole tile at a time through merge_tile. Contributions that can land
+/// anywhere in the image (light tracing) go through add_splat instead, which is lock-free.
+/// </summary>
+class film
+{
+public:
+	film(int image_width, int image_height, const filter& pixel_filter)
+		: image_width(image_width), image_height(image_height), table(pixel_filter)
+	{
+		pixels.resize(size_t(image_width) * image_height);
+		splats.reset(new film_splat[size_t(image_width) * image_height]);
+	}
+
+	int width() const { return image_width; }
+	int height() const { return image_height; }
+
+	// Returns an empty tile covering pixels [x0, x1) x [y0, y1), clipped to the image
+	film_tile make_tile(int x0, int y0, int x1, int y1) const
+	{
+		return film_tile(x0, y0, std::min(x1, image_width), std::min(y1, image_height),
+						 image_width, image_height, table);
+	}
+
+	// Adds a finished tile's totals into the film. Safe to call from several threads.
+	// Neighbouring tiles overlap in their borders, so merges are serialised. This happens once per tile
+	// rather than once per sample, so the lock is almost never contended.
+	void merge_tile(const film_tile& tile)
+	{
+		std::lock_guard<std::mutex> lock(merge_mutex);
+
+		int tile_width = tile.bx1 - tile.bx0;
+		for (int j = tile.by0; j < tile.by1; j++)
+		{
+			for (int i = tile.bx0; i < tile.bx1; i++)
+			{
+				const auto& src = tile.pixels[size_t(j - tile.by0) * tile_width + (i - tile.bx0)];
+				auto& dst = pixels[size_t(j) * image_width + i];
+				dst.weighted_sum += src.weighted_sum;
+				dst.weight_sum += src.weight_sum;
+			}
+		}
+	}
+
+	// Splats a contribution at film position (px, py) onto the pixels within the filter radius.
+	// Can be called from any thread at any time. Unlike camera samples these are not divided by
+	// the weight sum, so the filter weight is normalised to integrate to 1 instead.
+	void add_splat(double px, double py, const color& contribution)
+	{
+		int ix0 = std::max(int(std::ceil(px - 0.5 - table.radius)), 0);
+		int iy0 = std::max(int(std::ceil(py - 0.5 - table.radius)), 0);
+		int ix1 = std::min(int(std::floor(px - 0.5 + table.radius)), image_width - 1);
+		int iy1 = std::min(int(std::floor(py - 0.5 + table.radius)), image_height - 1);
+
+		for (int j = iy0; j <= iy1; j++)
+		{
+			for (int i = ix0; i <= ix1; i++)
+			{
+				auto w = table.weight(i + 0.5 - px, j + 0.5 - py) / table.integral;
+				if (w == 0)
+					continue;
+
+				auto& splat = splats[size_t(j) * image_width + i];
+				splat.r.add(w * contribution.x());
+				splat.g.add(w * contribution.y());
+				splat.b.add(w * contribution.z());
+			}
+		}
+	}
+
+	// Adds other's splatted contributions, times scale, to this film's. The films must be the same size.
+	void add_splats(const film& other, double scale)
+	{
+		for (size_t i = 0; i < size_t(image_width) * image_height; i++)
+		{
+			const auto& from = other.splats[i];
+			splats[i].r.add(scale * from.r.load());
+			splats[i].g.add(scale * from.g.load());
+			splats[i].b.add(scale * from.b.load());
+		}
+	}
+
+	// Records that per_pixel more light paths were traced for each pixel. Splatted contributions are divided
+	// by the total, so an image built up over several passes stays as bright as a single pass would make it.
+	void add_light_paths(int per_pixel)
+	{
+		light_paths += per_pixel;
+	}
+
+	// What guided passes have learned about where the light comes from (see path_guide), or null before the
+	// first. Kept with the film so that learning carries on from one pass of a progressive render to the next.
+	path_guide* guide() const { return learned_guide.get(); }
+	void set_guide(std::shared_ptr<path_guide> guide) { learned_guide = std::move(guide); }
+
+	// The caustic photon map traced for the first pass (see photon_map), or null before it. Kept with the film so
+	// that later passes of a progressive render use it rather than tracing their own.
+	const photon_map* caustics() const { return caustic_photons.get(); }
+	void set_caustics(std::shared_ptr<const photon_map> caustics) { caustic_photons = std::move(caustics); }
+
+	// The irradiance cache that earlier passes filled in (see irradiance_cache), or null before the first
+	irradiance_cache* irradiance() const { return irradiance_records.get(); }
+	void set_irradiance(std::shared_ptr<irradiance_cache> irradiance) { irradiance_records = std::move(irradiance); }
+
+	// Final (filtered) colour of pixel (i, j).
+	// splat_scale is applied to the splatted contributions, on top of dividing by the light paths per pixel.
+	color pixel_color(int i, int j, double splat_scale = 1.0) const
+	{
+		const auto& pixel = pixels[size_t(j) * image_width + i];
+		const auto& splat = splats[size_t(j) * image_width + i];
+
+		color result(0, 0, 0);
+		if (pixel.weight_sum != 0)
+			result = pixel.weighted_sum / pixel.weight_sum;
+
+		int paths = light_paths.load();
+		if (paths > 0)
+			splat_scale /= paths;
+
+		return result + splat_scale * color(splat.r.load(), splat.g.load(), splat.b.load());
+	}
+
+	// Fills bytes with the final colours of pixels [x0, x1) x [y0, y1) as 8-bit RGB, row by row.
+	// Takes the merge lock, so it is safe to call while other tiles are still being merged.
+	void tile_rgb(int x0, int y0, int x1, int y1, std::vector<unsigned char>& bytes, double splat_scale = 1.0) const
+	{
+		std::lock_guard<std::mutex> lock(merge_mutex);
+
+		bytes.clear();
+		bytes.reserve(size_t(x1 - x0) * (y1 - y0) * 3);
+		for (int j = y0; j < y1; j++)
+		{
+			for (int i = x0; i < x1; i++)
+			{
+				auto c = pixel_color(i, j, splat_scale);
+				bytes.push_back(to_byte(c.x()));
+				bytes.push_back(to_byte(c.y()));
+				bytes.push_back(to_byte(c.z()));
+			}
+		}
+	}
+
+	// Writes the image to the out stream as a PPM file
+	void write_ppm(std::ostream& out, double splat_scale = 1.0) const
+	{
+		out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+
+		for (int j = 0; j < image_height; j++)
+			for (int i = 0; i < image_width; i++)
+				write_color(out, pixel_color(i, j, splat_scale));
+	}
+
+private:
+	int image_width;
+	int image_height;
+	filter_table table;
+	std::vector<film_pixel> pixels;
+	// std::atomic can't be moved, so this can't live in a std::vector
+	std::unique_ptr<film_splat[]> splats;
+	std::atomic<int> light_paths{ 0 };		// Light paths traced per pixel, if any were counted (see add_light_paths)
+	std::shared_ptr<path_guide> learned_guide;
+	std::shared_ptr<const photon_map> caustic_photons;
+	std::shared_ptr<irradiance_cache> irradiance_records;
+	mutable std::mutex merge_mutex;
+};
+
+#endif
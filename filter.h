@@ -0,0 +1,90 @@
+#pragma once
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "rtweekend.h"
+
+/// <summary>
+/// Reconstruction filter used to weight a sample's contribution to the pixels around it.
+/// x and y are the offset from the sample to the pixel centre, in pixels.
+/// All filters here are symmetric, so only |x| and |y| matter.
+/// </summary>
+class filter
+{
+public:
+	filter(double radius) : r(radius) {}
+	virtual ~filter() = default;
+
+	// How far (in pixels) a sample reaches in x and y
+	double radius() const { return r; }
+
+	// Weight of a sample at offset (x, y). Zero outside the radius.
+	virtual double evaluate(double x, double y) const = 0;
+
+protected:
+	double r;
+};
+
+/// <summary>
+/// Every sample within the radius counts equally. With radius 0.5 this is plain per-pixel averaging.
+/// </summary>
+class box_filter : public filter
+{
+public:
+	box_filter(double radius = 0.5) : filter(radius) {}
+
+	double evaluate(double x, double y) const override
+	{
+		return (std::fabs(x) <= r && std::fabs(y) <= r) ? 1.0 : 0.0;
+	}
+};
+
+/// <summary>
+/// Weight falls off linearly from the centre to the radius (a pyramid in 2D).
+/// </summary>
+class tent_filter : public filter
+{
+public:
+	tent_filter(double radius = 1.0) : filter(radius) {}
+
+	double evaluate(double x, double y) const override
+	{
+		return std::fmax(0.0, r - std::fabs(x)) * std::fmax(0.0, r - std::fabs(y));
+	}
+};
+
+/// <summary>
+/// Smooth, bell-shaped window that falls to almost exactly zero at the radius.
+/// Sharper than a Gaussian of the same width with less ringing than a windowed sinc.
+/// </summary>
+class blackman_harris_filter : public filter
+{
+public:
+	blackman_harris_filter(double radius = 2.0) : filter(radius) {}
+
+	double evaluate(double x, double y) const override
+	{
+		// The filter is separable, so the 2D weight is just the 1D weight in x times the one in y
+		return blackman_harris(x) * blackman_harris(y);
+	}
+
+private:
+	double blackman_harris(double x) const
+	{
+		if (std::fabs(x) > r)
+			return 0.0;
+
+		// remap [-r, r] to [0, 1], the range the window is defined over
+		auto t = (x + r) / (2 * r);
+
+		const double a0 = 0.35875;
+		const double a1 = 0.48829;
+		const double a2 = 0.14128;
+		const double a3 = 0.01168;
+
+		return a0 - a1 * std::cos(2 * pi * t) + a2 * std::cos(4 * pi * t) - a3 * std::cos(6 * pi * t);
+	}
+};
+
+#endif
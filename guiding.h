@@ -0,0 +1,420 @@
+#pragma once
+
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/// <summary>
+/// How much light arrives from each direction at some region of the scene, as a quadtree over the square
+/// that the sphere of directions maps onto (cos theta across, phi down, which keeps areas in proportion).
+/// Each node holds the light recorded in each of its four quarters, and splits the quarters that get more
+/// than their share so that bright directions are described finely and dark ones coarsely.
+///
+/// Light is recorded from every render thread at once, so the sums are atomic.
+/// </summary>
+class directional_tree
+{
+public:
+	directional_tree() : nodes(1) {}
+
+	int node_count() const { return int(nodes.size()); }
+	double total() const { return nodes[0].total(); }
+
+	// Adds value to the light arriving from unit direction d
+	void record(const vec3& d, double value)
+	{
+		double x, y;
+		direction_to_square(d, x, y);
+
+		int index = 0;
+		while (true)
+		{
+			int quarter = quadrant(x, y);
+			auto& current = nodes[index];
+			atomic_add(current.sums[quarter], float(value));
+			if (current.children[quarter] == 0)
+				return;
+			index = current.children[quarter];
+		}
+	}
+
+	// Picks a direction in proportion to the light recorded from it, and sets pdf to its density per solid
+	// angle. Call only if total() > 0.
+	vec3 sample(double& pdf) const
+	{
+		double x0 = 0, y0 = 0, size = 1;
+		double square_pdf = 1;
+		int index = 0;
+		while (true)
+		{
+			const auto& current = nodes[index];
+			double node_total = current.total();
+
+			// Picks a quarter by its share of the light
+			double u = random_double() * node_total;
+			int quarter = 0;
+			for (; quarter < 3; quarter++)
+			{
+				u -= current.sums[quarter];
+				if (u < 0)
+					break;
+			}
+
+			square_pdf *= 4 * current.sums[quarter] / node_total;
+			size /= 2;
+			x0 += (quarter & 1) * size;
+			y0 += (quarter >> 1) * size;
+			if (current.children[quarter] == 0)
+				break;
+			index = current.children[quarter];
+		}
+
+		pdf = square_pdf / (4 * pi);
+		return square_to_direction(x0 + random_double() * size, y0 + random_double() * size);
+	}
+
+	// Density of sample picking unit direction d
+	double pdf(const vec3& d) const
+	{
+		double x, y;
+		direction_to_square(d, x, y);
+
+		double square_pdf = 1;
+		int index = 0;
+		while (true)
+		{
+			const auto& current = nodes[index];
+			double node_total = current.total();
+			if (node_total <= 0)
+				return 0;
+
+			int quarter = quadrant(x, y);
+			square_pdf *= 4 * current.sums[quarter] / node_total;
+			if (current.children[quarter] == 0 || square_pdf == 0)
+				break;
+			index = current.children[quarter];
+		}
+
+		return square_pdf / (4 * pi);
+	}
+
+	// A tree with nothing recorded, split wherever this one saw more than threshold of its light (down to
+	// max_depth levels), and merged back wherever it saw less
+	directional_tree refined(double threshold, int max_depth) const
+	{
+		directional_tree result;
+		result.nodes.reserve(nodes.size());
+		double all = total();
+		if (all > 0)
+			refine(0, 0, all, threshold, max_depth, result, 0);
+		return result;
+	}
+
+private:
+	/// <summary>
+	/// A node of the tree: the light recorded in each quarter, and each quarter's child node (0 if none;
+	/// the root is never anyone's child).
+	/// </summary>
+	class node
+	{
+	public:
+		std::atomic<float> sums[4] = { { 0 }, { 0 }, { 0 }, { 0 } };
+		int children[4] = { 0, 0, 0, 0 };
+
+		node() = default;
+		node(const node& other) { *this = other; }
+
+		node& operator=(const node& other)
+		{
+			for (int i = 0; i < 4; i++)
+			{
+				sums[i] = other.sums[i].load();
+				children[i] = other.children[i];
+			}
+			return *this;
+		}
+
+		double total() const { return double(sums[0]) + sums[1] + sums[2] + sums[3]; }
+	};
+
+	std::vector<node> nodes;
+
+	static void atomic_add(std::atomic<float>& sum, float value)
+	{
+		float current = sum.load(std::memory_order_relaxed);
+		while (!sum.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	// Which quarter of the unit square (x, y) is in, rescaling (x, y) to be the position within it
+	static int quadrant(double& x, double& y)
+	{
+		int quarter = 0;
+		x *= 2;
+		y *= 2;
+		if (x >= 1)
+			x -= 1, quarter |= 1;
+		if (y >= 1)
+			y -= 1, quarter |= 2;
+		return quarter;
+	}
+
+	static void direction_to_square(const vec3& d, double& x, double& y)
+	{
+		x = clamp((d.z() + 1) / 2, 0, 1 - 1e-9);
+		double phi = std::atan2(d.y(), d.x());
+		y = clamp((phi < 0 ? phi + 2 * pi : phi) / (2 * pi), 0, 1 - 1e-9);
+	}
+
+	static vec3 square_to_direction(double x, double y)
+	{
+		double cos_theta = 2 * x - 1;
+		double sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+		double phi = 2 * pi * y;
+		return vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+	}
+
+	// Copies the structure of node index into result's node result_index, splitting quarters holding more than
+	// threshold of all, and collapsing those holding less
+	void refine(int index, int result_index, double all, double threshold, int max_depth, directional_tree& result,
+				int depth) const
+	{
+		for (int quarter = 0; quarter < 4; quarter++)
+		{
+			if (depth + 1 >= max_depth || nodes[index].sums[quarter] / all <= threshold)
+				continue;
+
+			int child = result.node_count();
+			result.nodes[result_index].children[quarter] = child;
+			result.nodes.emplace_back();
+
+			// A quarter that was a leaf is split evenly: its light is assumed spread over the four parts
+			if (nodes[index].children[quarter] != 0)
+			{
+				refine(nodes[index].children[quarter], child, all, threshold, max_depth, result, depth + 1);
+			}
+			else
+			{
+				directional_tree even;
+				for (int i = 0; i < 4; i++)
+					even.nodes[0].sums[i] = nodes[index].sums[quarter] / 4;
+				even.refine(0, child, all, threshold, max_depth, result, depth + 1);
+			}
+		}
+	}
+};
+
+/// <summary>
+/// Learns where light comes from throughout the scene while it renders, so later samples can be aimed at the
+/// bright directions ("practical path guiding", Müller, Gross and Novák 2017). A binary tree splits the scene's
+/// bounds into regions, halving them along x, y and z in turn, and each region has two directional trees: one
+/// that paths sample from, learned by the last iteration, and one that this iteration records into.
+///
+/// Iterations take 1, 4, 16... samples per pixel, and after each one refine splits the regions that recorded
+/// many paths and rebuilds the directional trees around the light found, then the new trees take over for
+/// sampling. Both kinds of splitting stop once the trees would use more than the memory limit. Learning stops
+/// once the next iteration would leave less than four times its own samples to render with what it learned.
+/// </summary>
+class path_guide
+{
+public:
+	// total_samples is how many samples per pixel the whole render will take
+	path_guide(const aabb& bounds, std::size_t memory_limit, int total_samples)
+		: bounds(bounds), memory_limit(memory_limit), samples_left(total_samples), learning(total_samples >= 5)
+	{
+		spatial.emplace_back();
+		regions.push_back(std::make_unique<region>());
+	}
+
+	// Samples per pixel left in the iteration being learned, or 0 once learning has stopped. A pass should
+	// take no more than this before calling add_samples, so that later samples use what it learned.
+	int samples_to_learn() const { return learning ? iteration_samples - iteration_done : 0; }
+
+	// Call after rendering samples more per pixel. Ends the iteration, refining the guide, once it has taken
+	// all of its samples.
+	void add_samples(int samples)
+	{
+		samples_left -= samples;
+		if (!learning)
+			return;
+
+		iteration_done += samples;
+		if (iteration_done < iteration_samples)
+			return;
+
+		refine(iteration_samples);
+		iteration_samples *= 4;
+		iteration_done = 0;
+		learning = samples_left >= 5 * iteration_samples;
+	}
+
+	// The directions learned near p, or null where nothing has been learned yet
+	const directional_tree* sampling_tree(const point3& p) const
+	{
+		const auto& found = *regions[find_region(p)];
+		return found.sampling.total() > 0 ? &found.sampling : nullptr;
+	}
+
+	// Records value, light arriving at p from unit direction d over the density with which d was picked.
+	// Does nothing once learning has stopped.
+	void record(const point3& p, const vec3& d, double value)
+	{
+		if (!learning)
+			return;
+
+		// Paths that found no light still count towards splitting: dark regions need detail as much as bright
+		auto& found = *regions[find_region(p)];
+		found.paths++;
+		if (value > 0 && value != infinity)
+			found.training.record(d, value);
+	}
+
+	// Bytes used by the trees, roughly
+	std::size_t memory_used() const
+	{
+		std::size_t size = 0;
+		for (const auto& leaf : regions)
+			size += leaf->sampling.node_count() + leaf->training.node_count();
+		return size * node_size + spatial.size() * sizeof(spatial_node);
+	}
+
+private:
+	/// <summary>
+	/// A region of the scene that hasn't been split: the trees that paths sample from and record into, and
+	/// how many paths it has recorded this iteration.
+	/// </summary>
+	class region
+	{
+	public:
+		directional_tree sampling;
+		directional_tree training;
+		std::atomic<int> paths{ 0 };
+	};
+
+	/// <summary>
+	/// A node of the binary tree over the scene: split in half along axis into children, or a leaf
+	/// holding region (the index of its entry in regions).
+	/// </summary>
+	class spatial_node
+	{
+	public:
+		int axis = 0;
+		int children[2] = { 0, 0 };
+		int region = 0;
+	};
+
+	// Four sums and four child indices
+	static constexpr std::size_t node_size = 32;
+
+	aabb bounds;
+	std::size_t memory_limit;
+	std::vector<spatial_node> spatial;
+	std::vector<std::unique_ptr<region>> regions;		// Pointers, as regions hold atomics and can't move
+
+	int samples_left;			// Samples per pixel the render has still to take
+	int iteration_samples = 1;
+	int iteration_done = 0;		// Samples per pixel the current iteration has taken so far
+	bool learning;
+
+	// Ends an iteration that took iteration_samples per pixel. Regions that recorded more than 1000 paths
+	// times the square root of that are split, so the tree grows more slowly than the number of paths.
+	void refine(int iteration_samples)
+	{
+		int split_threshold = int(1000 * std::sqrt(double(iteration_samples)));
+		for (int i = 0; i < int(spatial.size()); i++)
+		{
+			if (spatial[i].children[0] != 0)
+				continue;
+
+			auto& leaf = *regions[spatial[i].region];
+			if (leaf.paths <= split_threshold)
+				continue;
+
+			// A copy of the region's light, an empty tree to sample from and two nodes of the binary tree
+			std::size_t split_size = (leaf.training.node_count() + 1) * node_size + 2 * sizeof(spatial_node);
+			if (memory_used() + split_size > memory_limit / 2)
+				continue;
+
+			// Both halves start with the whole region's light, as each has seen about half the paths. The
+			// first half keeps the region itself, so only leaves are ever in regions.
+			leaf.paths = leaf.paths / 2;
+			auto split = std::make_unique<region>();
+			split->training = leaf.training;
+			split->paths = leaf.paths.load();
+
+			int first = int(spatial.size());
+			spatial[i].children[0] = first;
+			spatial[i].children[1] = first + 1;
+			for (int half = 0; half < 2; half++)
+			{
+				spatial.emplace_back();
+				spatial.back().axis = (spatial[i].axis + 1) % 3;
+			}
+			spatial[first].region = spatial[i].region;
+			spatial[first + 1].region = int(regions.size());
+			regions.push_back(std::move(split));
+		}
+
+		// The light just recorded becomes what paths sample, and the next iteration records into trees
+		// shaped around it. Coarser trees are built if the finer ones would take too much memory, down to a
+		// single node each once the threshold passes 1. Those fit whenever the guide fitted before, as the
+		// sampling trees they take the place of had at least one node each.
+		for (double threshold = 0.01;; threshold *= 2)
+		{
+			std::size_t size = spatial.size() * sizeof(spatial_node);
+			std::vector<directional_tree> next;
+			next.reserve(regions.size());
+			for (const auto& leaf : regions)
+			{
+				next.push_back(leaf->training.refined(threshold, 20));
+				size += (leaf->training.node_count() + next.back().node_count()) * node_size;
+			}
+
+			if (size <= memory_limit || threshold > 1)
+			{
+				for (std::size_t i = 0; i < regions.size(); i++)
+				{
+					regions[i]->sampling = regions[i]->training;
+					regions[i]->training = next[i];
+					regions[i]->paths = 0;
+				}
+				break;
+			}
+		}
+	}
+
+	int find_region(const point3& p) const
+	{
+		point3 low = bounds.minimum, high = bounds.maximum;
+		int index = 0;
+		while (spatial[index].children[0] != 0)
+		{
+			const auto& current = spatial[index];
+			double middle = 0.5 * (low[current.axis] + high[current.axis]);
+			if (p[current.axis] < middle)
+			{
+				high[current.axis] = middle;
+				index = current.children[0];
+			}
+			else
+			{
+				low[current.axis] = middle;
+				index = current.children[1];
+			}
+		}
+
+		return spatial[index].region;
+	}
+};
+
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+
+#ifndef HITTABLE_H
+#define HITTABLE_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+
+class material;
+
+/// <summary>
+/// Everything we need to know about where a ray hit an object.
+/// </summary>
+class hit_record
+{
+public:
+	point3 p;
+	vec3 normal;
+	// A plain pointer rather than a shared_ptr: hit records are copied for every hit,
+	// and the object that was hit keeps the material alive anyway.
+	const material* mat = nullptr;
+	double t = 0;
+	bool front_face = false;
+
+	// Sets the hit record normal vector so that it always points against the ray.
+	// NOTE: the parameter outward_normal is assumed to have unit length.
+	void set_face_normal(const ray& r, const vec3& outward_normal)
+	{
+		// If the ray and the outward normal point in opposite directions, the ray is outside the object
+		front_face = dot(r.direction(), outward_normal) < 0;
+		normal = front_face ? outward_normal : -outward_normal;
+	}
+};
+
+/// <summary>
+/// Abstract class for anything a ray can hit.
+/// </summary>
+class hittable
+{
+public:
+	virtual ~hittable() = default;
+
+	// Only hits with ray_tmin < t < ray_tmax count
+	virtual bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const = 0;
+
+	// Is there anything at all between ray_tmin and ray_tmax? Used for shadow rays, which only need a yes or no.
+	// Unlike hit, this can stop at the first thing it finds and doesn't need to work out any shading data.
+	// The default just calls hit; objects override it when they can answer more cheaply.
+	virtual bool occluded(const ray& r, double ray_tmin, double ray_tmax) const
+	{
+		hit_record rec;
+		return hit(r, ray_tmin, ray_tmax, rec);
+	}
+
+	// Box that completely contains the object
+	virtual aabb bounding_box() const = 0;
+};
+
+#endif
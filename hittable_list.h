@@ -0,0 +1,68 @@
+#pragma once
+
+#ifndef HITTABLE_LIST_H
+#define HITTABLE_LIST_H
+
+#include "hittable.h"
+
+#include <vector>
+
+/// <summary>
+/// Stores a list of hittables and is itself a hittable, returning the closest hit.
+/// </summary>
+class hittable_list : public hittable
+{
+public:
+	std::vector<shared_ptr<hittable>> objects;
+
+	hittable_list() {}
+	hittable_list(shared_ptr<hittable> object) { add(object); }
+
+	void clear()
+	{
+		objects.clear();
+		bbox = aabb();
+	}
+
+	void add(shared_ptr<hittable> object)
+	{
+		objects.push_back(object);
+		bbox.expand(object->bounding_box());
+	}
+
+	bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override
+	{
+		hit_record temp_rec;
+		bool hit_anything = false;
+		// Each hit shrinks the range, so only closer objects can replace it
+		auto closest_so_far = ray_tmax;
+
+		for (const auto& object : objects)
+		{
+			if (object->hit(r, ray_tmin, closest_so_far, temp_rec))
+			{
+				hit_anything = true;
+				closest_so_far = temp_rec.t;
+				rec = temp_rec;
+			}
+		}
+
+		return hit_anything;
+	}
+
+	bool occluded(const ray& r, double ray_tmin, double ray_tmax) const override
+	{
+		for (const auto& object : objects)
+			if (object->occluded(r, ray_tmin, ray_tmax))
+				return true;
+
+		return false;
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+private:
+	aabb bbox;
+};
+
+#endif
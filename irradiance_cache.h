@@ -0,0 +1,154 @@
+#pragma once
+
+#ifndef IRRADIANCE_CACHE_H
+#define IRRADIANCE_CACHE_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "color.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+/// <summary>
+/// The light arriving at one point on a matte surface from the whole hemisphere above it, worked out by
+/// tracing many rays, and how far it can be reused: radius is the harmonic mean distance to the surfaces
+/// those rays hit, so records near walls and corners, where the light changes quickly, reach less far.
+/// </summary>
+class irradiance_record
+{
+public:
+	point3 p;
+	vec3 normal;
+	color irradiance;			// Irradiance over pi: the cosine-weighted average of the light arriving
+	double radius;
+};
+
+/// <summary>
+/// An irradiance cache (Ward, Rubinstein and Clear 1988). Light bouncing between matte surfaces changes
+/// slowly across them, so it is worked out at scattered points, and anything in between interpolates the
+/// records around it instead of tracing hundreds of rays of its own.
+///
+/// A record is used at p if its error estimate, distance / radius plus how far the normals differ, is
+/// below accuracy. Records are kept in an octree, each in the smallest node at least twice as wide as the
+/// distance it can reach, so a lookup only visits the nodes on its way down and their neighbours.
+/// Lookups from several threads run together; adding a record briefly locks everyone else out.
+/// </summary>
+class irradiance_cache
+{
+public:
+	irradiance_cache(const aabb& bounds, double accuracy)
+		: accuracy(accuracy)
+	{
+		root.center = bounds.centroid();
+		auto extent = bounds.extent();
+		root.half_size = 0.5 * std::fmax(extent.x(), std::fmax(extent.y(), extent.z())) * 1.001 + 1e-6;
+	}
+
+	int size() const { return record_count; }
+
+	// Sets irradiance to the weighted average of the records that can be used at p, on a surface facing
+	// normal. Returns false, leaving irradiance alone, if they don't cover p well enough: needing a total
+	// weight of min_weight means records overlap, so that a new one blends in with those around it.
+	bool lookup(const point3& p, const vec3& normal, color& irradiance) const
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+
+		color sum(0, 0, 0);
+		double weight_sum = 0;
+		gather(root, p, normal, sum, weight_sum);
+		if (weight_sum < min_weight)
+			return false;
+
+		irradiance = sum / weight_sum;
+		return true;
+	}
+
+	void add(const irradiance_record& record)
+	{
+		double reach = accuracy * record.radius;
+
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		node* current = &root;
+		for (int depth = 0; depth < max_depth && current->half_size >= 2 * reach; depth++)
+		{
+			int octant = current->octant(record.p);
+			auto& child = current->children[octant];
+			if (!child)
+			{
+				child = std::make_unique<node>();
+				child->half_size = current->half_size / 2;
+				child->center = current->center + child->half_size * vec3(octant & 1 ? 1 : -1, octant & 2 ? 1 : -1, octant & 4 ? 1 : -1);
+			}
+			current = child.get();
+		}
+
+		current->records.push_back(record);
+		record_count++;
+	}
+
+private:
+	/// <summary>
+	/// A cube of the octree, holding the records whose reach is no more than half its width.
+	/// </summary>
+	class node
+	{
+	public:
+		point3 center;
+		double half_size = 0;
+		std::vector<irradiance_record> records;
+		std::unique_ptr<node> children[8];
+
+		// The child p falls in: bit 0 for x, 1 for y and 2 for z
+		int octant(const point3& p) const
+		{
+			return (p.x() > center.x() ? 1 : 0) | (p.y() > center.y() ? 2 : 0) | (p.z() > center.z() ? 4 : 0);
+		}
+	};
+
+	static constexpr int max_depth = 24;
+	static constexpr double min_weight = 0.5;
+
+	double accuracy;
+	node root;
+	std::atomic<int> record_count{ 0 };
+	mutable std::shared_mutex mutex;
+
+	void gather(const node& current, const point3& p, const vec3& normal, color& sum, double& weight_sum) const
+	{
+		for (const auto& record : current.records)
+		{
+			auto offset = p - record.p;
+			double error = offset.length() / record.radius + std::sqrt(std::fmax(0.0, 1 - dot(normal, record.normal)));
+			if (error >= accuracy)
+				continue;
+
+			// A record in front of p sees light that p is shadowed from
+			if (dot(offset, normal + record.normal) < -0.1 * record.radius)
+				continue;
+
+			// Falls to 0 at the edge of the record's reach, so records appearing don't leave seams
+			double weight = 1 - error / accuracy;
+			sum += weight * record.irradiance;
+			weight_sum += weight;
+		}
+
+		// A record reaches at most half its node's width beyond it, so only nodes that close to p can hold one
+		for (const auto& child : current.children)
+		{
+			if (!child)
+				continue;
+
+			auto d = p - child->center;
+			double limit = 2 * child->half_size;
+			if (std::fabs(d.x()) <= limit && std::fabs(d.y()) <= limit && std::fabs(d.z()) <= limit)
+				gather(*child, p, normal, sum, weight_sum);
+		}
+	}
+};
+
+#endif
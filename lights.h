@@ -0,0 +1,107 @@
+#pragma once
+
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "rtweekend.h"
+
+#include "alias_table.h"
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <unordered_map>
+#include <vector>
+
+/// <summary>
+/// A glowing sphere, which light paths can start from.
+/// </summary>
+class sphere_light
+{
+public:
+	point3 center;
+	double radius;
+	color emit;						// Light given off from every point, in every outward direction
+	const material* mat;			// The sphere's material, to recognise the sphere when a ray hits it
+
+	double area() const { return 4 * pi * radius * radius; }
+};
+
+/// <summary>
+/// The lights that can be sampled directly: every sphere in the scene file with a light material. Picks one
+/// in proportion to the power it gives off, and a point on it.
+/// Emitters that aren't listed here (glowing meshes, say, or spheres in cluster files) still light the scene,
+/// but only rays that happen to hit them find them.
+/// </summary>
+class light_set
+{
+public:
+	void add(const point3& center, double radius, const material* mat)
+	{
+		lights.push_back(sphere_light{ center, radius, mat->emitted(), mat });
+	}
+
+	// Call once every light has been added
+	void build()
+	{
+		std::vector<double> power;
+		for (const auto& light : lights)
+			power.push_back(light.area() * (0.2126 * light.emit.x() + 0.7152 * light.emit.y() + 0.0722 * light.emit.z()));
+
+		picker = alias_table(power);
+
+		by_material.clear();
+		for (int i = 0; i < int(lights.size()); i++)
+			by_material[lights[i].mat].push_back(i);
+	}
+
+	bool empty() const { return lights.empty(); }
+	const sphere_light& operator[](int i) const { return lights[i]; }
+
+	// Chance of light i being picked
+	double probability(int i) const { return picker.probability(i); }
+
+	// Picks a light with u in [0, 1)
+	int pick(double u) const
+	{
+		double unused;
+		return picker.sample(u, unused);
+	}
+
+	// Picks a point uniformly over light i's surface with u1, u2 in [0, 1), and sets normal to its outward normal.
+	// Its density per unit area is 1 / area().
+	point3 sample_point(int i, double u1, double u2, vec3& normal) const
+	{
+		const auto& light = lights[i];
+		double z = 1 - 2 * u1;
+		double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+		double phi = 2 * pi * u2;
+
+		normal = vec3(r * std::cos(phi), r * std::sin(phi), z);
+		return light.center + light.radius * normal;
+	}
+
+	// Which light rec is on, or -1 if it isn't on any of them. Only the lights made of rec's material are checked.
+	int find(const hit_record& rec) const
+	{
+		auto found = by_material.find(rec.mat);
+		if (found == by_material.end())
+			return -1;
+
+		for (int i : found->second)
+		{
+			const auto& light = lights[i];
+			if (light.mat == rec.mat && std::fabs((rec.p - light.center).length() - light.radius) < 1e-6 + 1e-4 * light.radius)
+				return i;
+		}
+
+		return -1;
+	}
+
+private:
+	std::vector<sphere_light> lights;
+	alias_table picker;
+	std::unordered_map<const material*, std::vector<int>> by_material;	// Lights made of each material, for find
+};
+
+#endif
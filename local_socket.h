@@ -0,0 +1,245 @@
+#pragma once
+
+#ifndef LOCAL_SOCKET_H
+#define LOCAL_SOCKET_H
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if defined(_WIN32)
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+	#pragma comment(lib, "Ws2_32.lib")
+#else
+	#include <arpa/inet.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <sys/select.h>
+	#include <sys/socket.h>
+	#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+	using socket_handle = SOCKET;
+	const socket_handle no_socket = INVALID_SOCKET;
+#else
+	using socket_handle = int;
+	const socket_handle no_socket = -1;
+#endif
+
+/// <summary>
+/// Thrown when a socket can't be opened, or the other end goes away.
+/// </summary>
+class socket_error : public std::runtime_error
+{
+public:
+	socket_error(const std::string& message) : std::runtime_error(message) {}
+};
+
+// Windows needs the socket library starting up once before any socket is made
+inline void start_sockets()
+{
+#if defined(_WIN32)
+	static bool started = false;
+	if (!started)
+	{
+		WSADATA data;
+		if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+			throw socket_error("couldn't start Winsock");
+		started = true;
+	}
+#endif
+}
+
+inline void close_socket(socket_handle handle)
+{
+#if defined(_WIN32)
+	closesocket(handle);
+#else
+	close(handle);
+#endif
+}
+
+/// <summary>
+/// A TCP connection. Owns the socket and closes it when destroyed.
+/// Reads are buffered so that text lines and raw bytes can be mixed on the same connection.
+/// </summary>
+class socket_connection
+{
+public:
+	socket_connection() {}
+	socket_connection(socket_handle handle) : handle(handle) {}
+	~socket_connection() { close(); }
+
+	socket_connection(socket_connection&& other) noexcept { *this = std::move(other); }
+	socket_connection& operator=(socket_connection&& other) noexcept
+	{
+		if (this != &other)
+		{
+			close();
+			handle = other.handle;
+			buffer = std::move(other.buffer);
+			other.handle = no_socket;
+		}
+		return *this;
+	}
+
+	socket_connection(const socket_connection&) = delete;
+	socket_connection& operator=(const socket_connection&) = delete;
+
+	bool is_open() const { return handle != no_socket; }
+
+	void close()
+	{
+		if (handle != no_socket)
+			close_socket(handle);
+		handle = no_socket;
+	}
+
+	// Sends all of data, however many calls to send that takes
+	void send_all(const void* data, size_t size)
+	{
+		auto bytes = static_cast<const char*>(data);
+
+		// Writing to a closed connection raises SIGPIPE on Linux, which would end the program; ask for an error instead
+#if defined(MSG_NOSIGNAL)
+		const int flags = MSG_NOSIGNAL;
+#else
+		const int flags = 0;
+#endif
+
+		while (size > 0)
+		{
+			auto sent = ::send(handle, bytes, int(size), flags);
+			if (sent <= 0)
+				throw socket_error("connection closed while sending");
+
+			bytes += sent;
+			size -= size_t(sent);
+		}
+	}
+
+	void send_all(const std::string& text)
+	{
+		send_all(text.data(), text.size());
+	}
+
+	// True if there is something to read, waiting up to timeout_ms milliseconds for it
+	bool can_read(int timeout_ms = 0)
+	{
+		if (!buffer.empty())
+			return true;
+
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(handle, &readable);
+
+		timeval timeout;
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+		return select(int(handle) + 1, &readable, nullptr, nullptr, &timeout) > 0;
+	}
+
+	// Reads one line of text, without the newline. Blocks until the whole line has arrived.
+	std::string read_line()
+	{
+		size_t newline;
+		while ((newline = buffer.find('\n')) == std::string::npos)
+			fill();
+
+		auto line = buffer.substr(0, newline);
+		buffer.erase(0, newline + 1);
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+
+		return line;
+	}
+
+	// Reads exactly size bytes. Blocks until they have all arrived.
+	std::string read_bytes(size_t size)
+	{
+		while (buffer.size() < size)
+			fill();
+
+		auto bytes = buffer.substr(0, size);
+		buffer.erase(0, size);
+		return bytes;
+	}
+
+private:
+	socket_handle handle = no_socket;
+	std::string buffer;		// Received but not yet read
+
+	void fill()
+	{
+		char chunk[4096];
+		auto received = ::recv(handle, chunk, int(sizeof(chunk)), 0);
+		if (received <= 0)
+			throw socket_error("connection closed");
+
+		buffer.append(chunk, size_t(received));
+	}
+};
+
+/// <summary>
+/// Listens for TCP connections on a port of this machine only (127.0.0.1), so nothing on the network can connect.
+/// </summary>
+class socket_listener
+{
+public:
+	socket_listener(int port)
+	{
+		start_sockets();
+
+		handle = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (handle == no_socket)
+			throw socket_error("couldn't create a socket");
+
+		// lets the server restart straight away on the same port
+		int reuse = 1;
+		setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(static_cast<unsigned short>(port));
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		if (::bind(handle, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(handle, 1) != 0)
+		{
+			close_socket(handle);
+			throw socket_error("couldn't listen on port " + std::to_string(port));
+		}
+	}
+
+	~socket_listener() { close_socket(handle); }
+
+	socket_listener(const socket_listener&) = delete;
+	socket_listener& operator=(const socket_listener&) = delete;
+
+	// Waits for the next client to connect
+	socket_connection accept()
+	{
+		auto client = ::accept(handle, nullptr, nullptr);
+		if (client == no_socket)
+			throw socket_error("accept failed");
+
+		// tiles are sent as soon as they are ready, so don't hold small writes back
+		int no_delay = 1;
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&no_delay), sizeof(no_delay));
+
+		return socket_connection(client);
+	}
+
+private:
+	socket_handle handle;
+};
+
+#endif
@@ -0,0 +1,242 @@
+#pragma once
+
+#ifndef MATERIAL_H
+#define MATERIAL_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "hittable.h"
+#include "sampler.h"
+#include "spectrum.h"
+
+/// <summary>
+/// Abstract class for how light interacts with a surface.
+/// </summary>
+class material
+{
+public:
+	virtual ~material() = default;
+
+	// Light given off by the surface itself. Only lights return anything but black.
+	virtual color emitted() const
+	{
+		return color(0, 0, 0);
+	}
+
+	// Produces the bounced ray and how much it is dimmed (attenuation).
+	// Returns false if the ray is absorbed instead.
+	virtual bool scatter(const ray& /*r_in*/, const hit_record& /*rec*/, color& /*attenuation*/, ray& /*scattered*/) const
+	{
+		return false;
+	}
+
+	// The same for a spectral path (see camera::spectral), with attenuation at each of its wavelengths.
+	// By default the RGB version is used and its attenuation turned into a spectrum; materials whose behaviour
+	// depends on wavelength override this.
+	virtual bool scatter_spectral(const ray& r_in, const hit_record& rec, wavelengths& lambda, spectrum& attenuation,
+								  ray& scattered) const
+	{
+		color rgb;
+		if (!scatter(r_in, rec, rgb, scattered))
+			return false;
+
+		attenuation = lambda.from_rgb(rgb);
+		return true;
+	}
+
+	// How much of the light arriving from direction wi (unit length, away from the surface) leaves along the
+	// reversed r_in, including the cosine term; scatter's attenuation is this over scattering_pdf. Used when a
+	// direction is picked by something other than scatter, such as a light. Black for surfaces like mirrors and
+	// glass that only send light on in exact directions.
+	virtual color scattering(const ray& /*r_in*/, const hit_record& /*rec*/, const vec3& /*wi*/) const
+	{
+		return color(0, 0, 0);
+	}
+
+	// Density (per solid angle) of scatter picking direction wi, or 0 for exact-direction surfaces
+	virtual double scattering_pdf(const ray& /*r_in*/, const hit_record& /*rec*/, const vec3& /*wi*/) const
+	{
+		return 0;
+	}
+};
+
+/// <summary>
+/// Matte surface that scatters light in random directions (Lambertian reflection).
+/// </summary>
+class lambertian : public material
+{
+public:
+	lambertian(const color& albedo) : albedo(albedo) {}
+
+	bool scatter(const ray& /*r_in*/, const hit_record& rec, color& attenuation, ray& scattered) const override
+	{
+		auto scatter_direction = rec.normal + random_unit_vector();
+
+		// Catch degenerate scatter direction (the random vector was almost exactly opposite the normal)
+		if (scatter_direction.near_zero())
+			scatter_direction = rec.normal;
+
+		scattered = ray(rec.p, scatter_direction);
+		attenuation = albedo;
+		return true;
+	}
+
+	color scattering(const ray& /*r_in*/, const hit_record& rec, const vec3& wi) const override
+	{
+		return albedo * (std::fmax(dot(rec.normal, wi), 0.0) / pi);
+	}
+
+	// scatter's direction is the normal plus a random unit vector, which is cosine-distributed
+	double scattering_pdf(const ray& /*r_in*/, const hit_record& rec, const vec3& wi) const override
+	{
+		return std::fmax(dot(rec.normal, wi), 0.0) / pi;
+	}
+
+private:
+	color albedo;
+};
+
+/// <summary>
+/// Shiny surface that reflects rays like a mirror, optionally blurred by fuzz.
+/// </summary>
+class metal : public material
+{
+public:
+	metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+
+	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
+	{
+		vec3 reflected = reflect(r_in.direction(), rec.normal);
+		// nudge the reflection by a random amount, scaled by fuzz
+		reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
+		scattered = ray(rec.p, reflected);
+		attenuation = albedo;
+		// absorb rays the fuzz pushed below the surface
+		return (dot(scattered.direction(), rec.normal) > 0);
+	}
+
+private:
+	color albedo;
+	double fuzz;
+};
+
+/// <summary>
+/// Clear material like glass or water, which refracts light when it can and reflects when it can't.
+/// </summary>
+class dielectric : public material
+{
+public:
+	// dispersion is the Cauchy coefficient B, in square micrometres, by which the refractive index grows at
+	// shorter wavelengths; refraction_index is the index at 589 nm. Only the spectral mode shows dispersion.
+	dielectric(double refraction_index, double dispersion = 0)
+		: refraction_index(refraction_index), dispersion(dispersion) {}
+
+	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
+	{
+		// glass absorbs nothing
+		attenuation = color(1.0, 1.0, 1.0);
+		return bend(r_in, rec, refraction_index, scattered);
+	}
+
+	bool scatter_spectral(const ray& r_in, const hit_record& rec, wavelengths& lambda, spectrum& attenuation,
+						  ray& scattered) const override
+	{
+		if (dispersion == 0)
+		{
+			attenuation = spectrum(1);
+			return bend(r_in, rec, refraction_index, scattered);
+		}
+
+		// Each wavelength would bend its own way, so only the hero goes on
+		double microns = lambda.hero() / 1000;
+		double index = refraction_index + dispersion * (1 / (microns * microns) - 1 / (0.589 * 0.589));
+		attenuation = lambda.terminate_secondary();
+		return bend(r_in, rec, index, scattered);
+	}
+
+private:
+	// Refractive index in vacuum or air, or the ratio of the material's refractive index over
+	// the refractive index of the enclosing media
+	double refraction_index;
+	double dispersion;
+
+	// Reflects or refracts r_in with refractive index index
+	static bool bend(const ray& r_in, const hit_record& rec, double index, ray& scattered)
+	{
+		double ri = rec.front_face ? (1.0 / index) : index;
+
+		vec3 unit_direction = unit_vector(r_in.direction());
+		double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
+		double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
+
+		// no solution to Snell's law means the ray must reflect (total internal reflection)
+		bool cannot_refract = ri * sin_theta > 1.0;
+		vec3 direction;
+
+		if (cannot_refract || reflectance(cos_theta, ri) > random_double())
+			direction = reflect(unit_direction, rec.normal);
+		else
+			direction = refract(unit_direction, rec.normal, ri);
+
+		scattered = ray(rec.p, direction);
+		return true;
+	}
+
+	// Schlick's approximation for how much light reflects rather than refracts at a given angle
+	static double reflectance(double cosine, double refraction_index)
+	{
+		auto r0 = (1 - refraction_index) / (1 + refraction_index);
+		r0 = r0 * r0;
+		return r0 + (1 - r0) * std::pow((1 - cosine), 5);
+	}
+};
+
+/// <summary>
+/// Scatters light equally in every direction. The "surface" of a volume such as smoke: a hit is a point where
+/// the ray collided with a particle inside it.
+/// </summary>
+class isotropic : public material
+{
+public:
+	isotropic(const color& albedo) : albedo(albedo) {}
+
+	bool scatter(const ray& /*r_in*/, const hit_record& rec, color& attenuation, ray& scattered) const override
+	{
+		scattered = ray(rec.p, random_unit_vector());
+		attenuation = albedo;
+		return true;
+	}
+
+	color scattering(const ray& /*r_in*/, const hit_record& /*rec*/, const vec3& /*wi*/) const override
+	{
+		return albedo / (4 * pi);
+	}
+
+	double scattering_pdf(const ray& /*r_in*/, const hit_record& /*rec*/, const vec3& /*wi*/) const override
+	{
+		return 1 / (4 * pi);
+	}
+
+private:
+	color albedo;
+};
+
+/// <summary>
+/// Gives off light of a fixed colour and brightness and doesn't reflect any.
+/// </summary>
+class diffuse_light : public material
+{
+public:
+	diffuse_light(const color& emit) : emit(emit) {}
+
+	color emitted() const override
+	{
+		return emit;
+	}
+
+private:
+	color emit;
+};
+
+#endif
@@ -0,0 +1,144 @@
+#pragma once
+
+#ifndef METROPOLIS_H
+#define METROPOLIS_H
+
+#include "rtweekend.h"
+
+#include <cstdint>
+#include <vector>
+
+/// <summary>
+/// The random numbers of one Markov chain of primary sample space Metropolis light transport (Kelemen et al.
+/// 2002). A path is traced with random_double taking its numbers from here (see random_source), so the path
+/// tracer runs unchanged, and each new path is a mutation of the last: either every number is picked afresh (a
+/// large step), or each is nudged a little (a small step), which finds paths near one already known to carry
+/// light. Rejecting a mutation puts every number it changed back.
+///
+/// Numbers are mutated lazily, when a path asks for them, so paths that use few numbers cost little; a number
+/// not asked for over several small steps is nudged by all of them at once when it next is. The chain's own
+/// generator is seeded from seed, so two samplers with the same seed give the same first path; reseed then
+/// gives each its own mutations.
+/// </summary>
+class pss_sampler : public random_source
+{
+public:
+	pss_sampler(std::uint64_t seed, double sigma = 0.01, double large_step_probability = 0.3)
+		: state(seed), sigma(sigma), large_step_probability(large_step_probability)
+	{
+	}
+
+	// Starts the next mutation, deciding whether it is a large step
+	void start_iteration()
+	{
+		iteration++;
+		large_step = fresh() < large_step_probability;
+		index = 0;
+	}
+
+	double next() override
+	{
+		if (index >= int(samples.size()))
+			samples.resize(index + 1);
+
+		auto& sample = samples[index++];
+		mutate(sample);
+		return sample.value;
+	}
+
+	bool is_large_step() const { return large_step; }
+
+	// Keeps the mutation just traced
+	void accept()
+	{
+		if (large_step)
+			last_large_step = iteration;
+	}
+
+	// Puts back the numbers the mutation just traced changed
+	void reject()
+	{
+		for (auto& sample : samples)
+		{
+			if (sample.modified == iteration)
+			{
+				sample.value = sample.backup;
+				sample.modified = sample.modified_backup;
+			}
+		}
+		iteration--;
+	}
+
+	// Seeds the chain's own generator afresh, keeping the path already traced: what comes after it, the
+	// mutations and the decisions whether to accept them, is then drawn from seed rather than the path's seed
+	void reseed(std::uint64_t seed)
+	{
+		state = seed;
+	}
+
+	// A number in [0, 1) from the chain's own generator, not part of any path: for deciding whether to accept
+	double fresh()
+	{
+		// splitmix64: seeds that differ by one still give unrelated streams
+		std::uint64_t z = (state += 0x9e3779b97f4a7c15);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		z ^= z >> 31;
+		return double(z >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+private:
+	/// <summary>
+	/// One number of the path, the iteration that last changed it, and both as they were before, for reject.
+	/// </summary>
+	class primary_sample
+	{
+	public:
+		double value = 0;
+		double backup = 0;
+		long long modified = -1;			// Before any iteration: never picked
+		long long modified_backup = -1;
+	};
+
+	std::uint64_t state;
+	double sigma;
+	double large_step_probability;
+
+	std::vector<primary_sample> samples;
+	long long iteration = 0;
+	long long last_large_step = 0;
+	bool large_step = true;			// The first path picks every number afresh
+	int index = 0;
+
+	// Brings sample up to date with the current iteration
+	void mutate(primary_sample& sample)
+	{
+		// New, or not asked for since the last large step: as if that step had picked it
+		if (sample.modified < last_large_step)
+		{
+			sample.value = fresh();
+			sample.modified = last_large_step;
+		}
+
+		sample.backup = sample.value;
+		sample.modified_backup = sample.modified;
+		if (large_step)
+		{
+			sample.value = fresh();
+		}
+		else
+		{
+			// The small steps it missed add up to one with their combined spread, wrapped around [0, 1)
+			long long steps = iteration - sample.modified;
+			double u1 = std::fmax(fresh(), 1e-300);
+			double normal = std::sqrt(-2 * std::log(u1)) * std::cos(2 * pi * fresh());
+			sample.value += normal * sigma * std::sqrt(double(steps));
+			sample.value -= std::floor(sample.value);
+			if (sample.value >= 1)
+				sample.value = 0;
+		}
+		sample.modified = iteration;
+	}
+};
+
+#endif
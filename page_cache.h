@@ -0,0 +1,397 @@
+#pragma once
+
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "hittable.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/// <summary>
+/// Data that lives on disk and is only brought into memory while it's needed: a block of geometry, a texture...
+/// </summary>
+class pageable
+{
+public:
+	virtual ~pageable() = default;
+
+	// Roughly how much memory the page takes up, for page_cache's memory limit
+	size_t memory_size = 0;
+};
+
+class page_cache;
+
+/// <summary>
+/// Pages the current thread asked for and found weren't in memory yet (see page_cache::find).
+/// render_pass checks this after every pixel: a tile that needed missing data is put aside and taken again
+/// later, rather than the render thread sitting idle while the data is read from disk.
+/// </summary>
+class page_faults
+{
+public:
+	// The calling thread's list
+	static page_faults& current()
+	{
+		thread_local page_faults faults;
+		return faults;
+	}
+
+	bool empty() const { return pages.empty(); }
+	void clear() { pages.clear(); }
+
+	// While blocking is on, find waits for missing pages instead of recording a fault.
+	// A tile taken for the second time is rendered this way, so it always finishes.
+	bool blocking = false;
+
+	std::vector<std::pair<page_cache*, int>> pages;
+};
+
+/// <summary>
+/// Keeps track of which pages are in memory, and loads the rest on demand.
+/// Missing pages are read by a few I/O threads of its own, so render threads only ask for a page and move on to
+/// work that doesn't need it (see page_faults). Each page is loaded by a function given when it is added, which
+/// could read from a file, decompress, or anything else slow.
+///
+/// (An asynchronous I/O interface such as io_uring could replace the I/O threads on Linux, but they work
+/// the same everywhere, and with several in flight the disk is kept busy anyway.)
+///
+/// With a memory limit, loading a page that takes the total over the limit drops the least recently used
+/// pages. Renders of data bigger than the limit then slow down as pages are read again, rather than running
+/// out of memory. A dropped page that a thread is still using stays alive until that thread lets go of it.
+/// </summary>
+class page_cache
+{
+public:
+	using loader = std::function<shared_ptr<const pageable>()>;
+
+	// memory_limit is in bytes; 0 means no limit
+	page_cache(int io_thread_count = 2, size_t memory_limit = 0) : memory_limit(memory_limit)
+	{
+		for (int i = 0; i < io_thread_count; i++)
+			io_threads.emplace_back(&page_cache::io_loop, this);
+	}
+
+	~page_cache()
+	{
+		{
+			std::lock_guard<std::mutex> lock(cache_mutex);
+			stopping = true;
+		}
+		requested.notify_all();
+
+		for (auto& thread : io_threads)
+			thread.join();
+	}
+
+	page_cache(const page_cache&) = delete;
+	page_cache& operator=(const page_cache&) = delete;
+
+	// Adds a page, not yet loaded, that load will produce when it's needed. Returns the page's id.
+	// Pages must all be added before rendering starts.
+	int add_page(loader load)
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		entries.emplace_back(new page_entry(std::move(load)));
+		return int(entries.size()) - 1;
+	}
+
+	int page_count() const { return int(entries.size()); }
+
+	// Returns page id if it is in memory. If it isn't, an I/O thread is asked to load it, the page is added to
+	// the calling thread's page_faults, and null is returned; unless page_faults::blocking is on, in which case
+	// this waits for it instead. The returned pointer keeps the page alive for as long as it's held.
+	shared_ptr<const pageable> find(int id)
+	{
+		auto& entry = *entries[id];
+
+		// The usual case, and the one that needs to be fast: the page is there
+		auto data = entry.get();
+		if (data)
+		{
+			// Recency is only counted in loads, so most finds don't need to write to the entry
+			auto now = use_clock.load(std::memory_order_relaxed);
+			if (entry.last_used.load(std::memory_order_relaxed) != now)
+				entry.last_used.store(now, std::memory_order_relaxed);
+
+			return data;
+		}
+
+		auto& faults = page_faults::current();
+		if (!faults.blocking)
+		{
+			if (request(id))
+				faults.pages.emplace_back(this, id);
+			return nullptr;
+		}
+
+		return load_now(id);
+	}
+
+	bool is_resident(int id) const
+	{
+		return entries[id]->get() != nullptr;
+	}
+
+	// Starts loading page id in the background if it isn't in memory or on its way. Returns false if the page
+	// failed to load, so waiting for it is pointless.
+	bool request(int id)
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+
+		auto& entry = *entries[id];
+		if (entry.state == page_state::failed)
+			return false;
+		if (entry.state != page_state::absent)
+			return true;
+
+		entry.state = page_state::queued;
+		queue.push_back(id);
+		requested.notify_one();
+		return true;
+	}
+
+	// Changes the memory limit (in bytes, 0 = no limit). Pages over a new lower limit are dropped at the next load.
+	void set_memory_limit(size_t limit)
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		memory_limit = limit;
+	}
+
+	// Pages read from disk so far
+	int loads() const { return load_count.load(); }
+	// Pages dropped to stay under the memory limit so far
+	int evictions() const { return eviction_count.load(); }
+	// Memory taken by the pages in the cache now
+	size_t resident_memory() const
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		return resident_bytes;
+	}
+
+private:
+	// A page whose loader threw or returned nothing is failed, and stays out of the render as a hole rather
+	// than being loaded again by every tile that reaches it
+	enum class page_state { absent, queued, loading, resident, failed };
+
+	class page_entry
+	{
+	public:
+		page_entry(loader load) : load(std::move(load)) {}
+
+		// The page's data, or null while it isn't in memory
+		shared_ptr<const pageable> get() const
+		{
+			std::lock_guard<std::mutex> lock(data_mutex);
+			return data;
+		}
+
+		void set(shared_ptr<const pageable> new_data)
+		{
+			std::lock_guard<std::mutex> lock(data_mutex);
+			data.swap(new_data);
+		}
+
+		loader load;
+		page_state state = page_state::absent;	// Guarded by cache_mutex
+		size_t memory_size = 0;					// Guarded by cache_mutex
+		std::atomic<unsigned> last_used{ 0 };	// use_clock when the page was last found
+
+	private:
+		// A mutex of its own rather than cache_mutex, so finds of different pages never wait for each other.
+		// It is only held to copy the pointer: set frees the page it replaces after unlocking.
+		mutable std::mutex data_mutex;
+		shared_ptr<const pageable> data;
+	};
+
+	// unique_ptrs so that entries don't move when more are added
+	std::vector<std::unique_ptr<page_entry>> entries;
+
+	mutable std::mutex cache_mutex;
+	std::condition_variable requested;		// Signalled when a page is queued or the cache is stopping
+	std::condition_variable loaded;			// Signalled when any page finishes loading
+	std::deque<int> queue;					// Pages waiting for an I/O thread, oldest first
+	std::vector<std::thread> io_threads;
+	std::atomic<int> load_count{ 0 };
+	std::atomic<int> eviction_count{ 0 };
+	std::atomic<unsigned> use_clock{ 0 };	// Goes up by one with every load
+	size_t memory_limit;					// Guarded by cache_mutex
+	size_t resident_bytes = 0;				// Guarded by cache_mutex
+	bool stopping = false;
+
+	// Loads page id on the calling thread, or waits for whichever thread is already loading it
+	shared_ptr<const pageable> load_now(int id)
+	{
+		auto& entry = *entries[id];
+
+		std::unique_lock<std::mutex> lock(cache_mutex);
+		while (true)
+		{
+			// It may have been dropped again between loading and this thread waking, so go round until it's caught
+			auto data = entry.get();
+			if (data || entry.state == page_state::failed)
+				return data;
+
+			if (entry.state == page_state::absent || entry.state == page_state::queued)
+			{
+				// Take it ourselves (an I/O thread will skip it if it is still in the queue)
+				entry.state = page_state::loading;
+				lock.unlock();
+				return load(entry);
+			}
+
+			loaded.wait(lock);
+		}
+	}
+
+	// Runs the page's loader, with cache_mutex not held. The page must be marked as loading. Returns null if
+	// the loader failed, either way waking the threads waiting for it.
+	shared_ptr<const pageable> load(page_entry& entry)
+	{
+		shared_ptr<const pageable> data;
+		try
+		{
+			data = entry.load();
+		}
+		catch (...)
+		{
+			// Such as bad_alloc from sizes read from a corrupt file: not worth stopping the render for
+		}
+
+		if (!data)
+		{
+			{
+				std::lock_guard<std::mutex> lock(cache_mutex);
+				entry.state = page_state::failed;
+			}
+			loaded.notify_all();
+			return nullptr;
+		}
+
+		entry.last_used.store(++use_clock);
+		entry.set(data);
+		load_count++;
+
+		{
+			std::lock_guard<std::mutex> lock(cache_mutex);
+			entry.state = page_state::resident;
+			entry.memory_size = data->memory_size;
+			resident_bytes += entry.memory_size;
+			evict_for(entry);
+		}
+		loaded.notify_all();
+
+		return data;
+	}
+
+	// Drops the least recently used pages (other than keep, which was just loaded) until the cache is back
+	// under its memory limit. Call with cache_mutex held.
+	void evict_for(const page_entry& keep)
+	{
+		while (memory_limit != 0 && resident_bytes > memory_limit)
+		{
+			page_entry* oldest = nullptr;
+			for (auto& entry : entries)
+				if (entry.get() != &keep && entry->state == page_state::resident
+					&& (!oldest || entry->last_used.load() < oldest->last_used.load()))
+					oldest = entry.get();
+
+			if (!oldest)
+				return;
+
+			oldest->set(nullptr);
+			oldest->state = page_state::absent;
+			resident_bytes -= oldest->memory_size;
+			eviction_count++;
+		}
+	}
+
+	void io_loop()
+	{
+		while (true)
+		{
+			page_entry* entry;
+			{
+				std::unique_lock<std::mutex> lock(cache_mutex);
+				requested.wait(lock, [&]() { return stopping || !queue.empty(); });
+				if (stopping)
+					return;
+
+				entry = entries[queue.front()].get();
+				queue.pop_front();
+
+				// A render thread in blocking mode may have loaded it already
+				if (entry->state != page_state::queued)
+					continue;
+				entry->state = page_state::loading;
+			}
+
+			load(*entry);
+		}
+	}
+};
+
+/// <summary>
+/// A part of the scene that is kept on disk until a ray comes near it.
+/// The bounding box is known up front, so rays that miss it never cause a load.
+/// </summary>
+class paged_hittable : public hittable
+{
+public:
+	/// <summary>
+	/// What a paged_hittable's page holds once loaded.
+	/// </summary>
+	class contents : public pageable
+	{
+	public:
+		// The objects' materials should be kept alive outside the page (hit records point at them)
+		shared_ptr<hittable> objects;
+	};
+
+	paged_hittable(page_cache& cache, int page, const aabb& box) : cache(cache), page(page), bbox(box) {}
+
+	// While the page isn't loaded this misses everything, and the page fault makes render_pass take
+	// the tile again later, so the miss never reaches the image. A page that failed to load stays a hole.
+	bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override
+	{
+		if (!bbox.hit(r, ray_tmin, ray_tmax))
+			return false;
+
+		auto data = cache.find(page);
+		if (!data)
+			return false;
+
+		return static_cast<const contents&>(*data).objects->hit(r, ray_tmin, ray_tmax, rec);
+	}
+
+	bool occluded(const ray& r, double ray_tmin, double ray_tmax) const override
+	{
+		if (!bbox.hit(r, ray_tmin, ray_tmax))
+			return false;
+
+		auto data = cache.find(page);
+		if (!data)
+			return false;
+
+		return static_cast<const contents&>(*data).objects->occluded(r, ray_tmin, ray_tmax);
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+private:
+	page_cache& cache;
+	int page;
+	aabb bbox;
+};
+
+#endif
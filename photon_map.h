@@ -0,0 +1,311 @@
+#pragma once
+
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "hittable.h"
+#include "lights.h"
+#include "material.h"
+#include "page_cache.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/// <summary>
+/// Light arriving at one point on a surface, carried there by a photon traced from a light. Stored as floats
+/// so that a photon fits in 40 bytes and a search touches as few cache lines as possible.
+/// </summary>
+class photon
+{
+public:
+	photon() = default;
+
+	// from is the unit direction the light arrived from
+	photon(const point3& p, const vec3& from, const color& power)
+		: position{ float(p.x()), float(p.y()), float(p.z()) }, from_direction{ float(from.x()), float(from.y()), float(from.z()) },
+		  flux{ float(power.x()), float(power.y()), float(power.z()) }
+	{
+	}
+
+	double coordinate(int axis) const { return position[axis]; }
+	point3 p() const { return point3(position[0], position[1], position[2]); }
+	vec3 from() const { return vec3(from_direction[0], from_direction[1], from_direction[2]); }
+	color power() const { return color(flux[0], flux[1], flux[2]); }
+
+	int split_axis = 0;				// Axis the kd-tree splits on at this photon
+
+private:
+	float position[3];
+	float from_direction[3];
+	float flux[3];
+};
+
+/// <summary>
+/// Photons stored in a kd-tree for finding the nearest ones to a point (Jensen 1996). The tree is implicit:
+/// the photons are ordered so that the middle one of any range splits the rest on its split_axis, with the
+/// lower half before it and the upper half after. There are no child pointers, and a search walks one flat
+/// array.
+///
+/// Building it sorts the top few levels on the calling thread until there are several subtrees for each
+/// thread of the pool, then the pool's threads build those subtrees.
+/// </summary>
+class photon_map
+{
+public:
+	photon_map() = default;
+
+	photon_map(std::vector<photon> stored, thread_pool& pool, int priority = 0)
+		: photons(std::move(stored))
+	{
+		// Split breadth first until there are about four subtrees per thread, so uneven ones balance out
+		std::vector<std::pair<int, int>> subtrees{ { 0, size() } };
+		while (pool.size() > 1 && int(subtrees.size()) < 4 * pool.size() && subtrees.front().second - subtrees.front().first > 1)
+		{
+			std::vector<std::pair<int, int>> halves;
+			for (auto [begin, end] : subtrees)
+			{
+				int middle = split(begin, end);
+				halves.emplace_back(begin, middle);
+				halves.emplace_back(middle + 1, end);
+			}
+			subtrees.swap(halves);
+		}
+
+		std::atomic<int> next_subtree(0);
+		pool.run([&](int, int)
+		{
+			for (int i = next_subtree++; i < int(subtrees.size()); i = next_subtree++)
+				build(subtrees[i].first, subtrees[i].second);
+		}, priority);
+	}
+
+	int size() const { return int(photons.size()); }
+	bool empty() const { return photons.empty(); }
+	const photon& operator[](int i) const { return photons[i]; }
+
+	// Fills found with the indices of up to count photons nearest p, no further away than max_radius, nearest first
+	void nearest(const point3& p, int count, double max_radius, std::vector<int>& found) const
+	{
+		std::vector<neighbour> nearest;
+		double radius_squared = max_radius * max_radius;
+		find_nearest(p, count, radius_squared, nearest);
+		std::sort_heap(nearest.begin(), nearest.end());
+
+		found.clear();
+		for (const auto& near : nearest)
+			found.push_back(near.index);
+	}
+
+	// Light the photons near rec bring to the surface there and scatter back along r_in: the scattering of the
+	// nearest neighbours photons, over the area of the disk that holds them (density estimation). Looks no
+	// further than max_radius.
+	color radiance(const ray& r_in, const hit_record& rec, int neighbours, double max_radius) const
+	{
+		thread_local std::vector<neighbour> nearest;
+		double radius_squared = max_radius * max_radius;
+		find_nearest(rec.p, neighbours, radius_squared, nearest);
+		if (nearest.empty())
+			return color(0, 0, 0);
+
+		// Fewer than neighbours photons within max_radius: they were spread over the whole disk
+		if (int(nearest.size()) < neighbours)
+			radius_squared = max_radius * max_radius;
+
+		color sum(0, 0, 0);
+		for (const auto& found : nearest)
+		{
+			const auto& near = photons[found.index];
+			auto from = near.from();
+			double cos_theta = dot(rec.normal, from);
+			if (cos_theta > 0)
+				sum += (near.power() / cos_theta) * rec.mat->scattering(r_in, rec, from);
+		}
+
+		return sum / (pi * radius_squared);
+	}
+
+private:
+	/// <summary>
+	/// A photon found by a search, and its squared distance. Ordered by distance, so the nearest ones so far
+	/// can be kept in a heap with the furthest on top.
+	/// </summary>
+	class neighbour
+	{
+	public:
+		double distance_squared;
+		int index;
+
+		bool operator<(const neighbour& other) const { return distance_squared < other.distance_squared; }
+	};
+
+	std::vector<photon> photons;
+
+	// Puts the median photon of [begin, end), along the axis that range is widest on, in the middle, with
+	// every photon below it before it and every one above after. Returns the middle.
+	int split(int begin, int end)
+	{
+		int middle = begin + (end - begin) / 2;
+		if (end - begin < 2)
+			return middle;
+
+		point3 low = photons[begin].p(), high = low;
+		for (int i = begin + 1; i < end; i++)
+		{
+			auto p = photons[i].p();
+			for (int axis = 0; axis < 3; axis++)
+			{
+				low[axis] = std::fmin(low[axis], p[axis]);
+				high[axis] = std::fmax(high[axis], p[axis]);
+			}
+		}
+
+		auto extent = high - low;
+		int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+		std::nth_element(photons.begin() + begin, photons.begin() + middle, photons.begin() + end,
+						 [axis](const photon& a, const photon& b) { return a.coordinate(axis) < b.coordinate(axis); });
+		photons[middle].split_axis = axis;
+		return middle;
+	}
+
+	void build(int begin, int end)
+	{
+		while (end - begin > 1)
+		{
+			int middle = split(begin, end);
+			build(begin, middle);
+			begin = middle + 1;
+		}
+	}
+
+	// Fills nearest with up to count photons within sqrt(radius_squared) of p, shrinking radius_squared to the
+	// furthest of them once count have been found
+	void find_nearest(const point3& p, int count, double& radius_squared, std::vector<neighbour>& nearest) const
+	{
+		nearest.clear();
+		search(0, size(), p, count, radius_squared, nearest);
+	}
+
+	void search(int begin, int end, const point3& p, int count, double& radius_squared, std::vector<neighbour>& nearest) const
+	{
+		while (begin < end)
+		{
+			int middle = begin + (end - begin) / 2;
+			const auto& node = photons[middle];
+			int axis = node.split_axis;
+			double offset = p[axis] - node.coordinate(axis);
+
+			// The side p is on first, as it holds the nearest photons, then the other side if it's close enough
+			if (offset < 0)
+				search(begin, middle, p, count, radius_squared, nearest);
+			else
+				search(middle + 1, end, p, count, radius_squared, nearest);
+
+			double distance_squared = (node.p() - p).length_squared();
+			if (distance_squared < radius_squared)
+			{
+				if (int(nearest.size()) == count)
+				{
+					std::pop_heap(nearest.begin(), nearest.end());
+					nearest.pop_back();
+				}
+				nearest.push_back(neighbour{ distance_squared, middle });
+				std::push_heap(nearest.begin(), nearest.end());
+
+				if (int(nearest.size()) == count)
+					radius_squared = nearest.front().distance_squared;
+			}
+
+			if (offset * offset >= radius_squared)
+				return;
+
+			if (offset < 0)
+				begin = middle + 1;
+			else
+				end = middle;
+		}
+	}
+};
+
+// Traces count photons from lights, picked in proportion to their power, and keeps those that reach a matte
+// surface having only passed through glass or bounced off mirrors on the way: the light that focuses into
+// caustics. Photons stop at the first matte surface, so light that has bounced off one isn't kept.
+// Traced on every thread of pool, and each path is at most max_depth bounces long.
+inline photon_map trace_caustic_photons(const hittable& world, const light_set& lights, int count, int max_depth,
+										thread_pool& pool, int priority = 0)
+{
+	std::vector<photon> stored;
+	if (lights.empty() || count <= 0)
+		return photon_map(std::move(stored), pool, priority);
+
+	std::mutex stored_mutex;
+	std::atomic<int> next_batch(0);
+	const int batch_size = 4096;
+
+	pool.run([&](int, int)
+	{
+		// Photons are traced before any tile, so there is nothing to put aside while geometry is read: wait for it
+		auto& faults = page_faults::current();
+		faults.blocking = true;
+
+		std::vector<photon> found;
+		for (int first = next_batch++ * batch_size; first < count; first = next_batch++ * batch_size)
+		{
+			for (int i = first; i < std::min(first + batch_size, count); i++)
+			{
+				// A photon carries an equal share of the light leaving a point picked on a light
+				int light = lights.pick(random_double());
+				vec3 normal;
+				point3 start = lights.sample_point(light, random_double(), random_double(), normal);
+				color power = lights[light].emit * (pi * lights[light].area() / (lights.probability(light) * count));
+
+				// Leaves in a cosine distribution about the normal, as light is emitted
+				auto direction = normal + random_unit_vector();
+				if (direction.near_zero())
+					direction = normal;
+
+				ray r(start, direction);
+				bool focused = false;
+				for (int bounce = 0; bounce < max_depth; bounce++)
+				{
+					hit_record rec;
+					if (!world.hit(r, 0.001, infinity, rec))
+						break;
+
+					ray scattered;
+					color attenuation;
+					if (!rec.mat->scatter(r, rec, attenuation, scattered))
+						break;
+
+					// A surface that scatters with a density is matte: keep the photon if glass or a mirror sent it here
+					if (rec.mat->scattering_pdf(r, rec, unit_vector(scattered.direction())) > 0)
+					{
+						if (focused && !rec.normal.near_zero())
+							found.emplace_back(rec.p, -unit_vector(r.direction()), power);
+						break;
+					}
+
+					focused = true;
+					power = power * attenuation;
+					r = scattered;
+					if (power.near_zero())
+						break;
+				}
+			}
+		}
+		faults.blocking = false;
+
+		std::lock_guard<std::mutex> lock(stored_mutex);
+		stored.insert(stored.end(), found.begin(), found.end());
+	}, priority);
+
+	return photon_map(std::move(stored), pool, priority);
+}
+
+#endif
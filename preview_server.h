@@ -0,0 +1,244 @@
+#pragma once
+
+#ifndef PREVIEW_SERVER_H
+#define PREVIEW_SERVER_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "film.h"
+#include "local_socket.h"
+#include "render_task.h"
+#include "scene.h"
+#include "thread_pool.h"
+#include "watch.h"
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Renders previews for an interactive viewer (an editor, say) over a local TCP connection.
+/// The scene, its BVH and the render threads are kept between renders, so moving the camera or editing the
+/// scene starts a new preview straight away instead of paying for a fresh process and a scene load each time.
+/// Tiles are sent as soon as they are finished, and each pass refines the whole image, so the viewer sees a
+/// rough image almost at once that sharpens as samples accumulate.
+///
+/// The protocol is lines of text, some followed by raw bytes. From the viewer:
+///
+///		camera ... / image ... / render ... / filter ... / background ...
+///								the same statements as a scene file; change the view and restart the preview
+///		scene <byte count>		followed by that many bytes of scene file text, replacing the whole scene
+///								(at most max_scene_size)
+///		quit					closes the connection (the server then waits for the next viewer)
+///		shutdown				stops the server
+///
+/// From the server:
+///
+///		frame <id> <width> <height>									a new preview has started
+///		tile <frame id> <samples> <x0> <y0> <x1> <y1>				followed by (x1-x0)*(y1-y0)*3 bytes of 8 bit RGB,
+///																	rows top to bottom, with samples per pixel so far
+///		done <frame id>												all the samples have been taken
+///		error <message>												a command was rejected; the preview carries on
+///
+/// Only one viewer is served at a time, and only connections from this machine are accepted.
+/// </summary>
+class preview_server
+{
+public:
+	preview_server(int port) : listener(port) {}
+
+	// Loads the starting scene. Throws scene_error if it isn't valid.
+	void load(std::string_view scene_text)
+	{
+		live.update(scene_text);
+	}
+
+	// Serves viewers one after another until one of them sends shutdown
+	void run()
+	{
+		const auto& cam = live.scene_camera();
+		// Threads are created once and kept for every preview
+		thread_pool pool(cam.thread_count, cam.pin_threads);
+
+		std::clog << "Waiting for a viewer...\n";
+
+		bool serving = true;
+		while (serving)
+		{
+			socket_connection viewer = listener.accept();
+			std::clog << "Viewer connected\n";
+
+			try
+			{
+				serving = serve(viewer, pool);
+			}
+			catch (const socket_error& error)
+			{
+				std::clog << "Viewer lost: " << error.what() << '\n';
+			}
+		}
+	}
+
+private:
+	static constexpr double max_scene_size = 256.0 * 1024 * 1024;		// Bytes a viewer may send as a scene
+
+	socket_listener listener;
+	live_scene live;
+	int frame_id = 0;
+
+	// Renders for one viewer until it leaves. Returns false if it asked the server to shut down.
+	bool serve(socket_connection& viewer, thread_pool& pool)
+	{
+		std::mutex send_mutex;
+		std::atomic<bool> lost{ false };
+
+		while (true)
+		{
+			camera cam = live.scene_camera();
+			cam.initialize();
+			// film can't be moved or copied, so each preview gets a new one
+			std::unique_ptr<film> image(new film(cam.make_film()));
+
+			int frame = ++frame_id;
+			viewer.send_all("frame " + std::to_string(frame) + ' ' + std::to_string(image->width()) + ' '
+				+ std::to_string(image->height()) + '\n');
+
+			int samples = 0;
+
+			// The pass being rendered. Previews are interactive, so they take workers from any other render
+			// sharing the pool, and a pass is cancelled as soon as the viewer sends anything, as it's likely a
+			// change that makes the rest of the pass stale.
+			std::unique_ptr<render_task> pass;
+
+			// Called on the worker threads. A failed send can't be thrown out of a worker, so it is remembered
+			// and the rest of the pass just isn't sent.
+			std::vector<unsigned char> bytes;
+			auto send_tile = [&](const film_tile& tile)
+			{
+				std::lock_guard<std::mutex> lock(send_mutex);
+				if (lost || pass->is_cancelled())
+					return;
+
+				image->tile_rgb(tile.x0, tile.y0, tile.x1, tile.y1, bytes);
+				try
+				{
+					viewer.send_all("tile " + std::to_string(frame) + ' ' + std::to_string(samples + 1) + ' '
+						+ std::to_string(tile.x0) + ' ' + std::to_string(tile.y0) + ' '
+						+ std::to_string(tile.x1) + ' ' + std::to_string(tile.y1) + '\n');
+					viewer.send_all(bytes.data(), bytes.size());
+				}
+				catch (const socket_error&)
+				{
+					lost = true;
+				}
+
+				// The main thread is waiting in render_pass, so it's safe to look at the connection here
+				if (!lost && viewer.can_read(0))
+					pass->cancel();
+			};
+
+			bool restart = false;
+			bool uneven = false;	// A cancelled pass gave only some pixels their extra sample
+			while (!restart)
+			{
+				// Commands are checked between passes; once the preview is finished, just wait for the next one.
+				// Everything waiting is applied before restarting, so a burst of changes starts one preview, not several.
+				bool finished = samples >= cam.samples_per_pixel;
+				while (viewer.can_read(finished && !restart ? 100 : 0))
+				{
+					auto command = viewer.read_line();
+					if (command == "quit")
+						return true;
+					if (command == "shutdown")
+						return false;
+
+					if (apply(command, viewer))
+						restart = true;
+				}
+
+				if (uneven)
+					restart = true;
+				if (restart || finished)
+					continue;
+
+				// One sample per pixel per pass keeps the time between checks for commands short
+				pass.reset(new render_task(priority_interactive));
+				bool completed = cam.render_pass(live.world(), *image, pool, 1, false, send_tile, pass.get());
+
+				if (lost)
+					throw socket_error("connection closed while sending");
+
+				// Cancelled because a command arrived: read it first, then start again on a fresh film
+				if (!completed)
+				{
+					uneven = true;
+					continue;
+				}
+				samples++;
+
+				if (samples == cam.samples_per_pixel)
+					viewer.send_all("done " + std::to_string(frame) + '\n');
+			}
+		}
+	}
+
+	// Applies one command from the viewer. Returns true if the preview needs to start again.
+	// A bad command is reported back to the viewer and changes nothing.
+	bool apply(const std::string& command, socket_connection& viewer)
+	{
+		try
+		{
+			scene_tokenizer tokens(command);
+			if (!tokens.next_line())
+				return false;
+
+			auto keyword = tokens.word();
+			if (keyword == "scene")
+			{
+				// Checked before anything is read, so a viewer can't make the server hold any amount of memory
+				auto size = tokens.number();
+				if (!(size >= 0 && size == std::floor(size)))
+					throw scene_error("scene size must be a whole number of bytes");
+				if (size > max_scene_size)
+					throw scene_error("scene too large (at most " + std::to_string(size_t(max_scene_size)) + " bytes)");
+
+				auto text = viewer.read_bytes(size_t(size));
+				live.update(text);
+				return true;
+			}
+
+			// Edit a copy, so a setting that fails half way through the line leaves the camera as it was
+			camera cam = live.scene_camera();
+			if (!parse_camera_statement(keyword, tokens, cam))
+				throw scene_error("unknown command '" + std::string(keyword) + "'");
+			if (!tokens.at_line_end())
+				throw scene_error("unexpected '" + std::string(tokens.word()) + "' at end of command");
+
+			live.scene_camera() = cam;
+			return true;
+		}
+		catch (const scene_error& error)
+		{
+			viewer.send_all("error " + std::string(error.what()) + '\n');
+			return false;
+		}
+	}
+};
+
+// Serves previews on port, starting from the scene in scene_path (or an empty scene if there isn't one),
+// until a viewer sends shutdown. Throws scene_error if the scene can't be loaded, or socket_error if the port
+// can't be used.
+inline void serve_previews(int port, const std::string& scene_path)
+{
+	preview_server server(port);
+	server.load(scene_path.empty() ? std::string() : read_text_file(scene_path));
+
+	std::clog << "Serving previews on 127.0.0.1:" << port << '\n';
+	server.run();
+}
+
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+
+#ifndef RAY_H
+#define RAY_H
+
+#include "vec3.h"
+
+/// <summary>
+/// A ray is a function P(t) = A + tb, where A is the origin and b is the direction.
+/// </summary>
+class ray
+{
+public:
+	// Default constructor
+	ray() {}
+	// Constructor
+	ray(const point3& origin, const vec3& direction)
+		: orig(origin), dir(direction), inv_dir(1.0 / direction[0], 1.0 / direction[1], 1.0 / direction[2])
+	{
+	}
+
+	// Return the origin and direction respectively
+	const point3& origin() const { return orig; }
+	const vec3& direction() const { return dir; }
+	// 1 / direction for each component, worked out once per ray because every bounding box test needs it.
+	// A zero component gives infinity, which the box test handles.
+	const vec3& inverse_direction() const { return inv_dir; }
+
+	// Returns the point along the ray at distance t.
+	// t > 0 is in front of the origin, t < 0 is behind it.
+	point3 at(double t) const
+	{
+		return orig + t * dir;
+	}
+
+private:
+	point3 orig;
+	vec3 dir;
+	vec3 inv_dir;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#pragma once
+
+#ifndef RENDER_TASK_H
+#define RENDER_TASK_H
+
+#include <atomic>
+
+// How urgently a render is wanted. Renders sharing a thread_pool get its workers in this order,
+// and a more urgent one takes workers from a less urgent one at the next tile rather than waiting for it to finish.
+enum render_priority
+{
+	priority_background = 0,	// Batch jobs and other work nobody is waiting on
+	priority_final = 1,			// A finished image someone has asked for
+	priority_interactive = 2	// Previews that someone is watching
+};
+
+/// <summary>
+/// Lets a render be stopped part way through, from any thread, and says how urgent it is.
+/// Cancelling is cooperative: the render checks between tiles, so it stops once the tiles already
+/// started are done, leaving the film with whatever has been rendered so far.
+/// </summary>
+class render_task
+{
+public:
+	render_task(render_priority priority = priority_background) : priority(priority) {}
+
+	render_task(const render_task&) = delete;
+	render_task& operator=(const render_task&) = delete;
+
+	void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+	bool is_cancelled() const { return cancelled.load(std::memory_order_relaxed); }
+
+	render_priority priority;
+
+private:
+	std::atomic<bool> cancelled{ false };
+};
+
+#endif
@@ -0,0 +1,173 @@
+#pragma once
+
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "color.h"
+#include "film.h"
+#include "hittable_list.h"
+#include "render_task.h"
+#include "scene.h"
+#include "thread_pool.h"
+
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// <summary>
+/// A scene ready to render: its objects are already wrapped in a BVH.
+/// </summary>
+class loaded_scene
+{
+public:
+	camera cam;				// The camera as the scene describes it
+	hittable_list world;
+};
+
+// Builds the BVH for a scene's objects. Done once per scene, however many images are rendered from it.
+inline loaded_scene prepare_scene(const scene& source)
+{
+	loaded_scene ready;
+	ready.cam = source.cam;
+	if (!source.objects.objects.empty())
+		ready.world.add(make_shared<bvh>(source.objects));
+
+	return ready;
+}
+
+/// <summary>
+/// Scenes loaded so far, by path. Each file is read, parsed and has its BVH built only the first time it is
+/// asked for, however many images are rendered from it.
+/// </summary>
+class scene_cache
+{
+public:
+	// Returns the scene in path, loading it if it hasn't been already. Throws scene_error if it can't be loaded.
+	const loaded_scene& get(const std::string& path)
+	{
+		auto found = scenes.find(path);
+		if (found != scenes.end())
+			return found->second;
+
+		return scenes.emplace(path, prepare_scene(load_scene(path))).first->second;
+	}
+
+	// Forgets the scene in path (if it was loaded), so the next get reads the file again
+	void forget(const std::string& path) { scenes.erase(path); }
+
+	size_t size() const { return scenes.size(); }
+
+private:
+	std::unordered_map<std::string, loaded_scene> scenes;
+};
+
+/// <summary>
+/// A finished image: the final linear colour of every pixel, row by row from the top.
+/// Reusing one framebuffer for image after image only allocates when the size changes.
+/// </summary>
+class framebuffer
+{
+public:
+	int width = 0;
+	int height = 0;
+	std::vector<color> pixels;
+
+	const color& at(int i, int j) const { return pixels[size_t(j) * width + i]; }
+
+	// Writes the image to the out stream as a PPM file
+	void write_ppm(std::ostream& out) const
+	{
+		out << "P3\n" << width << ' ' << height << "\n255\n";
+
+		for (const auto& pixel : pixels)
+			write_color(out, pixel);
+	}
+};
+
+/// <summary>
+/// Renders images for a program that embeds the ray tracer (a service, say), rather than running it once per image.
+/// Keeps what is expensive to set up between renders: the render threads, and every scene loaded through
+/// load_scene_file with its BVH. Several threads can render with one renderer at once: the renders share
+/// the render threads by priority (see render_task), so an interactive request isn't stuck behind a batch.
+/// </summary>
+class renderer
+{
+public:
+	// The render threads are created by the first render, using that camera's thread_count and pin_threads
+	renderer() {}
+
+	renderer(const renderer&) = delete;
+	renderer& operator=(const renderer&) = delete;
+
+	// Returns the scene in path, loading it the first time. Throws scene_error if it can't be loaded.
+	const loaded_scene& load_scene_file(const std::string& path)
+	{
+		std::lock_guard<std::mutex> lock(renderer_mutex);
+		return scenes.get(path);
+	}
+
+	// Forgets a scene loaded with load_scene_file, e.g. because its file has changed.
+	// Nothing may still be rendering it.
+	void forget_scene_file(const std::string& path)
+	{
+		std::lock_guard<std::mutex> lock(renderer_mutex);
+		scenes.forget(path);
+	}
+
+	// Renders source as seen through settings (which can be source.cam or any other camera) into image.
+	// settings gives the view, the image size and sampling; image is resized to match.
+	// If given, tile_done is called (on a render thread) with each tile of the film as it is finished.
+	// If task is given, the render runs at its priority and can be cancelled through it. A cancelled render
+	// returns false, leaving image holding the tiles that were finished.
+	bool render(const loaded_scene& source, const camera& settings, framebuffer& image, bool show_progress = false,
+				const std::function<void(const film_tile&)>& tile_done = nullptr, const render_task* task = nullptr)
+	{
+		camera cam = settings;
+		cam.initialize();
+
+		film result = cam.make_film();
+		bool completed = cam.render_pass(source.world, result, threads(cam), cam.samples_per_pixel, show_progress,
+										 tile_done, task);
+
+		image.width = result.width();
+		image.height = result.height();
+		image.pixels.resize(size_t(image.width) * image.height);
+		for (int j = 0; j < image.height; j++)
+			for (int i = 0; i < image.width; i++)
+				image.pixels[size_t(j) * image.width + i] = result.pixel_color(i, j);
+
+		return completed;
+	}
+
+	// Renders source through its own camera
+	bool render(const loaded_scene& source, framebuffer& image, bool show_progress = false, const render_task* task = nullptr)
+	{
+		return render(source, source.cam, image, show_progress, nullptr, task);
+	}
+
+	// The render threads, created with settings' thread options if there aren't any yet.
+	// For callers that drive camera::render_pass themselves, e.g. to render progressively.
+	thread_pool& threads(const camera& settings)
+	{
+		std::lock_guard<std::mutex> lock(renderer_mutex);
+		if (!pool)
+			pool.reset(new thread_pool(settings.thread_count, settings.pin_threads));
+
+		return *pool;
+	}
+
+private:
+	std::mutex renderer_mutex;		// Guards scenes and creating pool
+	scene_cache scenes;
+	std::unique_ptr<thread_pool> pool;
+};
+
+#endif
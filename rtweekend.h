@@ -0,0 +1,124 @@
+#pragma once
+
+#ifndef RTWEEKEND_H
+#define RTWEEKEND_H
+
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <random>
+
+
+// Usings
+
+using std::shared_ptr;
+using std::make_shared;
+using std::sqrt;
+
+
+// Constants
+
+const double infinity = std::numeric_limits<double>::infinity();
+const double pi = 3.1415926535897932385;
+
+
+// Utility Functions
+
+// Converts an angle in degrees (nicer for camera settings) to radians (what std::sin etc. expect)
+inline double degrees_to_radians(double degrees)
+{
+	return degrees * pi / 180.0;
+}
+
+/// <summary>
+/// Somewhere other than its generator for random_double to take numbers from, on one thread. Metropolis light
+/// transport (see metropolis.h) uses this to trace paths with numbers it has picked.
+/// </summary>
+class random_source
+{
+public:
+	virtual ~random_source() = default;
+	virtual double next() = 0;
+};
+
+// Where random_double takes its numbers from on this thread, or null for its own generator.
+// Set by random_source_scope.
+inline random_source*& thread_random_source()
+{
+	thread_local random_source* source = nullptr;
+	return source;
+}
+
+// How many random_source_scopes are open, on any thread. While there are none, random_double doesn't look
+// for a source, so renders that never set one don't pay for the thread_local lookup.
+inline std::atomic<int>& open_random_source_scopes()
+{
+	static std::atomic<int> count{ 0 };
+	return count;
+}
+
+/// <summary>
+/// Makes random_double take its numbers from source on this thread for as long as it exists, then puts back
+/// whatever it took them from before.
+/// </summary>
+class random_source_scope
+{
+public:
+	explicit random_source_scope(random_source& source)
+		: previous(thread_random_source())
+	{
+		open_random_source_scopes()++;
+		thread_random_source() = &source;
+	}
+
+	~random_source_scope()
+	{
+		thread_random_source() = previous;
+		open_random_source_scopes()--;
+	}
+
+	random_source_scope(const random_source_scope&) = delete;
+	random_source_scope& operator=(const random_source_scope&) = delete;
+
+private:
+	random_source* previous;
+};
+
+// Returns a random real in [0,1).
+// The generator is thread_local so that each render thread gets its own stream
+// and never has to lock (or share a cache line) to draw a number.
+inline double random_double()
+{
+	if (open_random_source_scopes().load(std::memory_order_relaxed) != 0)
+	{
+		if (auto source = thread_random_source())
+			return source->next();
+	}
+
+	thread_local std::mt19937 generator(std::random_device{}());
+	thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+	return distribution(generator);
+}
+
+// Returns a random real in [min,max).
+inline double random_double(double min, double max)
+{
+	return min + (max - min) * random_double();
+}
+
+// Clamps x to the range [min,max]
+inline double clamp(double x, double min, double max)
+{
+	if (x < min) return min;
+	if (x > max) return max;
+	return x;
+}
+
+
+// Common Headers
+
+#include "ray.h"
+#include "vec3.h"
+
+#endif
@@ -0,0 +1,135 @@
+#pragma once
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rtweekend.h"
+
+#include <utility>
+#include <vector>
+
+// Returns a random vector of unit length, i.e. a random point on the surface of the unit sphere.
+inline vec3 random_unit_vector()
+{
+	// Rejection sampling: keep picking points in the cube until one lands inside the sphere.
+	// The lower bound stops a tiny vector blowing up to infinity when normalised.
+	while (true)
+	{
+		auto p = vec3(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1));
+		auto lensq = p.length_squared();
+		if (1e-160 < lensq && lensq <= 1)
+			return p / std::sqrt(lensq);
+	}
+}
+
+// Maps a point (u, v) in the unit square onto the unit disk.
+// Uses the concentric mapping (Shirley & Chiu) rather than sqrt/angle, because it keeps
+// neighbouring strata next to each other, so stratified square samples stay stratified on the lens.
+inline vec3 square_to_disk(double u, double v)
+{
+	// move from [0,1) to [-1,1)
+	auto a = 2 * u - 1;
+	auto b = 2 * v - 1;
+
+	if (a == 0 && b == 0)
+		return vec3(0, 0, 0);
+
+	double r, theta;
+	if (std::fabs(a) > std::fabs(b))
+	{
+		r = a;
+		theta = (pi / 4) * (b / a);
+	}
+	else
+	{
+		r = b;
+		theta = (pi / 2) - (pi / 4) * (a / b);
+	}
+
+	return vec3(r * std::cos(theta), r * std::sin(theta), 0);
+}
+
+// Weight for a sample taken with density pdf when another technique could have taken it with density
+// other_pdf (multiple importance sampling, Veach's power heuristic). The weights of the two add up to 1.
+inline double power_heuristic(double pdf, double other_pdf)
+{
+	double a = pdf * pdf;
+	double b = other_pdf * other_pdf;
+	return a + b > 0 ? a / (a + b) : 0;
+}
+
+/// <summary>
+/// Generates the jittered sub-pixel and lens positions for each sample of a pixel.
+/// The pixel is split into an n x n grid of strata and each sample is placed randomly inside its own stratum,
+/// which gives far less noise than purely random positions for the same sample count.
+/// One sampler is used per render thread as it holds per-pixel state.
+/// </summary>
+class sampler
+{
+public:
+	// The requested count is rounded down to a square number so the strata form a grid.
+	sampler(int samples_per_pixel)
+	{
+		sqrt_spp = int(std::sqrt(samples_per_pixel));
+		if (sqrt_spp < 1)
+			sqrt_spp = 1;
+		recip_sqrt_spp = 1.0 / sqrt_spp;
+
+		lens_strata.resize(sqrt_spp * sqrt_spp);
+		for (int s = 0; s < int(lens_strata.size()); s++)
+			lens_strata[s] = s;
+		wavelength_strata = lens_strata;
+	}
+
+	// Number of samples that will actually be taken per pixel
+	int samples_per_pixel() const { return sqrt_spp * sqrt_spp; }
+
+	// Call once at the start of each pixel.
+	// Shuffles which lens stratum is paired with which pixel stratum. Without this, sample s would
+	// always pair the top-left of the pixel with the top-left of the lens, which shows up as bias in the blur.
+	void start_pixel()
+	{
+		for (int i = int(lens_strata.size()) - 1; i > 0; i--)
+		{
+			int j = int(random_double() * (i + 1));
+			std::swap(lens_strata[i], lens_strata[j]);
+			j = int(random_double() * (i + 1));
+			std::swap(wavelength_strata[i], wavelength_strata[j]);
+		}
+	}
+
+	// Returns the jittered offset of sample s from the pixel centre, in [-0.5, 0.5) for x and y.
+	vec3 pixel_offset(int s) const
+	{
+		int sx = s % sqrt_spp;
+		int sy = s / sqrt_spp;
+		return vec3(((sx + random_double()) * recip_sqrt_spp) - 0.5,
+					((sy + random_double()) * recip_sqrt_spp) - 0.5,
+					0);
+	}
+
+	// Returns a jittered point on the unit disk for sample s, used to pick where on the lens the ray starts.
+	vec3 lens_sample(int s) const
+	{
+		int stratum = lens_strata[s];
+		int sx = stratum % sqrt_spp;
+		int sy = stratum / sqrt_spp;
+		return square_to_disk((sx + random_double()) * recip_sqrt_spp,
+							  (sy + random_double()) * recip_sqrt_spp);
+	}
+
+	// Returns a jittered number in [0, 1) for sample s, which picks the hero wavelength in spectral mode.
+	// Stratified like the other dimensions, so each pixel's samples spread across the spectrum.
+	double wavelength_sample(int s) const
+	{
+		return (wavelength_strata[s] + random_double()) / double(wavelength_strata.size());
+	}
+
+private:
+	int sqrt_spp;					// Square root of the number of samples per pixel
+	double recip_sqrt_spp;			// 1 / sqrt_spp, the width of a stratum
+	std::vector<int> lens_strata;	// Lens stratum used by each pixel sample
+	std::vector<int> wavelength_strata;	// Wavelength stratum used by each pixel sample
+};
+
+#endif
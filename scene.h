@@ -0,0 +1,615 @@
+#pragma once
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "cluster_file.h"
+#include "color.h"
+#include "compressed_mesh.h"
+#include "curves.h"
+#include "environment.h"
+#include "filter.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "scene_tokenizer.h"
+#include "sphere.h"
+#include "subdivision.h"
+#include "volume.h"
+
+#include <functional>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+/// <summary>
+/// The objects made by the last parse, keyed by the text that described them (the object's line
+/// plus its material's line). Passing the same cache to the next parse reuses every object whose
+/// description hasn't changed instead of parsing and creating it again, so after an edit only the
+/// edited objects are new - which is what lets the BVH be updated rather than rebuilt. Meshes, subdivision
+/// surfaces, hair and clouds are reused the same way, which also saves reading and building them again, as
+/// are environment maps. A file they read is only read again if its line changes.
+/// </summary>
+class scene_object_cache
+{
+public:
+	std::unordered_map<std::string, shared_ptr<hittable>> objects;
+	std::unordered_map<std::string, shared_ptr<environment_map>> environments;
+};
+
+/// <summary>
+/// Everything needed to render an image: the camera (with its image settings) and the objects.
+/// The objects are a flat list; wrap them in a bvh before rendering.
+/// </summary>
+class scene
+{
+public:
+	camera cam;
+	hittable_list objects;
+};
+
+// Applies a camera, image, render, filter or background statement (see parse_scene) to cam.
+// keyword has already been read. Returns false, reading nothing, if keyword is none of these.
+// Shared by the scene parser and anything else that edits a camera with the same syntax.
+inline bool parse_camera_statement(std::string_view keyword, scene_tokenizer& tokens, camera& cam)
+{
+	// Reads a count that must be at least minimum (0 or 1), and small enough to be an int
+	auto count = [&](const char* name, int minimum)
+	{
+		double value = tokens.number();
+		if (!(value >= minimum))
+			throw scene_error(tokens.line(), std::string(name) + (minimum > 0 ? " must be positive" : " can't be negative"));
+		if (value > std::numeric_limits<int>::max())
+			throw scene_error(tokens.line(), std::string(name) + " is too large");
+		return int(value);
+	};
+
+	if (keyword == "camera")
+	{
+		while (!tokens.at_line_end())
+		{
+			auto setting = tokens.word();
+			if (setting == "lookfrom")				cam.lookfrom = tokens.vector();
+			else if (setting == "lookat")			cam.lookat = tokens.vector();
+			else if (setting == "vup")				cam.vup = tokens.vector();
+			else if (setting == "vfov")				cam.vfov = tokens.number();
+			else if (setting == "defocus_angle")	cam.defocus_angle = tokens.number();
+			else if (setting == "focus_dist")		cam.focus_dist = tokens.number();
+			else
+				throw scene_error(tokens.line(), "unknown camera setting '" + std::string(setting) + "'");
+		}
+	}
+	else if (keyword == "image")
+	{
+		while (!tokens.at_line_end())
+		{
+			auto setting = tokens.word();
+			if (setting == "width")					cam.image_width = count("image width", 1);
+			else if (setting == "aspect")
+			{
+				cam.aspect_ratio = tokens.number();
+				if (!(cam.aspect_ratio > 0))
+					throw scene_error(tokens.line(), "image aspect must be positive");
+			}
+			else if (setting == "samples")			cam.samples_per_pixel = count("image samples", 1);
+			else if (setting == "depth")			cam.max_depth = count("image depth", 1);
+			else
+				throw scene_error(tokens.line(), "unknown image setting '" + std::string(setting) + "'");
+		}
+	}
+	else if (keyword == "render")
+	{
+		while (!tokens.at_line_end())
+		{
+			auto setting = tokens.word();
+			if (setting == "threads")				cam.thread_count = count("render threads", 0);
+			else if (setting == "tile")				cam.tile_size = count("render tile", 1);
+			else if (setting == "pin")				cam.pin_threads = tokens.number() != 0;
+			else if (setting == "spectral")			cam.spectral = tokens.number() != 0;
+			else if (setting == "sample_environment")	cam.sample_environment = tokens.number() != 0;
+			// Only sphere statements are added to the lights light paths start from (see light_set)
+			else if (setting == "bidirectional")	cam.bidirectional = tokens.number() != 0;
+			else if (setting == "caustics")			cam.caustic_photons = int(tokens.number());
+			else if (setting == "caustic_neighbours")	cam.caustic_neighbours = int(tokens.number());
+			else if (setting == "caustic_radius")	cam.caustic_radius = tokens.number();
+			else if (setting == "irradiance_cache")	cam.irradiance_accuracy = tokens.number();
+			else if (setting == "irradiance_rays")	cam.irradiance_rays = int(tokens.number());
+			else if (setting == "guided")			cam.guided = tokens.number() != 0;
+			else if (setting == "guide_memory")
+			{
+				cam.guide_memory = int(tokens.number());
+				if (cam.guide_memory < 0)
+					throw scene_error(tokens.line(), "guide memory limit can't be negative");
+			}
+			else if (setting == "metropolis")		cam.metropolis = tokens.number() != 0;
+			else if (setting == "metropolis_chains")	cam.metropolis_chains = int(tokens.number());
+			else
+				throw scene_error(tokens.line(), "unknown render setting '" + std::string(setting) + "'");
+		}
+	}
+	else if (keyword == "filter")
+	{
+		auto type = tokens.word();
+		bool has_radius = !tokens.at_line_end();
+		double radius = has_radius ? tokens.number() : 0;
+
+		if (type == "box")
+			cam.pixel_filter = has_radius ? make_shared<box_filter>(radius) : make_shared<box_filter>();
+		else if (type == "tent")
+			cam.pixel_filter = has_radius ? make_shared<tent_filter>(radius) : make_shared<tent_filter>();
+		else if (type == "blackman_harris")
+			cam.pixel_filter = has_radius ? make_shared<blackman_harris_filter>(radius) : make_shared<blackman_harris_filter>();
+		else
+			throw scene_error(tokens.line(), "unknown filter '" + std::string(type) + "'");
+	}
+	else if (keyword == "background")
+	{
+		cam.sky_background = false;
+		cam.environment = nullptr;
+		auto first = tokens.word();
+
+		if (first == "sky")
+		{
+			cam.sky_background = true;
+		}
+		else if (first == "map")
+		{
+			auto path = std::string(tokens.word());
+			double intensity = 1, rotation = 0;
+			while (!tokens.at_line_end())
+			{
+				auto setting = tokens.word();
+				if (setting == "intensity")			intensity = tokens.number();
+				else if (setting == "rotate")		rotation = tokens.number();
+				else
+					throw scene_error(tokens.line(), "unknown environment map setting '" + std::string(setting) + "'");
+			}
+
+			try
+			{
+				cam.environment = load_environment_map(path, intensity, rotation);
+			}
+			catch (const scene_error& error)
+			{
+				throw scene_error(tokens.line(), error.what());
+			}
+		}
+		else
+		{
+			// first was the red value
+			auto r = tokens.to_number(first);
+			auto g = tokens.number();
+			auto b = tokens.number();
+			cam.background = color(r, g, b);
+		}
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+// Builds a scene from the text of a scene file. The format is one statement per line:
+//
+//		camera lookfrom 0 0.5 2 lookat 0 0 -1.5 vup 0 1 0 vfov 40 defocus_angle 2 focus_dist 3.5
+//		image width 400 aspect 1.7778 samples 16 depth 10
+//		render threads 0 tile 16 pin 1 spectral 0	# pin 0 lets threads move between sockets; spectral 1 traces
+//												# wavelengths rather than RGB (see camera::spectral)
+//		render sample_environment 1			# 0 finds an environment map only by rays escaping into it
+//		render bidirectional 1				# bidirectional path tracing (see bdpt.h), for scenes lit indirectly.
+//												# Light paths start only from glowing spheres in the scene file;
+//												# other emitters (meshes, cluster files) are found by camera paths
+//		render caustics 200000 caustic_neighbours 50 caustic_radius 0.25
+//												# caustics from photons traced from the lights once (see
+//												# photon_map.h): the nearest 50 within 0.25 light each point
+//		render irradiance_cache 0.3 irradiance_rays 256	# reuse light bounced between matte surfaces, traced
+//												# with 256 rays at points spaced by accuracy 0.3 (see irradiance_cache.h)
+//		render guided 1 guide_memory 64			# learn where light comes from while rendering and aim paths
+//												# there, in at most 64 MB (see guiding.h)
+//		render metropolis 1 metropolis_chains 16	# mutate paths that found light (see metropolis.h), for light
+//												# through narrow gaps and caustics; 16 Markov chains per thread
+//		filter blackman_harris 2			# box, tent or blackman_harris, then an optional radius
+//		background sky						# or: background 0 0 0
+//												# or an HDR environment map (see environment.h), optionally
+//												# brightened and turned about the y axis (degrees):
+//												# background map sky.hdr intensity 1 rotate 0
+//		material ground lambertian 0.8 0.8 0.0
+//		material chrome metal 0.8 0.8 0.8 0.1	# albedo, fuzz
+//		material glass dielectric 1.5			# refractive index, then optionally dispersion (Cauchy B, in um^2)
+//		material lamp light 4 4 4				# emitted colour
+//		sphere 0 -100.5 -1 100 ground			# centre, radius, material name
+//		geometry city.clusters 512				# spheres from a cluster file (see cluster_file.h), read as rays
+//												# reach them, keeping at most 512 MB in memory (0 or left out = no limit)
+//		mesh teapot.obj chrome scale 0.5 offset 0 0 -1	# triangles from an OBJ file, optionally scaled then moved
+//		subdivision cube.obj matte levels 4 bumps 0.02 30 memory 64 scale 0.5 offset 0 0 -1
+//												# an OBJ file as the control mesh of a Catmull-Clark surface,
+//												# tessellated as rays reach it (see subdivision.h); bumps gives
+//												# a height and frequency for a displacement; all settings optional.
+//												# All surfaces share one cache, limited to their memory settings
+//												# added up (no limit if any of them leaves it out)
+//		hair 0 0 -1 0.4 20000 0.3 0.004 fur round	# strands growing out of a sphere (centre, radius), then how many,
+//												# how long and how wide at the root; round or ribbon (see curves.h)
+//		cloud 0 0.5 -1 0.6 30 0.9 0.9 0.9 96	# a cloud (see volume.h): centre, radius, extinction per unit length
+//												# in its core, scattering albedo, then optionally voxels across it
+//
+// Settings on the camera, image and render lines are name/value pairs in any order, and any left out keep
+// the camera's defaults. Materials must be defined before the objects that use them, including those in cluster files.
+//
+// If cache is given, unchanged objects are taken from it rather than created again (see scene_object_cache),
+// and it is replaced with the objects of this parse.
+inline scene parse_scene(std::string_view text, scene_object_cache* cache = nullptr)
+{
+	scene result;
+	auto& cam = result.cam;
+
+	class named_material
+	{
+	public:
+		shared_ptr<material> mat;
+		std::string_view definition;	// The line that defined it, for the object cache
+	};
+	// Keys point into text, which outlives the parse, so the names aren't copied either
+	std::unordered_map<std::string_view, named_material> materials;
+	scene_object_cache next_cache;
+	auto lights = make_shared<light_set>();
+
+	// Every subdivision surface in the scene tessellates on the same threads, within the total of their memory
+	// limits (none, if any of them has none)
+	shared_ptr<page_cache> tessellation_pages;
+	size_t tessellation_memory = 0;
+	bool tessellation_unlimited = false;
+
+	scene_tokenizer tokens(text);
+
+	// Returns the object made from the current line, whose material was defined by material_line, by the
+	// last parse, or null if there isn't one. Sets key for keep.
+	auto find_cached = [&](std::string_view material_line, std::string& key) -> shared_ptr<hittable>
+	{
+		if (!cache)
+			return nullptr;
+
+		// A duplicate of a line already seen this parse gets its own object, not a second copy of the first.
+		// The cache itself isn't changed until the parse succeeds, so a bad edit loses nothing.
+		key = std::string(tokens.current_line()) + '\n' + std::string(material_line);
+		auto cached = cache->objects.find(key);
+		if (cached != cache->objects.end() && next_cache.objects.count(key) == 0)
+			return cached->second;
+		return nullptr;
+	};
+
+	// Adds object to the scene, and to the cache for the next parse under key
+	auto keep = [&](std::string& key, shared_ptr<hittable> object)
+	{
+		if (cache)
+			next_cache.objects.emplace(std::move(key), object);
+		result.objects.add(std::move(object));
+	};
+
+	// Reads past the rest of a line whose object came from the cache. It was checked when the object was made.
+	auto skip_line = [&]()
+	{
+		while (!tokens.at_line_end())
+			tokens.word();
+	};
+
+	while (tokens.next_line())
+	{
+		auto keyword = tokens.word();
+
+		if (keyword == "material")
+		{
+			auto name = tokens.word();
+			auto type = tokens.word();
+			shared_ptr<material> mat;
+
+			if (type == "lambertian")
+			{
+				mat = make_shared<lambertian>(tokens.vector());
+			}
+			else if (type == "metal")
+			{
+				auto albedo = tokens.vector();
+				mat = make_shared<metal>(albedo, tokens.number());
+			}
+			else if (type == "dielectric")
+			{
+				auto index = tokens.number();
+				mat = make_shared<dielectric>(index, tokens.at_line_end() ? 0 : tokens.number());
+			}
+			else if (type == "light")
+			{
+				mat = make_shared<diffuse_light>(tokens.vector());
+			}
+			else
+			{
+				throw scene_error(tokens.line(), "unknown material type '" + std::string(type) + "'");
+			}
+
+			materials[name] = named_material{ mat, tokens.current_line() };
+		}
+		else if (keyword == "sphere")
+		{
+			// Read the tokens without converting them yet, in case the object can come from the cache
+			std::string_view words[4];
+			for (auto& word : words)
+				word = tokens.word();
+			auto name = tokens.word();
+
+			auto found = materials.find(name);
+			if (found == materials.end())
+				throw scene_error(tokens.line(), "unknown material '" + std::string(name) + "'");
+
+			std::string key;
+			auto object = find_cached(found->second.definition, key);
+			if (!object)
+			{
+				auto center = point3(tokens.to_number(words[0]), tokens.to_number(words[1]), tokens.to_number(words[2]));
+				auto radius = tokens.to_number(words[3]);
+				object = make_shared<sphere>(center, radius, found->second.mat);
+			}
+
+			// Glowing spheres are also lights that bidirectional paths can start from. A sphere kept from the
+			// last parse still has that parse's material, which is the one its hits report, so the light is
+			// registered with that.
+			const material* surface = std::static_pointer_cast<sphere>(object)->surface();
+			if (!surface->emitted().near_zero())
+			{
+				auto center = point3(tokens.to_number(words[0]), tokens.to_number(words[1]), tokens.to_number(words[2]));
+				lights->add(center, tokens.to_number(words[3]), surface);
+			}
+
+			keep(key, object);
+		}
+		else if (keyword == "geometry")
+		{
+			auto path = std::string(tokens.word());
+			double memory_mb = tokens.at_line_end() ? 0 : tokens.number();
+			if (!(memory_mb >= 0))
+				throw scene_error(tokens.line(), "geometry memory limit can't be negative");
+
+			std::unordered_map<std::string, shared_ptr<material>> by_name;
+			for (const auto& named : materials)
+				by_name.emplace(std::string(named.first), named.second.mat);
+
+			try
+			{
+				result.objects.add(make_shared<paged_geometry>(path, by_name, size_t(memory_mb * 1024 * 1024)));
+			}
+			catch (const scene_error& error)
+			{
+				throw scene_error(tokens.line(), error.what());
+			}
+		}
+		else if (keyword == "mesh")
+		{
+			auto path = std::string(tokens.word());
+			auto name = tokens.word();
+
+			auto found = materials.find(name);
+			if (found == materials.end())
+				throw scene_error(tokens.line(), "unknown material '" + std::string(name) + "'");
+
+			std::string key;
+			if (auto object = find_cached(found->second.definition, key))
+			{
+				skip_line();
+				keep(key, object);
+				continue;
+			}
+
+			triangle_mesh mesh;
+			try
+			{
+				mesh = load_obj(path);
+			}
+			catch (const scene_error& error)
+			{
+				throw scene_error(tokens.line(), path + ", " + error.what());
+			}
+
+			double scale = 1;
+			vec3 offset(0, 0, 0);
+			while (!tokens.at_line_end())
+			{
+				auto setting = tokens.word();
+				if (setting == "scale")
+					scale = tokens.number();
+				else if (setting == "offset")
+					offset = tokens.vector();
+				else
+					throw scene_error(tokens.line(), "unknown mesh setting '" + std::string(setting) + "'");
+			}
+
+			for (auto& position : mesh.positions)
+				position = scale * position + offset;
+
+			keep(key, make_shared<compressed_mesh>(mesh, found->second.mat));
+		}
+		else if (keyword == "subdivision")
+		{
+			auto path = std::string(tokens.word());
+			auto name = tokens.word();
+
+			auto found = materials.find(name);
+			if (found == materials.end())
+				throw scene_error(tokens.line(), "unknown material '" + std::string(name) + "'");
+
+			std::string key;
+			if (auto object = find_cached(found->second.definition, key))
+			{
+				skip_line();
+				keep(key, object);
+				continue;
+			}
+
+			polygon_mesh control;
+			try
+			{
+				control = load_obj_polygons(path);
+			}
+			catch (const scene_error& error)
+			{
+				throw scene_error(tokens.line(), path + ", " + error.what());
+			}
+
+			int levels = 3;
+			double bump_height = 0, bump_frequency = 0, memory_mb = 0, scale = 1;
+			vec3 offset(0, 0, 0);
+			while (!tokens.at_line_end())
+			{
+				auto setting = tokens.word();
+				if (setting == "levels")
+					levels = int(tokens.number());
+				else if (setting == "bumps")
+				{
+					bump_height = tokens.number();
+					bump_frequency = tokens.number();
+				}
+				else if (setting == "memory")
+					memory_mb = tokens.number();
+				else if (setting == "scale")
+					scale = tokens.number();
+				else if (setting == "offset")
+					offset = tokens.vector();
+				else
+					throw scene_error(tokens.line(), "unknown subdivision setting '" + std::string(setting) + "'");
+			}
+
+			if (levels < 0 || levels > 8)
+				throw scene_error(tokens.line(), "subdivision levels must be from 0 to 8");
+			if (!(memory_mb >= 0))
+				throw scene_error(tokens.line(), "subdivision memory limit can't be negative");
+
+			for (auto& position : control.positions)
+				position = scale * position + offset;
+
+			std::function<double(const point3&)> bumps;
+			if (bump_height != 0)
+			{
+				bumps = [bump_height, bump_frequency](const point3& p)
+				{
+					return bump_height * std::sin(bump_frequency * p.x()) * std::sin(bump_frequency * p.y())
+						* std::sin(bump_frequency * p.z());
+				};
+			}
+
+			if (!tessellation_pages)
+				tessellation_pages = make_shared<page_cache>();
+			tessellation_unlimited = tessellation_unlimited || memory_mb == 0;
+			tessellation_memory += size_t(memory_mb * 1024 * 1024);
+			tessellation_pages->set_memory_limit(tessellation_unlimited ? 0 : tessellation_memory);
+
+			keep(key, make_shared<subdivision_surface>(control, found->second.mat, levels, bumps, std::fabs(bump_height),
+													   tessellation_pages));
+		}
+		else if (keyword == "hair")
+		{
+			auto centre = tokens.vector();
+			auto radius = tokens.number();
+			auto count = int(tokens.number());
+			auto length = tokens.number();
+			auto width = tokens.number();
+			auto name = tokens.word();
+
+			auto found = materials.find(name);
+			if (found == materials.end())
+				throw scene_error(tokens.line(), "unknown material '" + std::string(name) + "'");
+
+			std::string key;
+			if (auto object = find_cached(found->second.definition, key))
+			{
+				skip_line();
+				keep(key, object);
+				continue;
+			}
+
+			auto shape = curve_shape::round;
+			if (!tokens.at_line_end())
+			{
+				auto shape_name = tokens.word();
+				if (shape_name == "ribbon")
+					shape = curve_shape::ribbon;
+				else if (shape_name != "round")
+					throw scene_error(tokens.line(), "unknown curve shape '" + std::string(shape_name) + "'");
+			}
+
+			keep(key, make_shared<curve_set>(grow_hair(centre, radius, count, length, width), found->second.mat, shape));
+		}
+		else if (keyword == "cloud")
+		{
+			std::string key;
+			if (auto object = find_cached(std::string_view(), key))
+			{
+				skip_line();
+				keep(key, object);
+				continue;
+			}
+
+			auto centre = tokens.vector();
+			auto radius = tokens.number();
+			auto sigma = tokens.number();
+			auto albedo = tokens.vector();
+			int resolution = tokens.at_line_end() ? 64 : int(tokens.number());
+
+			if (radius <= 0 || resolution < 1)
+				throw scene_error(tokens.line(), "a cloud needs a positive radius and resolution");
+
+			keep(key, make_shared<heterogeneous_medium>(make_cloud(centre, radius, resolution), sigma, albedo));
+		}
+		else if (keyword == "background" && cache && cache->environments.count(std::string(tokens.current_line())))
+		{
+			// An unchanged environment map line takes the map from the cache rather than loading it again
+			auto cached = cache->environments.find(std::string(tokens.current_line()));
+			skip_line();
+			cam.sky_background = false;
+			cam.environment = cached->second;
+			next_cache.environments.emplace(cached->first, cached->second);
+		}
+		else if (parse_camera_statement(keyword, tokens, cam))
+		{
+			if (keyword == "background" && cache && cam.environment)
+				next_cache.environments.emplace(std::string(tokens.current_line()), cam.environment);
+		}
+		else
+		{
+			throw scene_error(tokens.line(), "unknown statement '" + std::string(keyword) + "'");
+		}
+
+		if (!tokens.at_line_end())
+			throw scene_error(tokens.line(), "unexpected '" + std::string(tokens.word()) + "' at end of line");
+	}
+
+	if (cache)
+	{
+		cache->objects = std::move(next_cache.objects);
+		cache->environments = std::move(next_cache.environments);
+	}
+
+	lights->build();
+	cam.lights = lights;
+
+	return result;
+}
+
+// Reads a scene file and parses it
+inline scene load_scene(const std::string& path, scene_object_cache* cache = nullptr)
+{
+	auto text = read_text_file(path);
+
+	try
+	{
+		return parse_scene(text, cache);
+	}
+	catch (const scene_error& error)
+	{
+		throw scene_error(path + ", " + error.what());
+	}
+}
+
+#endif
@@ -0,0 +1,164 @@
+#pragma once
+
+#ifndef SCENE_TOKENIZER_H
+#define SCENE_TOKENIZER_H
+
+#include "rtweekend.h"
+
+#include <charconv>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+/// <summary>
+/// Thrown when a scene file can't be read or doesn't make sense. The message includes the line number.
+/// </summary>
+class scene_error : public std::runtime_error
+{
+public:
+	scene_error(int line, const std::string& message)
+		: std::runtime_error("line " + std::to_string(line) + ": " + message) {}
+	scene_error(const std::string& message) : std::runtime_error(message) {}
+};
+
+/// <summary>
+/// Splits scene text into lines and whitespace separated tokens.
+/// Tokens are string_views pointing into the original text, so nothing is copied or allocated
+/// however big the file is. Everything after a '#' on a line is a comment.
+/// </summary>
+class scene_tokenizer
+{
+public:
+	scene_tokenizer(std::string_view text) : text(text) {}
+
+	// Moves to the next line that has something on it (skipping whatever is left of the current one).
+	// Returns false when there are no more lines.
+	bool next_line()
+	{
+		if (started)
+			while (pos < text.size() && text[pos] != '\n')
+				pos++;
+		started = true;
+
+		while (pos < text.size())
+		{
+			if (text[pos] == '\n')
+			{
+				pos++;
+				line_number++;
+				continue;
+			}
+
+			line_start = pos;
+			skip_spaces();
+			if (pos < text.size() && text[pos] != '\n')
+				return true;
+		}
+
+		return false;
+	}
+
+	// The whole of the current line, without the newline
+	std::string_view current_line() const
+	{
+		auto end = text.find('\n', line_start);
+		if (end == std::string_view::npos)
+			end = text.size();
+		return text.substr(line_start, end - line_start);
+	}
+
+	// True if there are no more tokens on the current line
+	bool at_line_end()
+	{
+		skip_spaces();
+		return pos >= text.size() || text[pos] == '\n';
+	}
+
+	// Returns the next token on the current line
+	std::string_view word()
+	{
+		if (at_line_end())
+			throw scene_error(line_number, "unexpected end of line");
+
+		size_t start = pos;
+		while (pos < text.size() && !is_separator(text[pos]))
+			pos++;
+
+		return text.substr(start, pos - start);
+	}
+
+	// Reads the next token as a number
+	double number()
+	{
+		return to_number(word());
+	}
+
+	// Converts a token to a number.
+	// std::from_chars doesn't allocate or look at the locale, unlike std::stod.
+	double to_number(std::string_view token) const
+	{
+		double value = 0;
+		auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+		if (result.ec != std::errc() || result.ptr != token.data() + token.size())
+			throw scene_error(line_number, "expected a number but found '" + std::string(token) + "'");
+
+		return value;
+	}
+
+	// Reads the next three tokens as a vector
+	vec3 vector()
+	{
+		auto x = number();
+		auto y = number();
+		auto z = number();
+		return vec3(x, y, z);
+	}
+
+	int line() const { return line_number; }
+
+private:
+	std::string_view text;
+	size_t pos = 0;
+	size_t line_start = 0;
+	int line_number = 1;
+	bool started = false;
+
+	static bool is_separator(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '#';
+	}
+
+	// Skips spaces and comments, but stops at the end of the line
+	void skip_spaces()
+	{
+		while (pos < text.size())
+		{
+			char c = text[pos];
+			if (c == ' ' || c == '\t' || c == '\r')
+				pos++;
+			else if (c == '#')
+				while (pos < text.size() && text[pos] != '\n')
+					pos++;
+			else
+				break;
+		}
+	}
+};
+
+// Reads the whole of a text file into memory in one go
+inline std::string read_text_file(const std::string& path)
+{
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file)
+		throw scene_error("can't open file '" + path + "'");
+
+	// opened at the end (ate), so the position is the file size
+	std::string text(size_t(file.tellg()), '\0');
+	file.seekg(0);
+	file.read(&text[0], std::streamsize(text.size()));
+
+	return text;
+}
+
+#endif
@@ -0,0 +1,276 @@
+#pragma once
+
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define SPECTRUM_SSE 1
+#include <xmmintrin.h>
+#endif
+
+/// <summary>
+/// A value at each of the four wavelengths a spectral path carries: light, or how much of it a surface passes on.
+/// The four are packed into one SSE register where there is one, so spectral paths cost barely more to trace
+/// than RGB ones.
+/// </summary>
+class spectrum
+{
+public:
+	spectrum() : spectrum(0) {}
+	explicit spectrum(float v) : spectrum(v, v, v, v) {}
+
+#ifdef SPECTRUM_SSE
+	spectrum(float a, float b, float c, float d) : lanes(_mm_setr_ps(a, b, c, d)) {}
+
+	float operator[](int i) const
+	{
+		alignas(16) float values[4];
+		_mm_store_ps(values, lanes);
+		return values[i];
+	}
+
+	spectrum& operator+=(const spectrum& s) { lanes = _mm_add_ps(lanes, s.lanes); return *this; }
+	spectrum& operator*=(const spectrum& s) { lanes = _mm_mul_ps(lanes, s.lanes); return *this; }
+	spectrum& operator*=(float t) { lanes = _mm_mul_ps(lanes, _mm_set1_ps(t)); return *this; }
+
+	bool is_black() const { return _mm_movemask_ps(_mm_cmpneq_ps(lanes, _mm_setzero_ps())) == 0; }
+
+private:
+	__m128 lanes;
+#else
+	spectrum(float a, float b, float c, float d) : lanes{ a, b, c, d } {}
+
+	float operator[](int i) const { return lanes[i]; }
+
+	spectrum& operator+=(const spectrum& s) { for (int i = 0; i < 4; i++) lanes[i] += s.lanes[i]; return *this; }
+	spectrum& operator*=(const spectrum& s) { for (int i = 0; i < 4; i++) lanes[i] *= s.lanes[i]; return *this; }
+	spectrum& operator*=(float t) { for (int i = 0; i < 4; i++) lanes[i] *= t; return *this; }
+
+	bool is_black() const { return lanes[0] == 0 && lanes[1] == 0 && lanes[2] == 0 && lanes[3] == 0; }
+
+private:
+	float lanes[4];
+#endif
+};
+
+inline spectrum operator+(spectrum a, const spectrum& b) { return a += b; }
+inline spectrum operator*(spectrum a, const spectrum& b) { return a *= b; }
+inline spectrum operator*(spectrum a, float t) { return a *= t; }
+
+/// <summary>
+/// The wavelengths one spectral path carries (hero wavelength sampling, Wilkie et al. 2014): a "hero" chosen at
+/// random, and three more spaced evenly around the visible range from it, so every path covers the spectrum and
+/// colour noise stays low. Also converts the light gathered at them back to RGB.
+///
+/// The conversions both ways are looked up in tables, 1 nm apart, once per path when the wavelengths are
+/// picked, so that to_rgb and from_rgb (which every bounce calls) are only a few multiplies.
+/// </summary>
+class wavelengths
+{
+public:
+	static constexpr double shortest = 380;		// nm
+	static constexpr double longest = 720;
+
+	// Picks a hero wavelength from u in [0, 1)
+	explicit wavelengths(double u)
+	{
+		const auto& table = conversion_table();
+		for (int i = 0; i < 4; i++)
+		{
+			double l = shortest + (u + i / 4.0) * (longest - shortest);
+			nm[i] = l >= longest ? l - (longest - shortest) : l;
+
+			// Linearly between the two table entries either side
+			double x = nm[i] - shortest;
+			int k = std::min(int(x), table_size - 2);
+			double f = x - k;
+			response[i] = (1 - f) * table.response[k] + f * table.response[k + 1];
+			from_rgb_weights[i] = (1 - f) * table.from_rgb[k] + f * table.from_rgb[k + 1];
+		}
+	}
+
+	double operator[](int i) const { return nm[i]; }
+	double hero() const { return nm[0]; }
+
+	// Called where the path can only go on for the hero wavelength (e.g. dispersion, where each wavelength
+	// refracts its own way). Returns what to multiply the path by: 4 times the hero (it now stands for all four
+	// samples) and nothing for the others, the first time; after that, the path is already hero-only.
+	spectrum terminate_secondary()
+	{
+		if (secondary_terminated)
+			return spectrum(1, 0, 0, 0);
+
+		secondary_terminated = true;
+		return spectrum(4, 0, 0, 0);
+	}
+
+	// The RGB colour of light l at these wavelengths: an estimate whose average over all heroes is the
+	// colour of the whole spectrum. A spectrum of 1 everywhere gives white (1, 1, 1).
+	color to_rgb(const spectrum& l) const
+	{
+		color result(0, 0, 0);
+		for (int i = 0; i < 4; i++)
+			result += double(l[i]) * response[i];
+
+		return result / 4;
+	}
+
+	// A spectrum with RGB colour c, for reflectances and lights given in RGB. Smooth, and exact for white (a
+	// reflectance of 1 everywhere); other colours round-trip through to_rgb to within a few percent.
+	spectrum from_rgb(const color& c) const
+	{
+		// Clamped, as very saturated colours can ask for a little less than nothing at some wavelengths
+		float values[4];
+		for (int i = 0; i < 4; i++)
+			values[i] = float(std::fmax(dot(from_rgb_weights[i], c), 0.0));
+
+		return spectrum(values[0], values[1], values[2], values[3]);
+	}
+
+private:
+	static constexpr int table_size = int(longest - shortest) + 1;
+
+	double nm[4];
+	color response[4];				// rgb_response at each wavelength
+	color from_rgb_weights[4];		// What each RGB channel adds to the spectrum at each wavelength
+	bool secondary_terminated = false;
+
+	/// <summary>
+	/// rgb_response and the basis spectra weighted to give RGB colours (see from_rgb) at every whole nm.
+	/// </summary>
+	class conversions
+	{
+	public:
+		color response[table_size];
+		color from_rgb[table_size];
+	};
+
+	static const conversions& conversion_table()
+	{
+		static const conversions table = []()
+		{
+			// The basis spectra are mixed by the inverse matrix's rows: channel c adds
+			// sum over b of basis b * inverse[b][c] to the spectrum
+			const auto& weights = basis_matrix().inverse;
+			conversions result;
+			for (int k = 0; k < table_size; k++)
+			{
+				double l = shortest + k;
+				result.response[k] = rgb_response(l);
+
+				auto basis = rgb_basis(l);
+				for (int channel = 0; channel < 3; channel++)
+					result.from_rgb[k][channel] = basis.x() * weights[0][channel] + basis.y() * weights[1][channel]
+						+ basis.z() * weights[2][channel];
+			}
+			return result;
+		}();
+
+		return table;
+	}
+
+	// Piecewise Gaussian, as used by the CIE fits below
+	static double lobe(double l, double mean, double below, double above)
+	{
+		double x = (l - mean) / (l < mean ? below : above);
+		return std::exp(-0.5 * x * x);
+	}
+
+	// Linear sRGB response to light at wavelength l, from the CIE 1931 colour matching functions (the
+	// multi-lobe fits of Wyman, Sloan and Shirley 2013)
+	static color unscaled_response(double l)
+	{
+		double x = 1.056 * lobe(l, 599.8, 37.9, 31.0) + 0.362 * lobe(l, 442.0, 16.0, 26.7) - 0.065 * lobe(l, 501.1, 20.4, 26.2);
+		double y = 0.821 * lobe(l, 568.8, 46.9, 40.5) + 0.286 * lobe(l, 530.9, 16.3, 31.1);
+		double z = 1.217 * lobe(l, 437.0, 11.8, 36.0) + 0.681 * lobe(l, 459.0, 26.0, 13.8);
+
+		return color(3.2406 * x - 1.5372 * y - 0.4986 * z,
+					 -0.9689 * x + 1.8758 * y + 0.0415 * z,
+					 0.0557 * x - 0.2040 * y + 1.0570 * z);
+	}
+
+	// The response scaled so that a flat spectrum (averaged over the range) comes out white
+	static color rgb_response(double l)
+	{
+		static const color white = []()
+		{
+			color sum(0, 0, 0);
+			int steps = 0;
+			for (double nm = shortest + 0.5; nm < longest; nm += 1, steps++)
+				sum += unscaled_response(nm);
+			return sum / steps;
+		}();
+
+		auto rgb = unscaled_response(l);
+		return color(rgb.x() / white.x(), rgb.y() / white.y(), rgb.z() / white.z());
+	}
+
+	// Three smooth spectra, red, green and blue, that add up to 1 at every wavelength
+	static color rgb_basis(double l)
+	{
+		auto smoothstep = [](double from, double to, double x)
+		{
+			double t = clamp((x - from) / (to - from), 0, 1);
+			return t * t * (3 - 2 * t);
+		};
+
+		double blue = 1 - smoothstep(480, 510, l);
+		double red = smoothstep(570, 600, l);
+		return color(red, 1 - red - blue, blue);
+	}
+
+	/// <summary>
+	/// How much of each RGB channel each basis spectrum produces, inverted: the basis weights that give a colour.
+	/// </summary>
+	class basis_weights
+	{
+	public:
+		double inverse[3][3];
+	};
+
+	static const basis_weights& basis_matrix()
+	{
+		static const basis_weights weights = []()
+		{
+			double m[3][3] = {};
+			int steps = 0;
+			for (double l = shortest + 0.5; l < longest; l += 1, steps++)
+			{
+				auto response = rgb_response(l);
+				auto basis = rgb_basis(l);
+				for (int row = 0; row < 3; row++)
+					for (int column = 0; column < 3; column++)
+						m[row][column] += response[row] * basis[column];
+			}
+			for (auto& row : m)
+				for (auto& value : row)
+					value /= steps;
+
+			double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+				- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+				+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+
+			basis_weights result;
+			for (int row = 0; row < 3; row++)
+				for (int column = 0; column < 3; column++)
+				{
+					// Cofactor of m[column][row], over the determinant
+					int r0 = (column + 1) % 3, r1 = (column + 2) % 3, c0 = (row + 1) % 3, c1 = (row + 2) % 3;
+					result.inverse[row][column] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+				}
+
+			return result;
+		}();
+
+		return weights;
+	}
+};
+
+#endif
@@ -0,0 +1,86 @@
+#pragma once
+
+#ifndef SPHERE_H
+#define SPHERE_H
+
+#include "hittable.h"
+
+/// <summary>
+/// A sphere defined by its centre and radius.
+/// </summary>
+class sphere : public hittable
+{
+public:
+	sphere(const point3& center, double radius, shared_ptr<material> mat)
+		: center(center), radius(std::fmax(0, radius)), mat(mat)
+	{
+		auto rvec = vec3(radius, radius, radius);
+		bbox = aabb(center - rvec, center + rvec);
+	}
+
+	const material* surface() const { return mat.get(); }
+
+	bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override
+	{
+		// Solve the quadratic |A + tb - C|^2 = r^2 for t.
+		// Uses h = b/2 to cancel out the factors of 2 in the usual formula.
+		vec3 oc = center - r.origin();
+		auto a = r.direction().length_squared();
+		auto h = dot(r.direction(), oc);
+		auto c = oc.length_squared() - radius * radius;
+
+		auto discriminant = h * h - a * c;
+		if (discriminant < 0)
+			return false;
+
+		auto sqrtd = std::sqrt(discriminant);
+
+		// Find the nearest root that lies in the acceptable range.
+		auto root = (h - sqrtd) / a;
+		if (root <= ray_tmin || ray_tmax <= root)
+		{
+			root = (h + sqrtd) / a;
+			if (root <= ray_tmin || ray_tmax <= root)
+				return false;
+		}
+
+		rec.t = root;
+		rec.p = r.at(rec.t);
+		// dividing by the radius gives a unit length normal
+		vec3 outward_normal = (rec.p - center) / radius;
+		rec.set_face_normal(r, outward_normal);
+		rec.mat = mat.get();
+
+		return true;
+	}
+
+	bool occluded(const ray& r, double ray_tmin, double ray_tmax) const override
+	{
+		// Same quadratic as hit, but either root in range will do and there is no hit record to fill in
+		vec3 oc = center - r.origin();
+		auto a = r.direction().length_squared();
+		auto h = dot(r.direction(), oc);
+		auto c = oc.length_squared() - radius * radius;
+
+		auto discriminant = h * h - a * c;
+		if (discriminant < 0)
+			return false;
+
+		auto sqrtd = std::sqrt(discriminant);
+		auto near_root = (h - sqrtd) / a;
+		auto far_root = (h + sqrtd) / a;
+
+		return (ray_tmin < near_root && near_root < ray_tmax)
+			|| (ray_tmin < far_root && far_root < ray_tmax);
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+private:
+	point3 center;
+	double radius;
+	shared_ptr<material> mat;
+	aabb bbox;
+};
+
+#endif
@@ -0,0 +1,333 @@
+#pragma once
+
+#ifndef SUBDIVISION_H
+#define SUBDIVISION_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "compressed_mesh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "page_cache.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// One step of Catmull-Clark subdivision: every face with n corners becomes n quads. Edges with only one face
+// (including those around the outside of a piece cut from a bigger mesh) get the usual boundary rules.
+// in_patch holds a flag for each face, and is replaced with one for each new face, copied from its parent.
+inline polygon_mesh catmull_clark(const polygon_mesh& mesh, std::vector<bool>& in_patch)
+{
+	auto vertex_count = mesh.positions.size();
+	auto face_count = mesh.face_sizes.size();
+
+	std::vector<size_t> face_start(face_count);
+	for (size_t f = 0, first = 0; f < face_count; first += mesh.face_sizes[f++])
+		face_start[f] = first;
+
+	// Face points: the centre of each face
+	std::vector<point3> face_points(face_count, point3(0, 0, 0));
+	for (size_t f = 0; f < face_count; f++)
+	{
+		for (int i = 0; i < mesh.face_sizes[f]; i++)
+			face_points[f] += mesh.positions[mesh.indices[face_start[f] + i]];
+		face_points[f] /= mesh.face_sizes[f];
+	}
+
+	// Number the edges, and add up the face points on each side of them
+	class edge
+	{
+	public:
+		int a, b;
+		int faces = 0;
+		vec3 face_sum = vec3(0, 0, 0);
+	};
+	std::vector<edge> edges;
+	std::unordered_map<uint64_t, int> edge_index;
+	std::vector<int> face_edges(mesh.indices.size());		// Edge from each corner to the next
+
+	for (size_t f = 0; f < face_count; f++)
+	{
+		for (int i = 0; i < mesh.face_sizes[f]; i++)
+		{
+			int a = mesh.indices[face_start[f] + i];
+			int b = mesh.indices[face_start[f] + (i + 1) % mesh.face_sizes[f]];
+			auto key = (uint64_t(std::min(a, b)) << 32) | uint64_t(std::max(a, b));
+
+			auto found = edge_index.emplace(key, int(edges.size())).first;
+			if (found->second == int(edges.size()))
+				edges.push_back(edge{ a, b });
+
+			auto& e = edges[found->second];
+			e.faces++;
+			e.face_sum += face_points[f];
+			face_edges[face_start[f] + i] = found->second;
+		}
+	}
+
+	// Edge points: the average of the ends and the neighbouring face points, or the middle on a boundary
+	std::vector<point3> edge_points(edges.size());
+	for (size_t e = 0; e < edges.size(); e++)
+	{
+		const auto& ends = edges[e];
+		auto& a = mesh.positions[ends.a];
+		auto& b = mesh.positions[ends.b];
+		edge_points[e] = ends.faces == 2 ? (a + b + ends.face_sum) / 4 : (a + b) / 2;
+	}
+
+	// Vertex points: (F + 2R + (n - 3)P) / n inside the surface, where F averages the neighbouring face points,
+	// R the midpoints of the n edges and P is the vertex; on a boundary, 3/4 P plus 1/8 of each boundary neighbour
+	std::vector<int> valence(vertex_count, 0), boundary_edges(vertex_count, 0), face_counts(vertex_count, 0);
+	std::vector<vec3> midpoint_sum(vertex_count, vec3(0, 0, 0));
+	std::vector<vec3> boundary_sum(vertex_count, vec3(0, 0, 0));
+	std::vector<vec3> face_sum(vertex_count, vec3(0, 0, 0));
+
+	for (const auto& e : edges)
+	{
+		auto middle = (mesh.positions[e.a] + mesh.positions[e.b]) / 2;
+		for (int end : { e.a, e.b })
+		{
+			valence[end]++;
+			midpoint_sum[end] += middle;
+			if (e.faces != 2)
+			{
+				boundary_edges[end]++;
+				boundary_sum[end] += mesh.positions[end == e.a ? e.b : e.a];
+			}
+		}
+	}
+
+	for (size_t f = 0; f < face_count; f++)
+	{
+		for (int i = 0; i < mesh.face_sizes[f]; i++)
+		{
+			int v = mesh.indices[face_start[f] + i];
+			face_counts[v]++;
+			face_sum[v] += face_points[f];
+		}
+	}
+
+	polygon_mesh result;
+	result.positions.reserve(vertex_count + edges.size() + face_count);
+
+	for (size_t v = 0; v < vertex_count; v++)
+	{
+		const auto& p = mesh.positions[v];
+		double n = valence[v];
+
+		if (boundary_edges[v] == 0 && valence[v] > 0)
+			result.positions.push_back((face_sum[v] / face_counts[v] + 2 * midpoint_sum[v] / n + (n - 3) * p) / n);
+		else if (boundary_edges[v] == 2)
+			result.positions.push_back(0.75 * p + boundary_sum[v] / 8);
+		else
+			result.positions.push_back(p);	// A corner, or where the surface isn't a manifold: kept where it is
+	}
+	result.positions.insert(result.positions.end(), edge_points.begin(), edge_points.end());
+	result.positions.insert(result.positions.end(), face_points.begin(), face_points.end());
+
+	// New faces: corner, edge point after it, face point, edge point before it
+	int first_edge_point = int(vertex_count);
+	int first_face_point = int(vertex_count + edges.size());
+	std::vector<bool> children_in_patch;
+
+	for (size_t f = 0; f < face_count; f++)
+	{
+		int size = mesh.face_sizes[f];
+		for (int i = 0; i < size; i++)
+		{
+			result.face_sizes.push_back(4);
+			result.indices.push_back(mesh.indices[face_start[f] + i]);
+			result.indices.push_back(first_edge_point + face_edges[face_start[f] + i]);
+			result.indices.push_back(first_face_point + int(f));
+			result.indices.push_back(first_edge_point + face_edges[face_start[f] + (i + size - 1) % size]);
+			children_in_patch.push_back(in_patch[f]);
+		}
+	}
+
+	in_patch = std::move(children_in_patch);
+	return result;
+}
+
+/// <summary>
+/// A Catmull-Clark subdivision surface, optionally displaced along its normal.
+///
+/// Each face of the control mesh is a patch, which is only tessellated when a ray first reaches its bounding box.
+/// Tessellating uses the page_cache machinery: the work runs on the cache's own threads while render threads
+/// go on with other tiles, and with a memory limit the least recently used patches are dropped and made again
+/// if they're needed. So a surface far too finely tessellated to hold in memory at once can still be rendered.
+///
+/// A patch is tessellated by subdividing just the faces around it (every face sharing a corner with it):
+/// that is all a Catmull-Clark patch depends on, at every level, so neighbouring patches agree along their
+/// shared edges. The box of those faces' corners, grown by the displacement bound, holds the whole patch.
+/// Every patch is compressed with the same quantisation step, the one the biggest patch box needs, so the
+/// vertices along a shared edge are rounded to the same places in both patches and no cracks open.
+/// </summary>
+class subdivision_surface : public hittable
+{
+public:
+	// displacement moves each tessellated point that far along the surface normal; displacement_bound must be
+	// at least the largest distance it ever moves a point. The patches are kept in pages, which several surfaces
+	// can share so that they tessellate on the same threads within one memory limit; if it is null the surface
+	// makes a cache of its own, with no limit.
+	subdivision_surface(const polygon_mesh& control, shared_ptr<material> mat, int levels,
+						std::function<double(const point3&)> displacement = nullptr, double displacement_bound = 0,
+						shared_ptr<page_cache> pages = nullptr)
+		: cache(pages ? std::move(pages) : make_shared<page_cache>())
+	{
+		auto settings = make_shared<tessellation>();
+		settings->mat = std::move(mat);
+		settings->levels = levels;
+		settings->displacement = std::move(displacement);
+
+		std::vector<size_t> face_start(control.face_sizes.size());
+		for (size_t f = 0, first = 0; f < face_start.size(); first += control.face_sizes[f++])
+			face_start[f] = first;
+
+		std::vector<std::vector<int>> vertex_faces(control.positions.size());
+		for (size_t f = 0; f < face_start.size(); f++)
+			for (int i = 0; i < control.face_sizes[f]; i++)
+				vertex_faces[control.indices[face_start[f] + i]].push_back(int(f));
+
+		auto pad = vec3(displacement_bound, displacement_bound, displacement_bound);
+		hittable_list patches;
+
+		for (size_t f = 0; f < face_start.size(); f++)
+		{
+			// The patch's own face first, then every other face touching one of its corners
+			std::vector<int> faces{ int(f) };
+			for (int i = 0; i < control.face_sizes[f]; i++)
+				for (int neighbour : vertex_faces[control.indices[face_start[f] + i]])
+					if (std::find(faces.begin(), faces.end(), neighbour) == faces.end())
+						faces.push_back(neighbour);
+
+			aabb box;
+			for (int neighbour : faces)
+				for (int i = 0; i < control.face_sizes[neighbour]; i++)
+					box.expand(control.positions[control.indices[face_start[neighbour] + i]]);
+			box = aabb(box.minimum - pad, box.maximum + pad);
+			settings->step = std::fmax(settings->step, compressed_mesh::step_for(box));
+
+			polygon_mesh neighbourhood;
+			std::unordered_map<int, int> local_index;
+			for (int neighbour : faces)
+			{
+				neighbourhood.face_sizes.push_back(control.face_sizes[neighbour]);
+				for (int i = 0; i < control.face_sizes[neighbour]; i++)
+				{
+					int vertex = control.indices[face_start[neighbour] + i];
+					auto found = local_index.emplace(vertex, int(local_index.size())).first;
+					if (found->second == int(neighbourhood.positions.size()))
+						neighbourhood.positions.push_back(control.positions[vertex]);
+					neighbourhood.indices.push_back(found->second);
+				}
+			}
+
+			// The loader holds what it needs itself: a shared cache can still be loading it after this is gone
+			int page = cache->add_page([settings, neighbourhood]() { return tessellate(*settings, neighbourhood); });
+			patches.add(make_shared<paged_hittable>(*cache, page, box));
+		}
+
+		if (!patches.objects.empty())
+			top = make_shared<bvh>(patches);
+		bbox = patches.bounding_box();
+	}
+
+	bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override
+	{
+		return top && top->hit(r, ray_tmin, ray_tmax, rec);
+	}
+
+	bool occluded(const ray& r, double ray_tmin, double ray_tmax) const override
+	{
+		return top && top->occluded(r, ray_tmin, ray_tmax);
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+	const page_cache& pages() const { return *cache; }
+
+private:
+	/// <summary>
+	/// How the patches of one surface are tessellated, shared by their page loaders.
+	/// </summary>
+	class tessellation
+	{
+	public:
+		shared_ptr<material> mat;
+		int levels = 0;
+		std::function<double(const point3&)> displacement;
+		double step = 0;			// Quantisation step for every patch's compressed_mesh
+	};
+
+	// Declared before top so it is destroyed after it: the paged_hittables in top refer to it
+	shared_ptr<page_cache> cache;
+	shared_ptr<bvh> top;
+	aabb bbox;
+
+	// Subdivides a patch (the first face of neighbourhood) levels times, displaces it and packs the result
+	// into a compressed_mesh. Runs on a page_cache thread (or a render thread that had to wait).
+	static shared_ptr<const pageable> tessellate(const tessellation& settings, const polygon_mesh& neighbourhood)
+	{
+		std::vector<bool> in_patch(neighbourhood.face_sizes.size(), false);
+		in_patch[0] = true;
+
+		polygon_mesh mesh = neighbourhood;
+		for (int level = 0; level < settings.levels; level++)
+			mesh = catmull_clark(mesh, in_patch);
+
+		if (settings.displacement)
+		{
+			// Vertex normals from all the faces around each vertex, which along the patch's edges includes
+			// the neighbouring patch's faces, so both patches move their shared vertices the same way
+			std::vector<vec3> normals(mesh.positions.size(), vec3(0, 0, 0));
+			for (size_t f = 0, first = 0; f < mesh.face_sizes.size(); first += mesh.face_sizes[f++])
+			{
+				int size = mesh.face_sizes[f];
+				for (int i = 0; i < size; i++)
+				{
+					const auto& p = mesh.positions[mesh.indices[first + i]];
+					const auto& next = mesh.positions[mesh.indices[first + (i + 1) % size]];
+					const auto& previous = mesh.positions[mesh.indices[first + (i + size - 1) % size]];
+					normals[mesh.indices[first + i]] += cross(next - p, previous - p);
+				}
+			}
+
+			for (size_t v = 0; v < mesh.positions.size(); v++)
+				if (normals[v].length_squared() > 0)
+					mesh.positions[v] += settings.displacement(mesh.positions[v]) * unit_vector(normals[v]);
+		}
+
+		// Keep only the patch's own faces, and the vertices they use
+		polygon_mesh patch;
+		std::unordered_map<int, int> local_index;
+		for (size_t f = 0, first = 0; f < mesh.face_sizes.size(); first += mesh.face_sizes[f++])
+		{
+			if (!in_patch[f])
+				continue;
+
+			patch.face_sizes.push_back(mesh.face_sizes[f]);
+			for (int i = 0; i < mesh.face_sizes[f]; i++)
+			{
+				int vertex = mesh.indices[first + i];
+				auto found = local_index.emplace(vertex, int(local_index.size())).first;
+				if (found->second == int(patch.positions.size()))
+					patch.positions.push_back(mesh.positions[vertex]);
+				patch.indices.push_back(found->second);
+			}
+		}
+
+		auto triangles = make_shared<compressed_mesh>(triangulate(patch), settings.mat, settings.step);
+		auto data = make_shared<paged_hittable::contents>();
+		data->objects = triangles;
+		data->memory_size = triangles->memory_size();
+		return data;
+	}
+};
+
+#endif
@@ -0,0 +1,342 @@
+#pragma once
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#include <windows.h>
+#elif defined(__linux__)
+	#include <pthread.h>
+	#include <sched.h>
+#endif
+
+/// <summary>
+/// Which logical CPUs belong to which NUMA node (on a dual-socket machine, roughly which socket).
+/// Memory attached to the other socket is noticeably slower to reach, so threads should work on
+/// memory that lives on their own node.
+/// </summary>
+class cpu_topology
+{
+public:
+	std::vector<int> cpus;		// Logical CPU index, as understood by pin_current_thread
+	std::vector<int> nodes;		// NUMA node of each entry in cpus
+	int node_count = 1;
+
+	// Reads the topology from the operating system.
+	// Falls back to a single node holding every hardware thread if it can't be read.
+	static cpu_topology detect()
+	{
+		cpu_topology topology;
+
+#if defined(_WIN32)
+		ULONG highest_node = 0;
+		if (GetNumaHighestNodeNumber(&highest_node))
+		{
+			for (USHORT node = 0; node <= highest_node; node++)
+			{
+				GROUP_AFFINITY affinity = {};
+				if (!GetNumaNodeProcessorMaskEx(node, &affinity))
+					continue;
+
+				// Windows splits CPUs into groups of up to 64, so number them group * 64 + bit
+				for (int bit = 0; bit < 64; bit++)
+				{
+					if (affinity.Mask & (KAFFINITY(1) << bit))
+					{
+						topology.cpus.push_back(affinity.Group * 64 + bit);
+						topology.nodes.push_back(node);
+					}
+				}
+				topology.node_count = int(node) + 1;
+			}
+		}
+#elif defined(__linux__)
+		for (int node = 0; ; node++)
+		{
+			std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			if (!cpulist)
+				break;
+
+			std::string line;
+			std::getline(cpulist, line);
+			for (int cpu : parse_cpu_list(line))
+			{
+				topology.cpus.push_back(cpu);
+				topology.nodes.push_back(node);
+			}
+			topology.node_count = node + 1;
+		}
+#endif
+
+		if (topology.cpus.empty())
+		{
+			int threads = int(std::thread::hardware_concurrency());
+			for (int cpu = 0; cpu < (threads < 1 ? 1 : threads); cpu++)
+			{
+				topology.cpus.push_back(cpu);
+				topology.nodes.push_back(0);
+			}
+			topology.node_count = 1;
+		}
+
+		return topology;
+	}
+
+	// Parses a Linux CPU list such as "0-3,8-11" into {0,1,2,3,8,9,10,11}
+	static std::vector<int> parse_cpu_list(const std::string& list)
+	{
+		std::vector<int> cpus;
+		std::stringstream ranges(list);
+		std::string range;
+
+		while (std::getline(ranges, range, ','))
+		{
+			if (range.empty())
+				continue;
+
+			auto dash = range.find('-');
+			int first = std::stoi(range.substr(0, dash));
+			int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+			for (int cpu = first; cpu <= last; cpu++)
+				cpus.push_back(cpu);
+		}
+
+		return cpus;
+	}
+};
+
+// Restricts the calling thread to run only on the given logical CPU.
+// Returns false if the operating system refused (or pinning isn't supported here).
+inline bool pin_current_thread(int cpu)
+{
+#if defined(_WIN32)
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = WORD(cpu / 64);
+	affinity.Mask = KAFFINITY(1) << (cpu % 64);
+	return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)cpu;
+	return false;
+#endif
+}
+
+/// <summary>
+/// A fixed set of worker threads that stay alive between jobs.
+///
+/// When pinning is on and the machine has more than one NUMA node, each worker is locked to one CPU, and
+/// workers are handed out to the nodes in turn so that a pool smaller than the machine still uses every
+/// socket's memory bandwidth. With a single node there is no remote memory to avoid, so workers are left
+/// for the operating system to move around other programs.
+/// Both Windows and Linux place a page of memory on the node of the thread that first writes to it
+/// ("first touch"), so anything a pinned worker allocates and fills itself (tiles, samplers, scratch
+/// buffers) ends up in that worker's local memory. Jobs should therefore allocate their per-thread
+/// data inside the job rather than up front on the calling thread.
+///
+/// Several threads can run jobs on the same pool at once. Each worker takes the highest priority job it
+/// hasn't run yet, and a job can let a more urgent one jump in part way through by calling run_waiting at
+/// points where it is safe to pause (render_pass does between tiles). An interactive preview then only waits
+/// for the tiles already started, not for a whole batch render, to get every worker.
+/// </summary>
+class thread_pool
+{
+public:
+	// thread_count = 0 uses one worker per logical CPU
+	thread_pool(int thread_count = 0, bool pin_threads = false)
+	{
+		auto topology = cpu_topology::detect();
+		node_count = topology.node_count;
+
+		if (thread_count < 1)
+			thread_count = int(topology.cpus.size());
+
+		// Interleave the CPUs across nodes: node 0's first CPU, node 1's first CPU, node 0's second...
+		std::vector<int> order;
+		for (size_t rank = 0; order.size() < topology.cpus.size(); rank++)
+		{
+			for (int node = 0; node < node_count; node++)
+			{
+				size_t seen = 0;
+				for (size_t c = 0; c < topology.cpus.size(); c++)
+				{
+					if (topology.nodes[c] != node)
+						continue;
+					if (seen++ == rank)
+					{
+						order.push_back(int(c));
+						break;
+					}
+				}
+			}
+		}
+
+		for (int i = 0; i < thread_count; i++)
+		{
+			int c = order[i % order.size()];
+			worker_cpus.push_back(topology.cpus[c]);
+			worker_nodes.push_back(topology.nodes[c]);
+		}
+
+		worker_priorities.assign(size_t(thread_count), INT_MIN);
+		for (int i = 0; i < thread_count; i++)
+			workers.emplace_back(&thread_pool::worker_loop, this, i, pin_threads && node_count > 1);
+	}
+
+	~thread_pool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(pool_mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+
+		for (auto& worker : workers)
+			worker.join();
+	}
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	int size() const { return int(workers.size()); }
+	int numa_nodes() const { return node_count; }
+
+	// Runs job once on every worker and waits until they have all returned.
+	// job is passed the worker's index and the NUMA node it runs on.
+	// Jobs with a higher priority are run first, and can take workers from lower priority ones (see run_waiting).
+	void run(const std::function<void(int worker, int node)>& job, int priority = 0)
+	{
+		pool_job entry{ &job, priority, std::vector<bool>(workers.size(), false), int(workers.size()) };
+
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		jobs.push_back(&entry);
+		job_count++;
+		wake.notify_all();
+
+		finished.wait(lock, [&]() { return entry.remaining == 0; });
+
+		jobs.erase(std::find(jobs.begin(), jobs.end(), &entry));
+		job_count--;
+	}
+
+	// Called by a job on worker to run any jobs of a higher priority than its own that are waiting for
+	// that worker, before carrying on with its own work. Cheap when there's nothing waiting.
+	void run_waiting(int worker)
+	{
+		// Only the job calling this is running, so nothing can be waiting
+		if (job_count.load(std::memory_order_relaxed) < 2)
+			return;
+
+		while (true)
+		{
+			pool_job* job;
+			{
+				std::lock_guard<std::mutex> lock(pool_mutex);
+				job = next_job(worker, worker_priorities[worker]);
+				if (!job)
+					return;
+				job->taken[worker] = true;
+			}
+
+			execute(*job, worker);
+		}
+	}
+
+private:
+	/// <summary>
+	/// A job passed to run, and how far through the workers it has got.
+	/// </summary>
+	class pool_job
+	{
+	public:
+		const std::function<void(int, int)>* function;
+		int priority;
+		std::vector<bool> taken;	// Which workers have started it
+		int remaining;				// Workers that haven't finished it yet
+	};
+
+	std::vector<std::thread> workers;
+	std::vector<int> worker_cpus;
+	std::vector<int> worker_nodes;
+	// Priority of the job each worker is running (only ever touched by that worker)
+	std::vector<int> worker_priorities;
+	int node_count = 1;
+
+	std::mutex pool_mutex;
+	std::condition_variable wake;		// Signalled when a new job starts or the pool is stopping
+	std::condition_variable finished;	// Signalled when the last worker finishes a job
+	std::vector<pool_job*> jobs;		// Jobs passed to run that haven't finished, oldest first
+	std::atomic<int> job_count{ 0 };	// jobs.size(), readable without the lock
+	bool stopping = false;
+
+	// The highest priority job (the oldest of those) that worker hasn't run yet and whose priority is above
+	// above_priority, or null. Call with pool_mutex held.
+	pool_job* next_job(int worker, int above_priority) const
+	{
+		pool_job* best = nullptr;
+		for (auto job : jobs)
+			if (!job->taken[worker] && job->priority > above_priority && (!best || job->priority > best->priority))
+				best = job;
+
+		return best;
+	}
+
+	void execute(pool_job& job, int worker)
+	{
+		// Jobs can nest through run_waiting, so put back the priority of whichever job this interrupted
+		int outer_priority = worker_priorities[worker];
+		worker_priorities[worker] = job.priority;
+
+		(*job.function)(worker, worker_nodes[worker]);
+
+		worker_priorities[worker] = outer_priority;
+
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		if (--job.remaining == 0)
+			finished.notify_all();
+	}
+
+	void worker_loop(int index, bool pin)
+	{
+		if (pin)
+			pin_current_thread(worker_cpus[index]);
+
+		while (true)
+		{
+			pool_job* job = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(pool_mutex);
+				wake.wait(lock, [&]() { return stopping || (job = next_job(index, INT_MIN)) != nullptr; });
+				if (stopping)
+					return;
+
+				job->taken[index] = true;
+			}
+
+			execute(*job, index);
+		}
+	}
+};
+
+#endif
@@ -71,6 +71,13 @@ public:
 		// a^2 + b^2 + c^2 = ...d^2?
 		return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
 	}
+
+	// Returns true if the vector is close to zero in all dimensions.
+	bool near_zero() const
+	{
+		auto s = 1e-8;
+		return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
+	}
 };
 
 // point3 is just an alias for ve3, but useful for geometric clarity in the code.
@@ -157,4 +164,22 @@ inline vec3 unit_vector(const vec3& v)
 	return v / v.length();
 }
 
+// Mirror reflection of v about the (unit length) surface normal n.
+// dot(v, n) * n is the part of v going into the surface, so take it away twice to flip it.
+inline vec3 reflect(const vec3& v, const vec3& n)
+{
+	return v - 2 * dot(v, n) * n;
+}
+
+// Refraction of the unit vector uv through a surface with unit normal n (Snell's law).
+// etai_over_etat is the ratio of the refractive indices either side of the surface.
+inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat)
+{
+	auto cos_theta = std::fmin(dot(-uv, n), 1.0);
+	// split the refracted ray into the parts perpendicular and parallel to the normal
+	vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
+	vec3 r_out_parallel = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
+	return r_out_perp + r_out_parallel;
+}
+
 #endif
@@ -0,0 +1,386 @@
+#pragma once
+
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+/// <summary>
+/// Density values on a regular grid of voxels, stored sparsely: the grid is cut into bricks of 8x8x8 voxels
+/// and only bricks with something in them are kept, so memory grows with the occupied part of the volume
+/// rather than with its bounding box. Empty space (most of a typical cloud's box) costs one index per brick.
+///
+/// Each brick also has a majorant: the largest density anywhere it can affect a lookup. The majorants form a
+/// coarse grid that delta tracking walks through (see heterogeneous_medium), taking long steps through thin or
+/// empty bricks instead of being held to the densest voxel in the whole volume.
+/// </summary>
+class voxel_grid
+{
+public:
+	static const int brick_size = 8;
+
+	// Samples density at the centre of every voxel of a grid over bounds, resolution voxels along its longest
+	// side. Densities of 0 or less are empty space.
+	voxel_grid(const aabb& bounds, int resolution, const std::function<double(const point3&)>& density)
+		: bounds(bounds)
+	{
+		auto extent = bounds.maximum - bounds.minimum;
+		voxel_size = std::fmax(extent[bounds.longest_axis()], 1e-12) / resolution;
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			voxels[axis] = std::max(1, int(std::ceil(extent[axis] / voxel_size)));
+			bricks[axis] = (voxels[axis] + brick_size - 1) / brick_size;
+		}
+
+		brick_index.assign(size_t(bricks[0]) * bricks[1] * bricks[2], -1);
+		std::vector<float> values(brick_size * brick_size * brick_size);
+
+		for (int bz = 0; bz < bricks[2]; bz++)
+			for (int by = 0; by < bricks[1]; by++)
+				for (int bx = 0; bx < bricks[0]; bx++)
+				{
+					bool occupied = false;
+					size_t v = 0;
+					for (int z = 0; z < brick_size; z++)
+						for (int y = 0; y < brick_size; y++)
+							for (int x = 0; x < brick_size; x++)
+							{
+								auto p = bounds.minimum + voxel_size * vec3(bx * brick_size + x + 0.5,
+									by * brick_size + y + 0.5, bz * brick_size + z + 0.5);
+								values[v] = float(std::fmax(density(p), 0.0));
+								occupied = occupied || values[v] > 0;
+								v++;
+							}
+
+					if (occupied)
+					{
+						brick_index[brick_cell(bx, by, bz)] = int(brick_data.size() / values.size());
+						brick_data.insert(brick_data.end(), values.begin(), values.end());
+					}
+				}
+
+		brick_data.shrink_to_fit();
+		build_majorants();
+	}
+
+	// Density at p, interpolated between the voxel centres around it (0 outside the grid)
+	double density(const point3& p) const
+	{
+		double g[3];
+		int i[3];
+		double f[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			g[axis] = (p[axis] - bounds.minimum[axis]) / voxel_size - 0.5;
+			i[axis] = int(std::floor(g[axis]));
+			f[axis] = g[axis] - i[axis];
+		}
+
+		double result = 0;
+		for (int corner = 0; corner < 8; corner++)
+		{
+			int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+			double weight = (dx ? f[0] : 1 - f[0]) * (dy ? f[1] : 1 - f[1]) * (dz ? f[2] : 1 - f[2]);
+			if (weight > 0)
+				result += weight * voxel(i[0] + dx, i[1] + dy, i[2] + dz);
+		}
+
+		return result;
+	}
+
+	// The density of voxel (x, y, z), or 0 for one outside the grid or in an empty brick
+	double voxel(int x, int y, int z) const
+	{
+		if (x < 0 || y < 0 || z < 0 || x >= voxels[0] || y >= voxels[1] || z >= voxels[2])
+			return 0;
+
+		int brick = brick_index[brick_cell(x / brick_size, y / brick_size, z / brick_size)];
+		if (brick < 0)
+			return 0;
+
+		int local = ((z % brick_size) * brick_size + y % brick_size) * brick_size + x % brick_size;
+		return brick_data[size_t(brick) * brick_size * brick_size * brick_size + local];
+	}
+
+	const aabb& bounding_box() const { return bounds; }
+
+	// Size of a brick (a cell of the majorant grid) in world units, and the majorant grid's dimensions
+	double brick_width() const { return voxel_size * brick_size; }
+	int brick_count(int axis) const { return bricks[axis]; }
+
+	// Largest density any lookup inside brick (x, y, z) can return
+	double majorant(int x, int y, int z) const { return majorants[brick_cell(x, y, z)]; }
+
+	int occupied_bricks() const { return int(brick_data.size() / (brick_size * brick_size * brick_size)); }
+
+	// Memory taken by the grid, and what the same grid would take stored densely
+	size_t memory_size() const
+	{
+		return brick_data.capacity() * sizeof(float) + brick_index.capacity() * sizeof(int)
+			+ majorants.capacity() * sizeof(float);
+	}
+	size_t dense_memory_size() const { return size_t(voxels[0]) * voxels[1] * voxels[2] * sizeof(float); }
+
+private:
+	aabb bounds;
+	double voxel_size = 1;
+	int voxels[3] = { 1, 1, 1 };
+	int bricks[3] = { 1, 1, 1 };
+	std::vector<int> brick_index;			// Per brick, where its voxels start in brick_data (in bricks), or -1 if empty
+	std::vector<float> brick_data;			// The voxels of every occupied brick, one brick after another
+	std::vector<float> majorants;			// Per brick
+
+	size_t brick_cell(int x, int y, int z) const { return (size_t(z) * bricks[1] + y) * bricks[0] + x; }
+
+	// A lookup in a brick interpolates voxels up to one outside it, so each majorant covers those too
+	void build_majorants()
+	{
+		majorants.assign(brick_index.size(), 0);
+
+		for (int bz = 0; bz < bricks[2]; bz++)
+			for (int by = 0; by < bricks[1]; by++)
+				for (int bx = 0; bx < bricks[0]; bx++)
+				{
+					// Skip the search for a brick with no occupied bricks around it
+					bool near_anything = false;
+					for (int nz = std::max(bz - 1, 0); nz <= std::min(bz + 1, bricks[2] - 1); nz++)
+						for (int ny = std::max(by - 1, 0); ny <= std::min(by + 1, bricks[1] - 1); ny++)
+							for (int nx = std::max(bx - 1, 0); nx <= std::min(bx + 1, bricks[0] - 1); nx++)
+								near_anything = near_anything || brick_index[brick_cell(nx, ny, nz)] >= 0;
+					if (!near_anything)
+						continue;
+
+					double largest = 0;
+					for (int z = bz * brick_size - 1; z <= (bz + 1) * brick_size; z++)
+						for (int y = by * brick_size - 1; y <= (by + 1) * brick_size; y++)
+							for (int x = bx * brick_size - 1; x <= (bx + 1) * brick_size; x++)
+								largest = std::fmax(largest, voxel(x, y, z));
+
+					majorants[brick_cell(bx, by, bz)] = float(largest);
+				}
+	}
+};
+
+/// <summary>
+/// Smoke, cloud or other participating medium whose density varies through space, given by a voxel_grid.
+///
+/// Like RTIOW's constant density medium, it is a hittable whose "hits" are the points where a ray collides with
+/// a particle, scattered by an isotropic material, so the rest of the renderer needs to know nothing about it.
+/// Collisions are found by delta tracking: tentative collisions are placed at the rate of the local majorant
+/// and each is accepted with probability density / majorant, which gives exactly the right distribution
+/// without ever integrating the density. The ray walks the majorant grid brick by brick, so empty bricks are
+/// skipped outright and thin ones take few steps.
+/// </summary>
+class heterogeneous_medium : public hittable
+{
+public:
+	// sigma is the extinction coefficient (per unit length) where the grid's density is 1.
+	// albedo is the fraction of light a collision scatters rather than absorbs.
+	heterogeneous_medium(shared_ptr<voxel_grid> grid, double sigma, const color& albedo)
+		: grid(grid), sigma(sigma), phase_function(make_shared<isotropic>(albedo)) {}
+
+	bool hit(const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const override
+	{
+		double t;
+		if (!track(r, ray_tmin, ray_tmax, t, [](double) { return random_double(); }))
+			return false;
+
+		rec.t = t;
+		rec.p = r.at(t);
+		rec.normal = vec3(0, 0, 0);		// no surface here: the isotropic material ignores it
+		rec.front_face = true;
+		rec.mat = phase_function.get();
+		return true;
+	}
+
+	// A shadow ray is blocked with probability 1 - transmittance, which is estimated with ratio tracking
+	// (less noisy than asking delta tracking for a yes or no)
+	bool occluded(const ray& r, double ray_tmin, double ray_tmax) const override
+	{
+		return random_double() >= transmittance(r, ray_tmin, ray_tmax);
+	}
+
+	aabb bounding_box() const override { return grid->bounding_box(); }
+
+	// Unbiased estimate of the fraction of light that gets through the medium between ray_tmin and ray_tmax.
+	// Ratio tracking: the same tentative collisions as delta tracking, but instead of stopping at one it
+	// multiplies in the chance of passing each (1 - density / majorant).
+	double transmittance(const ray& r, double ray_tmin, double ray_tmax) const
+	{
+		double result = 1;
+		double t;
+		track(r, ray_tmin, ray_tmax, t, [&](double chance_of_collision)
+		{
+			result *= 1 - chance_of_collision;
+			// Once hardly anything gets through, stop (Russian roulette keeps it unbiased)
+			if (result < 0.1)
+			{
+				if (random_double() < 0.5)
+					result = 0;
+				else
+					result *= 2;
+			}
+
+			// Returning 2 never accepts, so tracking goes on to the end of the ray unless result reached 0
+			return result > 0 ? 2.0 : 0.0;
+		});
+
+		return result;
+	}
+
+private:
+	shared_ptr<voxel_grid> grid;
+	double sigma;
+	shared_ptr<material> phase_function;
+
+	// Walks the majorant grid along the ray placing tentative collisions. At each one, decide is called with
+	// density / majorant there; a collision is accepted if what it returns is below that. Returns whether one
+	// was, with its t in collision_t.
+	template <typename decider>
+	bool track(const ray& r, double ray_tmin, double ray_tmax, double& collision_t, const decider& decide) const
+	{
+		const auto& box = grid->bounding_box();
+
+		// Clip the ray to the grid's box
+		double t_enter = ray_tmin, t_exit = ray_tmax;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			double inv_direction = 1 / r.direction()[axis];
+			double t0 = (box.minimum[axis] - r.origin()[axis]) * inv_direction;
+			double t1 = (box.maximum[axis] - r.origin()[axis]) * inv_direction;
+			if (inv_direction < 0)
+				std::swap(t0, t1);
+			t_enter = std::fmax(t_enter, t0);
+			t_exit = std::fmin(t_exit, t1);
+		}
+		if (t_exit <= t_enter)
+			return false;
+
+		// 3D DDA through the bricks (Amanatides and Woo), in units of bricks
+		double width = grid->brick_width();
+		double length = r.direction().length();
+		auto start = (r.at(t_enter) - box.minimum) / width;
+
+		int cell[3], step[3];
+		double t_next[3], t_delta[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			double direction = r.direction()[axis] / width;
+			cell[axis] = std::clamp(int(std::floor(start[axis])), 0, grid->brick_count(axis) - 1);
+			step[axis] = direction > 0 ? 1 : -1;
+
+			if (direction != 0)
+			{
+				double boundary = cell[axis] + (direction > 0 ? 1 : 0);
+				t_next[axis] = t_enter + (boundary - start[axis]) / direction;
+				t_delta[axis] = std::fabs(1 / direction);
+			}
+			else
+			{
+				t_next[axis] = infinity;
+				t_delta[axis] = infinity;
+			}
+		}
+
+		double t = t_enter;
+		while (t < t_exit)
+		{
+			int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+			double cell_exit = std::fmax(std::fmin(t_next[axis], t_exit), t);
+
+			double majorant = grid->majorant(cell[0], cell[1], cell[2]);
+			if (majorant > 0)
+			{
+				// Collisions at the majorant's rate: exponential steps along the ray (in t, so scaled by its length)
+				double rate = majorant * sigma * length;
+				while (true)
+				{
+					t -= std::log(1 - random_double()) / rate;
+					if (t >= cell_exit)
+						break;
+
+					double chance = grid->density(r.at(t)) / majorant;
+					if (decide(chance) < chance)
+					{
+						collision_t = t;
+						return true;
+					}
+				}
+			}
+
+			// Free flight starts afresh at the brick boundary (it has no memory), with the next brick's majorant
+			t = cell_exit;
+			cell[axis] += step[axis];
+			t_next[axis] += t_delta[axis];
+			if (cell[axis] < 0 || cell[axis] >= grid->brick_count(axis))
+				break;
+		}
+
+		return false;
+	}
+};
+
+// Fractal value noise: a few octaves of smoothly interpolated random lattice values, each half the size and
+// strength of the last. Returns values roughly in [-1, 1].
+inline double fractal_noise(const point3& p, int octaves = 4)
+{
+	auto lattice = [](int x, int y, int z)
+	{
+		uint32_t h = uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u ^ uint32_t(z) * 83492791u;
+		h ^= h >> 13;
+		h *= 0x5bd1e995u;
+		h ^= h >> 15;
+		return double(h & 0xffffff) / double(0x7fffff) - 1;
+	};
+
+	double result = 0, amplitude = 0.5, scale = 1;
+	for (int octave = 0; octave < octaves; octave++)
+	{
+		auto q = p * scale;
+		int x = int(std::floor(q.x())), y = int(std::floor(q.y())), z = int(std::floor(q.z()));
+		double fx = q.x() - x, fy = q.y() - y, fz = q.z() - z;
+		// smoothstep, so the noise has no creases along the lattice
+		fx = fx * fx * (3 - 2 * fx);
+		fy = fy * fy * (3 - 2 * fy);
+		fz = fz * fz * (3 - 2 * fz);
+
+		double value = 0;
+		for (int corner = 0; corner < 8; corner++)
+		{
+			int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+			value += (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy) * (dz ? fz : 1 - fz) * lattice(x + dx, y + dy, z + dz);
+		}
+
+		result += amplitude * value;
+		amplitude /= 2;
+		scale *= 2;
+	}
+
+	return result;
+}
+
+// A billowing cloud filling roughly a sphere: density 1 in its core, fading to nothing at radius with
+// noise eating into the edge
+inline shared_ptr<voxel_grid> make_cloud(const point3& centre, double radius, int resolution)
+{
+	auto size = vec3(radius, radius, radius);
+	return make_shared<voxel_grid>(aabb(centre - size, centre + size), resolution, [&](const point3& p)
+	{
+		double falloff = 1 - (p - centre).length() / radius;
+		double noise = fractal_noise((p - centre) * (4 / radius));
+		return std::fmin(1.0, 3 * (falloff + 0.6 * noise) - 0.3);
+	});
+}
+
+#endif
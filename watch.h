@@ -0,0 +1,211 @@
+#pragma once
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "film.h"
+#include "hittable_list.h"
+#include "scene.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/// <summary>
+/// A scene that is expected to be replaced by edited versions of itself.
+/// Passing each new version through update parses only the statements that changed, and updates the BVH
+/// in place when the edit just changed existing objects (rather than adding or removing some),
+/// so an update costs little more than the edit itself.
+/// </summary>
+class live_scene
+{
+public:
+	// Replaces the scene with the one described by text.
+	// Throws scene_error, leaving the scene as it was, if text isn't a valid scene.
+	void update(std::string_view text)
+	{
+		auto start = std::chrono::steady_clock::now();
+
+		scene next = parse_scene(text, &cache);
+
+		// Objects whose lines didn't change are the same objects as last time
+		std::unordered_set<const hittable*> old_objects;
+		for (const auto& object : current.objects.objects)
+			old_objects.insert(object.get());
+
+		std::unordered_set<const hittable*> new_objects;
+		std::vector<shared_ptr<hittable>> added;
+		for (const auto& object : next.objects.objects)
+		{
+			new_objects.insert(object.get());
+			if (old_objects.count(object.get()) == 0)
+				added.push_back(object);
+		}
+
+		std::vector<const hittable*> removed;
+		for (const auto& object : current.objects.objects)
+			if (new_objects.count(object.get()) == 0)
+				removed.push_back(object.get());
+
+		const char* update_kind = "unchanged";
+		if (!tree || removed.size() != added.size())
+		{
+			// Objects were added or removed, so the tree has to be built again
+			tree = make_shared<bvh>(next.objects);
+			update_kind = "rebuilt";
+		}
+		else if (!added.empty())
+		{
+			// The same number of objects changed as were replaced, so pair them up in file order
+			// (an edited line stands in for the old version of itself)
+			std::unordered_map<const hittable*, shared_ptr<hittable>> replacements;
+			for (size_t i = 0; i < added.size(); i++)
+				replacements[removed[i]] = added[i];
+
+			tree->update(replacements);
+			update_kind = "updated";
+		}
+
+		current = next;
+		world_list.clear();
+		if (!current.objects.objects.empty())
+			world_list.add(tree);
+
+		auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		std::clog << "\nScene loaded: " << added.size() << " new objects, " << removed.size()
+			<< " old ones gone, BVH " << update_kind << " (" << ms << " ms)\n";
+	}
+
+	const camera& scene_camera() const { return current.cam; }
+	// The camera can be changed freely without touching the objects
+	camera& scene_camera() { return current.cam; }
+	const hittable& world() const { return world_list; }
+
+private:
+	scene current;
+	scene_object_cache cache;
+	shared_ptr<bvh> tree;
+	hittable_list world_list;
+};
+
+/// <summary>
+/// Keeps a live_scene in step with its file.
+/// </summary>
+class scene_watcher
+{
+public:
+	// Loads the scene. Throws scene_error if the first load fails.
+	scene_watcher(const std::string& path) : path(path)
+	{
+		last_write = modified_time();
+		reload();
+	}
+
+	// Reloads the scene if the file has been saved since the last check. Returns true if it was reloaded.
+	// A scene with an error is reported and ignored, keeping the last good one.
+	bool poll()
+	{
+		auto modified = modified_time();
+		if (modified == last_write)
+			return false;
+		last_write = modified;
+
+		try
+		{
+			reload();
+		}
+		catch (const scene_error& error)
+		{
+			std::clog << "\nScene not reloaded: " << error.what() << '\n';
+			return false;
+		}
+
+		return true;
+	}
+
+	const camera& scene_camera() const { return live.scene_camera(); }
+	const hittable& world() const { return live.world(); }
+
+private:
+	std::string path;
+	std::filesystem::file_time_type last_write;
+	live_scene live;
+
+	std::filesystem::file_time_type modified_time() const
+	{
+		// editors often delete and re-create the file when saving, so it can briefly be missing
+		std::error_code error;
+		auto time = std::filesystem::last_write_time(path, error);
+		return error ? last_write : time;
+	}
+
+	void reload()
+	{
+		auto text = read_text_file(path);
+
+		try
+		{
+			live.update(text);
+		}
+		catch (const scene_error& error)
+		{
+			throw scene_error(path + ", " + error.what());
+		}
+	}
+};
+
+// Renders the scene progressively, writing the image to output_path after every pass, and starts the
+// render again whenever the scene file is saved. Runs until the program is closed.
+inline void watch_and_render(const std::string& scene_path, const std::string& output_path)
+{
+	scene_watcher watcher(scene_path);
+
+	// Threads are created once and kept, rather than for every restart
+	const auto& first = watcher.scene_camera();
+	thread_pool pool(first.thread_count, first.pin_threads);
+
+	while (true)
+	{
+		camera cam = watcher.scene_camera();
+		cam.initialize();
+		film image = cam.make_film();
+
+		bool restart = false;
+		for (int samples = 0; !restart; )
+		{
+			if (samples < cam.samples_per_pixel)
+			{
+				// One sample per pixel per pass keeps the time between checks for changes short
+				cam.render_pass(watcher.world(), image, pool, 1);
+				samples++;
+
+				std::ofstream imageOut(output_path);
+				image.write_ppm(imageOut);
+
+				std::clog << "\rSamples per pixel: " << samples << ' ' << std::flush;
+			}
+			else
+			{
+				// Finished: just wait for the next change
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			}
+
+			restart = watcher.poll();
+		}
+	}
+}
+
+#endif